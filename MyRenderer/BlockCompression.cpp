@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <cmath>
+#include "BlockCompression.h"
+
+int getBlockChannels(TextureCompression compression)
+{
+    switch (compression)
+    {
+    case TEXTURE_COMPRESSION_BC1:
+        return 3;
+    case TEXTURE_COMPRESSION_BC4:
+        return 1;
+    case TEXTURE_COMPRESSION_BC5:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static float saturate(float f)
+{
+    return std::min(std::max(f, 0.0f), 1.0f);
+}
+
+//---------------------------------------------------------------------
+// BC1
+//---------------------------------------------------------------------
+
+static uint16_t packColor565(const float c[3])
+{
+    uint16_t r = (uint16_t)(saturate(c[0]) * 31.0f + 0.5f);
+    uint16_t g = (uint16_t)(saturate(c[1]) * 63.0f + 0.5f);
+    uint16_t b = (uint16_t)(saturate(c[2]) * 31.0f + 0.5f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void unpackColor565(uint16_t packed, float c[3])
+{
+    c[0] = (float)((packed >> 11) & 31) / 31.0f;
+    c[1] = (float)((packed >> 5) & 63) / 63.0f;
+    c[2] = (float)(packed & 31) / 31.0f;
+}
+
+// the 4 colors indices of a block refer to
+static void getBC1Palette(uint16_t color0, uint16_t color1, float palette[4][3])
+{
+    unpackColor565(color0, palette[0]);
+    unpackColor565(color1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+    {
+        if (color0 > color1)
+        {
+            palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+            palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+        }
+        else
+        {
+            // 3 colors and black
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2.0f;
+            palette[3][c] = 0.0f;
+        }
+    }
+}
+
+static void encodeBC1(const float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS], uint8_t* block)
+{
+    int i, c;
+    // endpoints are the extremes of the texels along their principal axis
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        for (c = 0; c < 3; ++c)
+        {
+            mean[c] += saturate(texels[i][c]) / (float)BLOCK_COMPRESSION_TEXEL_COUNT;
+        }
+    }
+    float covariance[3][3] = {};
+    for (i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        float d[3] = { saturate(texels[i][0]) - mean[0], saturate(texels[i][1]) - mean[1], saturate(texels[i][2]) - mean[2] };
+        for (int r = 0; r < 3; ++r)
+        {
+            for (c = 0; c < 3; ++c)
+            {
+                covariance[r][c] += d[r] * d[c];
+            }
+        }
+    }
+    // power iteration
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int iteration = 0; iteration < 8; ++iteration)
+    {
+        float next[3];
+        for (int r = 0; r < 3; ++r)
+        {
+            next[r] = covariance[r][0] * axis[0] + covariance[r][1] * axis[1] + covariance[r][2] * axis[2];
+        }
+        float length = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+        if (length < 1e-12f)
+        {
+            break;
+        }
+        for (c = 0; c < 3; ++c)
+        {
+            axis[c] = next[c] / length;
+        }
+    }
+    float tMin = 0.0f;
+    float tMax = 0.0f;
+    for (i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        float t = 0.0f;
+        for (c = 0; c < 3; ++c)
+        {
+            t += (saturate(texels[i][c]) - mean[c]) * axis[c];
+        }
+        tMin = std::min(tMin, t);
+        tMax = std::max(tMax, t);
+    }
+    float end0[3], end1[3];
+    for (c = 0; c < 3; ++c)
+    {
+        end0[c] = mean[c] + axis[c] * tMax;
+        end1[c] = mean[c] + axis[c] * tMin;
+    }
+    uint16_t color0 = packColor565(end0);
+    uint16_t color1 = packColor565(end1);
+    // color0 > color1 selects 4 colors
+    if (color0 < color1)
+    {
+        std::swap(color0, color1);
+    }
+    float palette[4][3];
+    getBC1Palette(color0, color1, palette);
+    // equal endpoints would select 3 colors and black, only palette[0] is used then
+    int paletteSize = color0 == color1 ? 1 : 4;
+    uint32_t indices = 0;
+    for (i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        int best = 0;
+        float bestDistance = 1e30f;
+        for (int p = 0; p < paletteSize; ++p)
+        {
+            float distance = 0.0f;
+            for (c = 0; c < 3; ++c)
+            {
+                float d = saturate(texels[i][c]) - palette[p][c];
+                distance += d * d;
+            }
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = p;
+            }
+        }
+        indices |= (uint32_t)best << (i * 2);
+    }
+    block[0] = (uint8_t)(color0 & 0xff);
+    block[1] = (uint8_t)(color0 >> 8);
+    block[2] = (uint8_t)(color1 & 0xff);
+    block[3] = (uint8_t)(color1 >> 8);
+    for (i = 0; i < 4; ++i)
+    {
+        block[4 + i] = (uint8_t)(indices >> (i * 8));
+    }
+}
+
+static void decodeBC1(const uint8_t* block, float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS])
+{
+    uint16_t color0 = (uint16_t)(block[0] | (block[1] << 8));
+    uint16_t color1 = (uint16_t)(block[2] | (block[3] << 8));
+    uint32_t indices = (uint32_t)block[4] | ((uint32_t)block[5] << 8) | ((uint32_t)block[6] << 16) | ((uint32_t)block[7] << 24);
+    float palette[4][3];
+    getBC1Palette(color0, color1, palette);
+    for (int i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        const float* color = palette[(indices >> (i * 2)) & 3];
+        texels[i][0] = color[0];
+        texels[i][1] = color[1];
+        texels[i][2] = color[2];
+        texels[i][3] = 0.0f;
+    }
+}
+
+//---------------------------------------------------------------------
+// BC4, one channel of the texels
+//---------------------------------------------------------------------
+
+// the 8 values indices of a block refer to
+static void getBC4Palette(uint8_t end0, uint8_t end1, float palette[8])
+{
+    palette[0] = (float)end0 / 255.0f;
+    palette[1] = (float)end1 / 255.0f;
+    if (end0 > end1)
+    {
+        for (int i = 2; i < 8; ++i)
+        {
+            palette[i] = ((float)(8 - i) * palette[0] + (float)(i - 1) * palette[1]) / 7.0f;
+        }
+    }
+    else
+    {
+        // 6 values, 0.0 and 1.0
+        for (int i = 2; i < 6; ++i)
+        {
+            palette[i] = ((float)(6 - i) * palette[0] + (float)(i - 1) * palette[1]) / 5.0f;
+        }
+        palette[6] = 0.0f;
+        palette[7] = 1.0f;
+    }
+}
+
+static void encodeBC4(const float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS], int channel, uint8_t* block)
+{
+    int i;
+    float vMin = 1.0f;
+    float vMax = 0.0f;
+    for (i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        vMin = std::min(vMin, saturate(texels[i][channel]));
+        vMax = std::max(vMax, saturate(texels[i][channel]));
+    }
+    // end0 > end1 selects 8 values
+    uint8_t end0 = (uint8_t)(vMax * 255.0f + 0.5f);
+    uint8_t end1 = (uint8_t)(vMin * 255.0f + 0.5f);
+    float palette[8];
+    getBC4Palette(end0, end1, palette);
+    // equal endpoints would select 6 values, only palette[0] is used then
+    int paletteSize = end0 == end1 ? 1 : 8;
+    uint64_t indices = 0;
+    for (i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        int best = 0;
+        float bestDistance = 1e30f;
+        for (int p = 0; p < paletteSize; ++p)
+        {
+            float distance = std::abs(saturate(texels[i][channel]) - palette[p]);
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = p;
+            }
+        }
+        indices |= (uint64_t)best << (i * 3);
+    }
+    block[0] = end0;
+    block[1] = end1;
+    for (i = 0; i < 6; ++i)
+    {
+        block[2 + i] = (uint8_t)(indices >> (i * 8));
+    }
+}
+
+static void decodeBC4(const uint8_t* block, int channel, float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS])
+{
+    float palette[8];
+    getBC4Palette(block[0], block[1], palette);
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; ++i)
+    {
+        indices |= (uint64_t)block[2 + i] << (i * 8);
+    }
+    for (int i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        texels[i][channel] = palette[(indices >> (i * 3)) & 7];
+    }
+}
+
+//---------------------------------------------------------------------
+// blocks of any format
+//---------------------------------------------------------------------
+
+void encodeBlock(TextureCompression compression, const float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS], uint8_t* block)
+{
+    switch (compression)
+    {
+    case TEXTURE_COMPRESSION_BC1:
+        encodeBC1(texels, block);
+        break;
+    case TEXTURE_COMPRESSION_BC4:
+        encodeBC4(texels, 0, block);
+        break;
+    case TEXTURE_COMPRESSION_BC5:
+        encodeBC4(texels, 0, block);
+        encodeBC4(texels, 1, block + 8);
+        break;
+    default:
+        break;
+    }
+}
+
+void decodeBlock(TextureCompression compression, const uint8_t* block, float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS])
+{
+    for (int i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+    {
+        for (int c = 0; c < BLOCK_COMPRESSION_MAX_CHANNELS; ++c)
+        {
+            texels[i][c] = 0.0f;
+        }
+    }
+    switch (compression)
+    {
+    case TEXTURE_COMPRESSION_BC1:
+        decodeBC1(block, texels);
+        break;
+    case TEXTURE_COMPRESSION_BC4:
+        decodeBC4(block, 0, texels);
+        break;
+    case TEXTURE_COMPRESSION_BC5:
+        decodeBC4(block, 0, texels);
+        decodeBC4(block + 8, 1, texels);
+        break;
+    default:
+        break;
+    }
+}
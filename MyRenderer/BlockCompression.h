@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// block compressed formats, every block is 4x4 texels
+enum TextureCompression
+{
+    TEXTURE_COMPRESSION_NONE,
+    // 3 channels, 2 565 endpoints and 16 2 bit indices, 8 bytes per block
+    TEXTURE_COMPRESSION_BC1,
+    // 1 channel, 2 8 bit endpoints and 16 3 bit indices, 8 bytes per block
+    TEXTURE_COMPRESSION_BC4,
+    // 2 channels, a BC4 block for each, 16 bytes per block
+    TEXTURE_COMPRESSION_BC5,
+};
+
+constexpr int BLOCK_COMPRESSION_BLOCK_SIZE = 4;
+constexpr int BLOCK_COMPRESSION_TEXEL_COUNT = 16;
+// max channels of a texel, unused channels of a block are 0
+constexpr int BLOCK_COMPRESSION_MAX_CHANNELS = 4;
+
+// bytes of a block, 0 if not compressed
+inline size_t getBlockBytes(TextureCompression compression)
+{
+    switch (compression)
+    {
+    case TEXTURE_COMPRESSION_BC1:
+    case TEXTURE_COMPRESSION_BC4:
+        return 8;
+    case TEXTURE_COMPRESSION_BC5:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+// count of channels stored in the blocks
+int getBlockChannels(TextureCompression compression);
+
+// texels are in row order, channel values are clamped to [0.0, 1.0]
+void encodeBlock(TextureCompression compression, const float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS], uint8_t* block);
+
+void decodeBlock(TextureCompression compression, const uint8_t* block, float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS]);
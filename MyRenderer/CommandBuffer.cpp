@@ -0,0 +1,239 @@
+#include <algorithm>
+#include "CommandBuffer.h"
+#include "Pipeline.h"
+
+void CommandBuffer::begin()
+{
+    commands.clear();
+    states.clear();
+    shaders.clear();
+    vertexBuffers.clear();
+    indexBuffers.clear();
+    uniforms.clear();
+    drawTransforms.clear();
+    clears.clear();
+    presents.clear();
+    valid = false;
+    error.clear();
+}
+
+void CommandBuffer::record(CommandType type, int argument)
+{
+    Command command = { type, argument };
+    commands.push_back(command);
+    valid = false;
+}
+
+void CommandBuffer::setPipelineState(const PipelineState& state)
+{
+    states.push_back(state);
+    record(COMMAND_TYPE_SET_PIPELINE_STATE, (int)states.size() - 1);
+}
+
+void CommandBuffer::setShaders(VertexShader* pVS, PixelShader* pPS)
+{
+    shaders.push_back(std::make_pair(pVS, pPS));
+    record(COMMAND_TYPE_SET_SHADERS, (int)shaders.size() - 1);
+}
+
+void CommandBuffer::setVertexBuffer(const VertexBufferView& view)
+{
+    vertexBuffers.push_back(view);
+    record(COMMAND_TYPE_SET_VERTEX_BUFFER, (int)vertexBuffers.size() - 1);
+}
+
+void CommandBuffer::setIndexBuffer(const IndexBufferView& view)
+{
+    indexBuffers.push_back(view);
+    record(COMMAND_TYPE_SET_INDEX_BUFFER, (int)indexBuffers.size() - 1);
+}
+
+void CommandBuffer::setInstanceBuffer(const VertexBufferView& view)
+{
+    vertexBuffers.push_back(view);
+    record(COMMAND_TYPE_SET_INSTANCE_BUFFER, (int)vertexBuffers.size() - 1);
+}
+
+void CommandBuffer::setUniforms(const std::shared_ptr<const ShaderUniform>& uniforms)
+{
+    this->uniforms.push_back(uniforms);
+    record(COMMAND_TYPE_SET_UNIFORMS, (int)this->uniforms.size() - 1);
+}
+
+void CommandBuffer::setDrawTransform(const Mat4x4f& transform)
+{
+    drawTransforms.push_back(transform);
+    record(COMMAND_TYPE_SET_DRAW_TRANSFORM, (int)drawTransforms.size() - 1);
+}
+
+void CommandBuffer::clearRenderTarget(Vec3f color, float depth)
+{
+    ClearValues values = { color, depth };
+    clears.push_back(values);
+    record(COMMAND_TYPE_CLEAR, (int)clears.size() - 1);
+}
+
+void CommandBuffer::draw()
+{
+    record(COMMAND_TYPE_DRAW, 0);
+}
+
+void CommandBuffer::drawInstanced(int instanceCount)
+{
+    record(COMMAND_TYPE_DRAW, instanceCount);
+}
+
+void CommandBuffer::present(uint8_t* buffer, const FrameOutputOptions& options)
+{
+    PresentTarget target = { buffer, options };
+    presents.push_back(target);
+    record(COMMAND_TYPE_PRESENT, (int)presents.size() - 1);
+}
+
+bool CommandBuffer::checkInstanceBuffer(const VertexBufferView& vertices, int instanceBufferIndex, int instanceCount)
+{
+    if (instanceBufferIndex < 0)
+    {
+        error = "instanced draw without an instance buffer";
+        return false;
+    }
+    const VertexBufferView& instances = vertexBuffers[instanceBufferIndex];
+    if (instances.count < instanceCount || instances.layout == nullptr || instances.data == nullptr)
+    {
+        error = "instance buffer without layout or data, or with too few instances";
+        return false;
+    }
+    if (vertices.layout == nullptr)
+    {
+        return true;
+    }
+    // the vertex shader reads the values of both buffers and SV_InstanceID in one layout
+    if (vertices.layout->floatCount() + instances.layout->floatCount() + 1 > SHADER_CONTEXT_MAX_FLOATS)
+    {
+        error = "too many floats in the vertex and the instance layouts";
+        return false;
+    }
+    for (int key = VARYING_KEY_MIN; key <= VARYING_KEY_MAX; ++key)
+    {
+        if (instances.layout->has(key) && (key == SV_InstanceID || vertices.layout->has(key)))
+        {
+            error = "instance layout sharing keys with the vertex layout or SV_InstanceID";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CommandBuffer::end()
+{
+    // the bindings as the commands run, indices of the arguments or -1 if not recorded yet
+    int shaderIndex = -1;
+    int vertexBufferIndex = -1;
+    int indexBufferIndex = -1;
+    int instanceBufferIndex = -1;
+    // indices of index buffers already checked against the vertex buffer they are drawn with
+    std::vector<std::pair<int, int>> checkedPairs;
+    error.clear();
+    for (size_t i = 0; i < commands.size() && error.empty(); ++i)
+    {
+        const Command& command = commands[i];
+        switch (command.type)
+        {
+        case COMMAND_TYPE_SET_PIPELINE_STATE:
+        {
+            const PipelineState& state = states[command.argument];
+            if (state.width <= 0 || state.height <= 0)
+            {
+                error = "the render target is empty";
+            }
+            else if (state.msCount < 1 || state.msCount > PIPELINE_MAX_MS_COUNT || (int)state.sampleCoords.size() < state.msCount)
+            {
+                error = "bad msaa sample count or sample coords";
+            }
+            break;
+        }
+        case COMMAND_TYPE_SET_SHADERS:
+            if (shaders[command.argument].first == nullptr || shaders[command.argument].second == nullptr)
+            {
+                error = "null shader";
+            }
+            shaderIndex = command.argument;
+            break;
+        case COMMAND_TYPE_SET_VERTEX_BUFFER:
+            vertexBufferIndex = command.argument;
+            break;
+        case COMMAND_TYPE_SET_INDEX_BUFFER:
+            indexBufferIndex = command.argument;
+            break;
+        case COMMAND_TYPE_SET_INSTANCE_BUFFER:
+            instanceBufferIndex = command.argument;
+            break;
+        case COMMAND_TYPE_SET_UNIFORMS:
+            if (!uniforms[command.argument])
+            {
+                error = "null uniforms";
+            }
+            break;
+        case COMMAND_TYPE_DRAW:
+        {
+            if (shaderIndex < 0 || vertexBufferIndex < 0 || indexBufferIndex < 0)
+            {
+                error = "draw without shaders, a vertex buffer or an index buffer";
+                break;
+            }
+            const VertexBufferView& vertices = vertexBuffers[vertexBufferIndex];
+            const IndexBufferView& indices = indexBuffers[indexBufferIndex];
+            if (vertices.count > 0 && (vertices.layout == nullptr || vertices.data == nullptr))
+            {
+                error = "vertex buffer without layout or data";
+                break;
+            }
+            if (vertices.count > 0 && !vertices.layout->has(SV_Position))
+            {
+                error = "vertex buffer without SV_Position";
+                break;
+            }
+            if (indices.count > 0 && indices.data == nullptr)
+            {
+                error = "index buffer without data";
+                break;
+            }
+            if (command.argument < 0)
+            {
+                error = "negative instance count";
+                break;
+            }
+            if (command.argument > 0 && !checkInstanceBuffer(vertices, instanceBufferIndex, command.argument))
+            {
+                break;
+            }
+            // every index must refer to a vertex, a pair of buffers is scanned once
+            std::pair<int, int> pair(vertexBufferIndex, indexBufferIndex);
+            if (std::find(checkedPairs.begin(), checkedPairs.end(), pair) != checkedPairs.end())
+            {
+                break;
+            }
+            checkedPairs.push_back(pair);
+            for (int j = 0; j < indices.count; ++j)
+            {
+                if (indices.data[j] < 0 || indices.data[j] >= vertices.count)
+                {
+                    error = "index out of the vertex buffer";
+                    break;
+                }
+            }
+            break;
+        }
+        case COMMAND_TYPE_PRESENT:
+            if (presents[command.argument].buffer == nullptr)
+            {
+                error = "present to null";
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    valid = error.empty();
+    return valid;
+}
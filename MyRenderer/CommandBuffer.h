@@ -0,0 +1,115 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "FrameOutput.h"
+#include "Shader.h"
+
+enum CommandType
+{
+    COMMAND_TYPE_SET_PIPELINE_STATE,
+    COMMAND_TYPE_SET_SHADERS,
+    COMMAND_TYPE_SET_VERTEX_BUFFER,
+    COMMAND_TYPE_SET_INDEX_BUFFER,
+    COMMAND_TYPE_SET_INSTANCE_BUFFER,
+    COMMAND_TYPE_SET_UNIFORMS,
+    COMMAND_TYPE_SET_DRAW_TRANSFORM,
+    COMMAND_TYPE_CLEAR,
+    COMMAND_TYPE_DRAW,
+    COMMAND_TYPE_PRESENT,
+};
+
+/*
+* class CommandBuffer
+* draws, binding changes, clears and presents recorded once and run by Pipeline::submit() in order
+* usage :
+* 1. call begin(), record the commands, call end() to validate them
+* 2. submit the buffer every frame, it can be submitted as long as the bound buffers, shaders and present targets live
+* 3. call begin() again to record other commands
+* bindings not recorded are the ones the pipeline has when the buffer is submitted, except that every draw
+* must be preceded by shaders, a vertex buffer and an index buffer in the same command buffer, and every instanced
+* draw by an instance buffer too
+*/
+class CommandBuffer
+{
+public:
+    // drop all the commands
+    void begin();
+
+    // validate the commands, returns false if any of them can't run, see getError()
+    bool end();
+
+    // true if end() succeeded and nothing is recorded after it
+    bool isValid() const { return valid; }
+
+    const std::string& getError() const { return error; }
+
+    void setPipelineState(const PipelineState& state);
+
+    void setShaders(VertexShader* pVS, PixelShader* pPS);
+
+    void setVertexBuffer(const VertexBufferView& view);
+
+    void setIndexBuffer(const IndexBufferView& view);
+
+    // per instance values of the instanced draws after it, as Pipeline::setInstanceBuffer()
+    void setInstanceBuffer(const VertexBufferView& view);
+
+    void setUniforms(const std::shared_ptr<const ShaderUniform>& uniforms);
+
+    // the transform of the objects drawn after it, as Pipeline::setDrawTransform()
+    void setDrawTransform(const Mat4x4f& transform);
+
+    void clearRenderTarget(Vec3f color, float depth);
+
+    // draw the bound buffers with the bound shaders and uniforms
+    void draw();
+
+    // draw the bound buffers instanceCount times, as Pipeline::renderToTargetInstanced()
+    // an instance buffer of at least instanceCount instances must be recorded before it
+    void drawInstanced(int instanceCount);
+
+    // resolve and convert the render target to buffer, as Pipeline::presentToScreen()
+    void present(uint8_t* buffer, const FrameOutputOptions& options = FrameOutputOptions());
+
+protected:
+    friend class Pipeline;
+
+    struct Command
+    {
+        CommandType type;
+        // index of the arguments in the vector of the type, instance buffers are in vertexBuffers
+        // the instance count of draws, 0 if not instanced
+        int argument;
+    };
+
+    struct ClearValues
+    {
+        Vec3f color;
+        float depth;
+    };
+
+    struct PresentTarget
+    {
+        uint8_t* buffer;
+        FrameOutputOptions options;
+    };
+
+    void record(CommandType type, int argument);
+
+    // sets error and returns false if vertexBuffers[instanceBufferIndex] can't be drawn instanceCount times with vertices
+    bool checkInstanceBuffer(const VertexBufferView& vertices, int instanceBufferIndex, int instanceCount);
+
+    std::vector<Command> commands;
+    std::vector<PipelineState> states;
+    std::vector<std::pair<VertexShader*, PixelShader*>> shaders;
+    std::vector<VertexBufferView> vertexBuffers;
+    std::vector<IndexBufferView> indexBuffers;
+    std::vector<std::shared_ptr<const ShaderUniform>> uniforms;
+    std::vector<Mat4x4f> drawTransforms;
+    std::vector<ClearValues> clears;
+    std::vector<PresentTarget> presents;
+    bool valid = false;
+    std::string error;
+};
@@ -0,0 +1,231 @@
+#include <cstring>
+#include "FrameOutput.h"
+#include "SimdHelper.h"
+
+// linear values are quantized to this many entries before the sRGB lookup
+// steps are 1/16383, a fifth of an sRGB byte at the steepest part of the curve
+constexpr int FRAME_OUTPUT_SRGB_TABLE_SIZE = 16384;
+// output rows converted by one job
+constexpr int FRAME_OUTPUT_ROWS_PER_JOB = 16;
+
+int getPixelBytes(PixelFormat format)
+{
+    return format == PIXEL_FORMAT_BGRA8 || format == PIXEL_FORMAT_RGBA8 ? 4 : 3;
+}
+
+static const uint8_t* getSrgbTable()
+{
+    struct Table
+    {
+        uint8_t values[FRAME_OUTPUT_SRGB_TABLE_SIZE];
+        Table()
+        {
+            for (int i = 0; i < FRAME_OUTPUT_SRGB_TABLE_SIZE; ++i)
+            {
+                values[i] = (uint8_t)(linearToSrgb((float)i / (FRAME_OUTPUT_SRGB_TABLE_SIZE - 1)) * 255.0f + 0.5f);
+            }
+        }
+    };
+    static const Table table;
+    return table.values;
+}
+
+// clamp count floats to [0.0, 1.0] and quantize them to bytes, truncated the same as floatToByte, or by the sRGB table
+static void quantize(const float* src, int count, bool srgb, int32_t* dst)
+{
+    int i = 0;
+    const float scale = srgb ? (float)(FRAME_OUTPUT_SRGB_TABLE_SIZE - 1) : 255.0f;
+    const float bias = srgb ? 0.5f : 0.0f;
+#if defined(SIMD_SSE2)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale4 = _mm_set1_ps(scale);
+    const __m128 bias4 = _mm_set1_ps(bias);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), zero), one);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale4), bias4)));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        dst[i] = (int32_t)(clamp(src[i], 0.0f, 1.0f) * scale + bias);
+    }
+    if (srgb)
+    {
+        const uint8_t* table = getSrgbTable();
+        for (i = 0; i < count; ++i)
+        {
+            dst[i] = table[dst[i]];
+        }
+    }
+}
+
+// write count pixels of quantized rgb values in the byte order of the format
+static void packPixels(const int32_t* rgb, int count, PixelFormat format, uint8_t* dst)
+{
+    int i;
+    switch (format)
+    {
+    case PIXEL_FORMAT_RGB8:
+        for (i = 0; i < count * 3; ++i)
+        {
+            dst[i] = (uint8_t)rgb[i];
+        }
+        break;
+    case PIXEL_FORMAT_BGR8:
+        for (i = 0; i < count; ++i)
+        {
+            dst[i * 3 + 0] = (uint8_t)rgb[i * 3 + 2];
+            dst[i * 3 + 1] = (uint8_t)rgb[i * 3 + 1];
+            dst[i * 3 + 2] = (uint8_t)rgb[i * 3 + 0];
+        }
+        break;
+    case PIXEL_FORMAT_RGBA8:
+        for (i = 0; i < count; ++i)
+        {
+            dst[i * 4 + 0] = (uint8_t)rgb[i * 3 + 0];
+            dst[i * 4 + 1] = (uint8_t)rgb[i * 3 + 1];
+            dst[i * 4 + 2] = (uint8_t)rgb[i * 3 + 2];
+            dst[i * 4 + 3] = 255;
+        }
+        break;
+    case PIXEL_FORMAT_BGRA8:
+        for (i = 0; i < count; ++i)
+        {
+            dst[i * 4 + 0] = (uint8_t)rgb[i * 3 + 2];
+            dst[i * 4 + 1] = (uint8_t)rgb[i * 3 + 1];
+            dst[i * 4 + 2] = (uint8_t)rgb[i * 3 + 0];
+            dst[i * 4 + 3] = 255;
+        }
+        break;
+    }
+}
+
+// floats of row y of level0, straight from the texels if they are linear floats, else converted into scratch
+static const float* getRow(const Texture2D3F& src, int y, std::vector<Vec3f>& scratch)
+{
+    const MipLevel& level = src.getMipLevel(0);
+    if (src.format == TEXEL_FORMAT_FLOAT && src.compression == TEXTURE_COMPRESSION_NONE &&
+        (src.layout == TEXTURE_LAYOUT_LINEAR || src.layout == TEXTURE_LAYOUT_LINEAR_ALIGNED))
+    {
+        return (const float*)&src.data[src.texelIndex(0, y, level)];
+    }
+    scratch.resize(level.width);
+    for (int x = 0; x < level.width; ++x)
+    {
+        scratch[x] = src.fetch(x, y, level);
+    }
+    return (const float*)scratch.data();
+}
+
+void convertFrame(const Texture2D3F& src, uint8_t* dst, const FrameOutputOptions& options)
+{
+    const int width = (int)src.width;
+    const int height = (int)src.height;
+    const int scale = std::max(options.scale, 1);
+    const int outWidth = width * scale;
+    const int outHeight = height * scale;
+    const int pixelBytes = getPixelBytes(options.format);
+    const size_t outRowBytes = (size_t)outWidth * pixelBytes;
+    const bool bilinear = options.filter == UPSCALE_FILTER_BILINEAR && scale > 1;
+    // row of the render target written as output row r / scale
+    auto srcRow = [&](int r) { return options.flipY ? height - 1 - r : r; };
+
+    // bilinear taps on x are the same for all rows
+    std::vector<int> x0s, x1s;
+    std::vector<float> kxs;
+    if (bilinear)
+    {
+        x0s.resize(outWidth);
+        x1s.resize(outWidth);
+        kxs.resize(outWidth);
+        for (int x = 0; x < outWidth; ++x)
+        {
+            float sx = std::max(((float)x + 0.5f) / scale - 0.5f, 0.0f);
+            x0s[x] = std::min((int)sx, width - 1);
+            x1s[x] = std::min(x0s[x] + 1, width - 1);
+            kxs[x] = sx - (float)(int)sx;
+        }
+    }
+
+    // a job converts a band of rows of the render target, or of the output when bilinear
+    const int rowCount = bilinear ? outHeight : height;
+    auto job = [&](int band)
+    {
+        std::vector<Vec3f> scratch0, scratch1;
+        std::vector<float> rowBlend;
+        std::vector<float> blended;
+        std::vector<int32_t> quantized;
+        std::vector<uint8_t> packed;
+        int rowEnd = std::min((band + 1) * FRAME_OUTPUT_ROWS_PER_JOB, rowCount);
+        for (int r = band * FRAME_OUTPUT_ROWS_PER_JOB; r < rowEnd; ++r)
+        {
+            if (!bilinear)
+            {
+                // convert the row once, then repeat the pixels and the row
+                const float* row = getRow(src, srcRow(r), scratch0);
+                quantized.resize((size_t)width * 3);
+                quantize(row, width * 3, options.srgb, quantized.data());
+                uint8_t* out = dst + (size_t)r * scale * outRowBytes;
+                if (scale == 1)
+                {
+                    packPixels(quantized.data(), width, options.format, out);
+                    continue;
+                }
+                packed.resize((size_t)width * pixelBytes);
+                packPixels(quantized.data(), width, options.format, packed.data());
+                for (int x = 0; x < width; ++x)
+                {
+                    for (int s = 0; s < scale; ++s)
+                    {
+                        memcpy(out + ((size_t)x * scale + s) * pixelBytes, &packed[(size_t)x * pixelBytes], pixelBytes);
+                    }
+                }
+                for (int s = 1; s < scale; ++s)
+                {
+                    memcpy(out + s * outRowBytes, out, outRowBytes);
+                }
+                continue;
+            }
+            // blend 2 rows of the render target, then 2 pixels of the blended row for every output pixel
+            float sy = std::max(((float)r + 0.5f) / scale - 0.5f, 0.0f);
+            int y0 = std::min((int)sy, height - 1);
+            int y1 = std::min(y0 + 1, height - 1);
+            float ky = sy - (float)(int)sy;
+            const float* row0 = getRow(src, srcRow(y0), scratch0);
+            const float* row1 = getRow(src, srcRow(y1), scratch1);
+            rowBlend.assign(row0, row0 + width * 3);
+            for (float& f : rowBlend)
+            {
+                f *= 1.0f - ky;
+            }
+            simdAxpy(ky, row1, rowBlend.data(), width * 3);
+            blended.resize((size_t)outWidth * 3);
+            for (int x = 0; x < outWidth; ++x)
+            {
+                const float* p0 = &rowBlend[x0s[x] * 3];
+                const float* p1 = &rowBlend[x1s[x] * 3];
+                for (int c = 0; c < 3; ++c)
+                {
+                    blended[x * 3 + c] = p0[c] + (p1[c] - p0[c]) * kxs[x];
+                }
+            }
+            quantized.resize((size_t)outWidth * 3);
+            quantize(blended.data(), outWidth * 3, options.srgb, quantized.data());
+            packPixels(quantized.data(), outWidth, options.format, dst + (size_t)r * outRowBytes);
+        }
+    };
+    int bandCount = (rowCount + FRAME_OUTPUT_ROWS_PER_JOB - 1) / FRAME_OUTPUT_ROWS_PER_JOB;
+    if (options.pThreadPool != nullptr)
+    {
+        options.pThreadPool->parallelFor(bandCount, job);
+    }
+    else
+    {
+        for (int band = 0; band < bandCount; ++band)
+        {
+            job(band);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "Texture.h"
+#include "ThreadPool.h"
+
+// byte order of the pixels written by convertFrame()
+enum PixelFormat
+{
+    // 24 bit GDI DIBs
+    PIXEL_FORMAT_BGR8,
+    PIXEL_FORMAT_RGB8,
+    // alpha is 255
+    PIXEL_FORMAT_BGRA8,
+    PIXEL_FORMAT_RGBA8,
+};
+
+enum UpscaleFilter
+{
+    // every pixel of the render target is repeated scale x scale times
+    UPSCALE_FILTER_NEAREST,
+    // pixels of the render target are blended by their distances to the output pixel center
+    UPSCALE_FILTER_BILINEAR,
+};
+
+struct FrameOutputOptions
+{
+    PixelFormat format = PIXEL_FORMAT_BGR8;
+    // encode the linear colors of the render target to sRGB, by a lookup table
+    bool srgb = false;
+    // the output is scale times as wide and as high as the render target
+    int scale = 1;
+    UpscaleFilter filter = UPSCALE_FILTER_NEAREST;
+    // write the rows from the last one, the render target is bottom-up as GDI DIBs
+    bool flipY = false;
+    // rows are split across the threads of the pool, null to run on the calling thread
+    ThreadPool* pThreadPool = nullptr;
+};
+
+// bytes of a pixel of the format
+int getPixelBytes(PixelFormat format);
+
+// convert level0 of the render target to pixels of the format, values are clamped to [0.0, 1.0]
+// dst holds (width * scale) x (height * scale) pixels, rows are not padded
+void convertFrame(const Texture2D3F& src, uint8_t* dst, const FrameOutputOptions& options);
@@ -1,8 +1,12 @@
 #pragma once
 
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <algorithm>
 #include <vector>
+#include <cmath>
+#include <cstdint>
 #include <assert.h>
 #undef min
 #undef max
@@ -23,6 +27,7 @@ template <size_t N, typename T> struct Vector {
     inline Vector() { for (size_t i = 0; i < N; i++) m[i] = T(); }
     inline Vector(const T* ptr) { for (size_t i = 0; i < N; i++) m[i] = ptr[i]; }
     inline Vector(const Vector<N, T>& vec) { for (size_t i = 0; i < N; i++) m[i] = vec.m[i]; }
+    inline Vector<N, T>& operator = (const Vector<N, T>& vec) = default;
     inline Vector(const std::initializer_list<T>& u) {
         auto it = u.begin(); for (size_t i = 0; i < N; i++) m[i] = *it++;
     }
@@ -60,6 +65,7 @@ struct Vector<2, T>
     inline Vector() : x(T()), y(T()) {}
     inline Vector(T X, T Y = T()) : x(X), y(Y) {}
     inline Vector(const Vec2T<T>& vec) : x(vec.x), y(vec.y) {}
+    inline Vec2T<T>& operator = (const Vec2T<T>& vec) = default;
     inline Vector(const T* ptr) : x(ptr[0]), y(ptr[1]) {}
     inline const T& operator[] (size_t i) const { assert(i < 2); return m[i]; }
     inline T& operator[] (size_t i) { assert(i < 2); return m[i]; }
@@ -79,6 +85,7 @@ struct Vector<3, T>
     inline Vector() : x(T()), y(T()), z(T()) {}
     inline Vector(T X, T Y = T(), T Z = T()) : x(X), y(Y), z(Z) {}
     inline Vector(const Vec3T<T>& vec) : x(vec.x), y(vec.y), z(vec.z) {}
+    inline Vec3T<T>& operator = (const Vec3T<T>& vec) = default;
     inline Vector(const Vec2T<T>& vec, T Z = T()) : x(vec.x), y(vec.y), z(Z) {}
     inline Vector(const T* ptr) : x(ptr[0]), y(ptr[1]), z(ptr[2]) {}
     inline const T& operator[] (size_t i) const { assert(i < 3); return m[i]; }
@@ -100,6 +107,7 @@ struct Vector<4, T>
     inline Vector() : x(T()), y(T()), z(T()), w(T()) {}
     inline Vector(T X, T Y = T(), T Z = T(), T W = T()) : x(X), y(Y), z(Z), w(W) {}
     inline Vector(const Vec4T<T>& vec) : x(vec.x), y(vec.y), z(vec.z), w(vec.w) {}
+    inline Vec4T<T>& operator = (const Vec4T<T>& vec) = default;
     inline Vector(const Vec2T<T>& vec, T Z = T(), T W = T()) : x(vec.x), y(vec.y), z(Z), w(W) {}
     inline Vector(const Vec3T<T>& vec, T W = T()) : x(vec.x), y(vec.y), z(vec.z), w(W) {}
     inline Vector(const T* ptr) : x(ptr[0]), y(ptr[1]), z(ptr[2]), w(ptr[3]) {}
@@ -372,6 +380,8 @@ template<size_t ROW, size_t COL, typename T> struct Matrix {
         }
     }
 
+    inline Matrix<ROW, COL, T>& operator = (const Matrix<ROW, COL, T>& src) = default;
+
     inline Matrix(const std::initializer_list<Vector<COL, T>>& u) {
         auto it = u.begin();
         for (size_t i = 0; i < ROW; i++) SetRow(i, *it++);
@@ -782,6 +792,17 @@ inline uint8_t floatToByte(float f)
     return uint8_t(clamp(f, 0.0f, 1.0f) * 255.0f);
 }
 
+// sRGB transfer function, for values in [0.0, 1.0]
+inline float srgbToLinear(float f)
+{
+    return f <= 0.04045f ? f / 12.92f : std::pow((f + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float linearToSrgb(float f)
+{
+    return f <= 0.0031308f ? f * 12.92f : 1.055f * std::pow(f, 1.0f / 2.4f) - 0.055f;
+}
+
 // don't input a triangle (v0, v1, v2) which is 0 in size
 inline Vec3f getFactor(Vec2f p, Vec2f v0, Vec2f v1, Vec2f v2)
 {
@@ -0,0 +1,498 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include "Mesh.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(int) == 4, "indices of binary mesh files are 32 bit");
+
+Mesh::~Mesh()
+{
+    reset();
+}
+
+void Mesh::assign(const VaryingLayout& layout, std::vector<float> vertices, std::vector<int> indices)
+{
+    reset();
+    this->layout = layout;
+    ownedVertices = std::move(vertices);
+    ownedIndices = std::move(indices);
+    vertexData = ownedVertices.data();
+    indexData = ownedIndices.data();
+    vertexCount = layout.floatCount() > 0 ? (int)(ownedVertices.size() / layout.floatCount()) : 0;
+    indexCount = (int)ownedIndices.size();
+}
+
+void Mesh::reset()
+{
+    if (mapping != nullptr)
+    {
+#if defined(_WIN32)
+        UnmapViewOfFile(mapping);
+        CloseHandle((HANDLE)mappingHandle);
+        CloseHandle((HANDLE)fileHandle);
+#else
+        munmap(mapping, mappingSize);
+#endif
+    }
+    mapping = nullptr;
+    mappingSize = 0;
+    fileHandle = nullptr;
+    mappingHandle = nullptr;
+    layout = VaryingLayout();
+    ownedVertices.clear();
+    ownedIndices.clear();
+    vertexData = nullptr;
+    indexData = nullptr;
+    vertexCount = 0;
+    indexCount = 0;
+}
+
+void Mesh::loadVertex(int i, ShaderContext& context) const
+{
+    context.layout = &layout;
+    memcpy(context.data, vertexData + (size_t)i * layout.floatCount(), sizeof(float) * layout.floatCount());
+}
+
+bool Mesh::getBounds(Vec3f& boundsMin, Vec3f& boundsMax) const
+{
+    if (vertexCount == 0)
+    {
+        return false;
+    }
+    const int stride = layout.floatCount();
+    const float* position = vertexData + layout.offsetOf(SV_Position);
+    boundsMin = boundsMax = Vec3f(position[0], position[1], position[2]);
+    for (int i = 1; i < vertexCount; ++i)
+    {
+        position += stride;
+        Vec3f p(position[0], position[1], position[2]);
+        boundsMin = Vector_min(boundsMin, p);
+        boundsMax = Vector_max(boundsMax, p);
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+// OBJ
+//---------------------------------------------------------------------
+
+// a corner of a face, 0-based indices of the position, uv and normal, -1 if not given
+struct ObjCorner
+{
+    int position;
+    int uv;
+    int normal;
+
+    bool operator== (const ObjCorner& other) const
+    {
+        return position == other.position && uv == other.uv && normal == other.normal;
+    }
+};
+
+struct ObjCornerHash
+{
+    size_t operator() (const ObjCorner& corner) const
+    {
+        return ((size_t)corner.position * 73856093U) ^ ((size_t)corner.uv * 19349663U) ^ ((size_t)corner.normal * 83492791U);
+    }
+};
+
+static bool readFile(const char* path, std::vector<char>& data)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    data.clear();
+    size_t size = 0;
+    for (;;)
+    {
+        data.resize(size + (1 << 20));
+        size_t read = fread(data.data() + size, 1, data.size() - size, file);
+        size += read;
+        if (read == 0)
+        {
+            break;
+        }
+    }
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    // parsing stops at the terminating 0
+    data.resize(size + 1);
+    data[size] = '\0';
+    return ok;
+}
+
+static bool isLineSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* skipLineSpaces(const char* p)
+{
+    while (isLineSpace(*p))
+    {
+        ++p;
+    }
+    return p;
+}
+
+// parse up to count floats of the line, missing ones are left as they are
+static const char* parseFloats(const char* p, float* values, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        p = skipLineSpaces(p);
+        char* end;
+        float value = strtof(p, &end);
+        if (end == p)
+        {
+            break;
+        }
+        values[i] = value;
+        p = end;
+    }
+    return p;
+}
+
+// OBJ indices are 1-based, and negative ones count back from the last element, returns -1 if out of range
+static int resolveObjIndex(long index, size_t count)
+{
+    long resolved = index > 0 ? index - 1 : (long)count + index;
+    return resolved >= 0 && resolved < (long)count ? (int)resolved : -1;
+}
+
+bool importObj(const char* path, Mesh& mesh)
+{
+    std::vector<char> text;
+    if (!readFile(path, text))
+    {
+        return false;
+    }
+    std::vector<Vec3f> positions;
+    std::vector<Vec2f> uvs;
+    std::vector<Vec3f> normals;
+    // 3 corners for every triangle
+    std::vector<ObjCorner> corners;
+    std::vector<ObjCorner> face;
+    bool hasUv = false;
+    bool hasNormal = false;
+    const char* p = text.data();
+    while (*p != '\0')
+    {
+        p = skipLineSpaces(p);
+        if (p[0] == 'v' && isLineSpace(p[1]))
+        {
+            Vec3f v(0.0f, 0.0f, 0.0f);
+            p = parseFloats(p + 1, (float*)&v, 3);
+            positions.push_back(v);
+        }
+        else if (p[0] == 'v' && p[1] == 't' && isLineSpace(p[2]))
+        {
+            Vec2f uv(0.0f, 0.0f);
+            p = parseFloats(p + 2, (float*)&uv, 2);
+            uvs.push_back(uv);
+        }
+        else if (p[0] == 'v' && p[1] == 'n' && isLineSpace(p[2]))
+        {
+            Vec3f n(0.0f, 0.0f, 0.0f);
+            p = parseFloats(p + 2, (float*)&n, 3);
+            normals.push_back(n);
+        }
+        else if (p[0] == 'f' && isLineSpace(p[1]))
+        {
+            // corners are position[/[uv][/normal]]
+            face.clear();
+            ++p;
+            for (;;)
+            {
+                p = skipLineSpaces(p);
+                char* end;
+                long index = strtol(p, &end, 10);
+                if (end == p)
+                {
+                    break;
+                }
+                p = end;
+                ObjCorner corner = { resolveObjIndex(index, positions.size()), -1, -1 };
+                if (corner.position < 0)
+                {
+                    return false;
+                }
+                if (*p == '/')
+                {
+                    ++p;
+                    index = strtol(p, &end, 10);
+                    if (end != p)
+                    {
+                        corner.uv = resolveObjIndex(index, uvs.size());
+                        if (corner.uv < 0)
+                        {
+                            return false;
+                        }
+                        hasUv = true;
+                        p = end;
+                    }
+                    if (*p == '/')
+                    {
+                        ++p;
+                        index = strtol(p, &end, 10);
+                        if (end == p)
+                        {
+                            return false;
+                        }
+                        corner.normal = resolveObjIndex(index, normals.size());
+                        if (corner.normal < 0)
+                        {
+                            return false;
+                        }
+                        hasNormal = true;
+                        p = end;
+                    }
+                }
+                face.push_back(corner);
+            }
+            // triangle fan
+            for (size_t i = 2; i < face.size(); ++i)
+            {
+                corners.push_back(face[0]);
+                corners.push_back(face[i - 1]);
+                corners.push_back(face[i]);
+            }
+        }
+        // skip the rest of the line, comments and unsupported statements
+        while (*p != '\0' && *p != '\n')
+        {
+            ++p;
+        }
+        if (*p == '\n')
+        {
+            ++p;
+        }
+    }
+
+    VaryingLayout layout;
+    layout.add(SV_Position, VARYING_TYPE_VEC4F);
+    if (hasUv)
+    {
+        layout.add(SV_uv, VARYING_TYPE_VEC2F);
+    }
+    if (hasNormal)
+    {
+        layout.add(SV_normal, VARYING_TYPE_VEC3F);
+    }
+    const int stride = layout.floatCount();
+    std::vector<float> vertices;
+    std::vector<int> indices;
+    indices.reserve(corners.size());
+    // every distinct corner becomes a vertex
+    std::unordered_map<ObjCorner, int, ObjCornerHash> vertexIndices;
+    vertexIndices.reserve(positions.size() * 2);
+    for (const ObjCorner& corner : corners)
+    {
+        auto result = vertexIndices.insert(std::make_pair(corner, (int)(vertices.size() / stride)));
+        if (result.second)
+        {
+            const Vec3f& position = positions[corner.position];
+            vertices.insert(vertices.end(), { position.x, position.y, position.z, 1.0f });
+            if (hasUv)
+            {
+                Vec2f uv = corner.uv >= 0 ? uvs[corner.uv] : Vec2f(0.0f, 0.0f);
+                vertices.insert(vertices.end(), { uv.x, uv.y });
+            }
+            if (hasNormal)
+            {
+                Vec3f normal = corner.normal >= 0 ? normals[corner.normal] : Vec3f(0.0f, 0.0f, 0.0f);
+                vertices.insert(vertices.end(), { normal.x, normal.y, normal.z });
+            }
+        }
+        indices.push_back(result.first->second);
+    }
+    mesh.assign(layout, std::move(vertices), std::move(indices));
+    return true;
+}
+
+//---------------------------------------------------------------------
+// binary mesh files
+//---------------------------------------------------------------------
+
+static uint64_t alignMeshOffset(uint64_t offset)
+{
+    return (offset + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT;
+}
+
+bool saveMesh(const char* path, const Mesh& mesh)
+{
+    const VaryingLayout& layout = mesh.getLayout();
+    MeshFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MESH_FILE_MAGIC;
+    header.version = MESH_FILE_VERSION;
+    // keys are added to the layout in the order of their offsets
+    for (int offset = 0; offset < layout.floatCount(); )
+    {
+        int key = VARYING_KEY_MIN;
+        while (key <= VARYING_KEY_MAX && !(layout.has(key) && layout.offsetOf(key) == offset))
+        {
+            ++key;
+        }
+        if (key > VARYING_KEY_MAX || header.attributeCount == MESH_FILE_MAX_ATTRIBUTES)
+        {
+            return false;
+        }
+        header.attributeKeys[header.attributeCount] = key;
+        header.attributeTypes[header.attributeCount] = (int32_t)layout.typeOf(key);
+        ++header.attributeCount;
+        offset += (int)layout.typeOf(key);
+    }
+    header.vertexCount = (uint32_t)mesh.getVertexCount();
+    header.indexCount = (uint32_t)mesh.getIndexCount();
+    size_t vertexBytes = sizeof(float) * layout.floatCount() * mesh.getVertexCount();
+    size_t indexBytes = sizeof(int) * mesh.getIndexCount();
+    header.vertexOffset = alignMeshOffset(sizeof(header));
+    header.indexOffset = alignMeshOffset(header.vertexOffset + vertexBytes);
+
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    const char padding[MESH_FILE_ALIGNMENT] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(padding, 1, header.vertexOffset - sizeof(header), file) == header.vertexOffset - sizeof(header) &&
+        fwrite(mesh.getVertexData(), 1, vertexBytes, file) == vertexBytes &&
+        fwrite(padding, 1, header.indexOffset - header.vertexOffset - vertexBytes, file) == header.indexOffset - header.vertexOffset - vertexBytes &&
+        fwrite(mesh.getIndexData(), 1, indexBytes, file) == indexBytes;
+    return fclose(file) == 0 && ok;
+}
+
+// check the header against the file size, and build the layout of it
+static bool validateMeshHeader(const MeshFileHeader& header, size_t fileSize, VaryingLayout& layout)
+{
+    if (header.magic != MESH_FILE_MAGIC || header.version != MESH_FILE_VERSION || header.attributeCount > MESH_FILE_MAX_ATTRIBUTES)
+    {
+        return false;
+    }
+    layout = VaryingLayout();
+    for (uint32_t i = 0; i < header.attributeCount; ++i)
+    {
+        int key = header.attributeKeys[i];
+        int type = header.attributeTypes[i];
+        bool validType = type == VARYING_TYPE_FLOAT || type == VARYING_TYPE_VEC2F || type == VARYING_TYPE_VEC3F ||
+            type == VARYING_TYPE_VEC4F || type == VARYING_TYPE_MAT4X4F;
+        if (key < VARYING_KEY_MIN || key > VARYING_KEY_MAX || layout.has(key) || !validType ||
+            layout.floatCount() + type > SHADER_CONTEXT_MAX_FLOATS)
+        {
+            return false;
+        }
+        layout.add(key, (VaryingType)type);
+    }
+    if (!layout.has(SV_Position) || layout.typeOf(SV_Position) != VARYING_TYPE_VEC4F)
+    {
+        return false;
+    }
+    uint64_t vertexBytes = (uint64_t)sizeof(float) * layout.floatCount() * header.vertexCount;
+    uint64_t indexBytes = (uint64_t)sizeof(int) * header.indexCount;
+    // the offsets are untrusted, the ranges are checked by subtraction so that no sum can wrap
+    return header.vertexOffset % MESH_FILE_ALIGNMENT == 0 && header.indexOffset % MESH_FILE_ALIGNMENT == 0 &&
+        header.vertexOffset >= sizeof(header) && header.vertexOffset <= fileSize && vertexBytes <= fileSize - header.vertexOffset &&
+        header.indexOffset >= header.vertexOffset && header.indexOffset - header.vertexOffset >= vertexBytes &&
+        header.indexOffset <= fileSize && indexBytes <= fileSize - header.indexOffset &&
+        header.vertexCount <= 0x7fffffffU && header.indexCount <= 0x7fffffffU;
+}
+
+bool mapMesh(const char* path, Mesh& mesh)
+{
+    mesh.reset();
+    void* mapping = nullptr;
+    size_t size = 0;
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    HANDLE mappingHandle = nullptr;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= (LONGLONG)sizeof(MeshFileHeader))
+    {
+        size = (size_t)fileSize.QuadPart;
+        mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    if (mappingHandle != nullptr)
+    {
+        mapping = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (mapping == nullptr)
+    {
+        if (mappingHandle != nullptr)
+        {
+            CloseHandle(mappingHandle);
+        }
+        CloseHandle(file);
+        return false;
+    }
+    mesh.fileHandle = file;
+    mesh.mappingHandle = mappingHandle;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+    {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(file, &fileStat) == 0 && fileStat.st_size >= (off_t)sizeof(MeshFileHeader))
+    {
+        size = (size_t)fileStat.st_size;
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+        }
+    }
+    // the mapping stays valid after the file is closed
+    close(file);
+    if (mapping == nullptr)
+    {
+        return false;
+    }
+#endif
+    mesh.mapping = mapping;
+    mesh.mappingSize = size;
+    MeshFileHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    if (!validateMeshHeader(header, size, mesh.layout))
+    {
+        mesh.reset();
+        return false;
+    }
+    const uint8_t* bytes = (const uint8_t*)mapping;
+    const int* indices = (const int*)(bytes + header.indexOffset);
+    // draws don't check the indices, so they are checked once here, only the index block is read
+    for (uint64_t i = 0; i < header.indexCount; ++i)
+    {
+        if (indices[i] < 0 || (uint64_t)indices[i] >= header.vertexCount)
+        {
+            mesh.reset();
+            return false;
+        }
+    }
+    mesh.vertexData = (const float*)(bytes + header.vertexOffset);
+    mesh.indexData = indices;
+    mesh.vertexCount = (int)header.vertexCount;
+    mesh.indexCount = (int)header.indexCount;
+    return true;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Shader.h"
+
+// first 4 bytes of a binary mesh file, "MESH" in little endian
+constexpr uint32_t MESH_FILE_MAGIC = 0x4853454dU;
+constexpr uint32_t MESH_FILE_VERSION = 1;
+// max values of a vertex in a binary mesh file
+constexpr int MESH_FILE_MAX_ATTRIBUTES = 16;
+// vertex and index data in a binary mesh file start at multiples of this
+constexpr int MESH_FILE_ALIGNMENT = 16;
+
+/*
+* struct MeshFileHeader
+* a binary mesh file is the header, the vertices packed as floats by the layout, and the indices
+* all values are little endian, the file is used in place once mapped
+*/
+struct MeshFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    // the layout of the vertices, the values are added in this order
+    int32_t attributeKeys[MESH_FILE_MAX_ATTRIBUTES];
+    int32_t attributeTypes[MESH_FILE_MAX_ATTRIBUTES];
+    uint32_t attributeCount;
+    uint32_t vertexCount;
+    // 3 indices per triangle
+    uint32_t indexCount;
+    uint32_t reserved;
+    // in bytes from the start of the file
+    uint64_t vertexOffset;
+    uint64_t indexOffset;
+};
+
+/*
+* class Mesh
+* vertices packed as floats by the layout one after another, and 3 indices per triangle
+* the data is either owned by the mesh, or a read only mapping of a binary mesh file
+* usage :
+* 1. importObj() or assign() to build a mesh in memory, saveMesh() to write it to a binary mesh file
+* 2. mapMesh() to use a binary mesh file without reading it, the mapping lives as long as the mesh
+* 3. Pipeline::setMesh() binds views of the mesh to draws without copying it
+*/
+class Mesh
+{
+public:
+    Mesh() {}
+
+    ~Mesh();
+
+    Mesh(const Mesh&) = delete;
+
+    Mesh& operator= (const Mesh&) = delete;
+
+    // own the vertices, layout.floatCount() floats for every vertex
+    void assign(const VaryingLayout& layout, std::vector<float> vertices, std::vector<int> indices);
+
+    // drop the data and the mapping
+    void reset();
+
+    const VaryingLayout& getLayout() const { return layout; }
+
+    const float* getVertexData() const { return vertexData; }
+
+    const int* getIndexData() const { return indexData; }
+
+    int getVertexCount() const { return vertexCount; }
+
+    int getIndexCount() const { return indexCount; }
+
+    bool isMapped() const { return mapping != nullptr; }
+
+    VertexBufferView getVertexBufferView() const
+    {
+        return VertexBufferView(&layout, vertexData, sizeof(float) * layout.floatCount(), vertexCount);
+    }
+
+    IndexBufferView getIndexBufferView() const { return IndexBufferView(indexData, indexCount); }
+
+    // copy vertex i to a shader context of the mesh layout
+    void loadVertex(int i, ShaderContext& context) const;
+
+    // bounding box of SV_Position, false if the mesh has no vertex
+    bool getBounds(Vec3f& boundsMin, Vec3f& boundsMax) const;
+
+protected:
+    friend bool mapMesh(const char* path, Mesh& mesh);
+
+    VaryingLayout layout;
+    std::vector<float> ownedVertices;
+    std::vector<int> ownedIndices;
+    const float* vertexData = nullptr;
+    const int* indexData = nullptr;
+    int vertexCount = 0;
+    int indexCount = 0;
+    // the mapped view of the file, and the handles to close it
+    void* mapping = nullptr;
+    size_t mappingSize = 0;
+    void* fileHandle = nullptr;
+    void* mappingHandle = nullptr;
+};
+
+// import positions, uvs and normals of a Wavefront OBJ file, polygons are split to triangle fans
+// vertices get SV_Position (w = 1), and SV_uv and SV_normal if the file has them
+// a vertex is added for every distinct position/uv/normal triple of the faces
+bool importObj(const char* path, Mesh& mesh);
+
+bool saveMesh(const char* path, const Mesh& mesh);
+
+// map a binary mesh file read only, no vertex is parsed or copied
+// fails if the header doesn't fit the file or an index is out of the vertices
+bool mapMesh(const char* path, Mesh& mesh);
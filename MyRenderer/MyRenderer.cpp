@@ -34,24 +34,10 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
     initSimplePipeline();
     simPipeline.clearRenderTarget({ 0.0f, 0.0f, 0.0f }, 1.0f);
     simPipeline.renderToTarget();
-    simPipeline.presentToScreen(bitData);
-    //memcpy(screenData, bitData, sizeof(bitData));
-    for (int j = 0; j < screenHeight; ++j)
-    {
-        for (int i = 0; i < screenWidth; ++i)
-        {
-            for (int y = 0; y < screenScale; ++y)
-            {
-                for (int x = 0; x < screenScale; ++x)
-                {
-                    screenData[3 * (i * screenScale + x + (j * screenScale + y) * screenWidth * screenScale) + 0] = bitData[3 * (i + j * screenWidth) + 0];
-                    screenData[3 * (i * screenScale + x + (j * screenScale + y) * screenWidth * screenScale) + 1] = bitData[3 * (i + j * screenWidth) + 1];
-                    screenData[3 * (i * screenScale + x + (j * screenScale + y) * screenWidth * screenScale) + 2] = bitData[3 * (i + j * screenWidth) + 2];
-                }
-            }
-            //memcpy(screenData + 3 * (i * screenScale + (j * screenScale) * screenWidth * screenScale), bitData + i * 3 + j * screenWidth, 3);
-        }
-    }
+    // upscaled to the window while converted
+    FrameOutputOptions outputOptions;
+    outputOptions.scale = screenScale;
+    simPipeline.presentToScreen(screenData, outputOptions);
     // TODO: 在此处放置代码。
     GdiplusStartupInput gdiplusStartupInput;
     ULONG_PTR           gdiplusToken;
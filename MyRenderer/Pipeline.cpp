@@ -1,308 +1,1621 @@
+#include <algorithm>
 #include "Pipeline.h"
+#include "SimdHelper.h"
 
 const Vec2i Pipeline::pixel2x2Steps[4] = {Vec2i(0, 0), Vec2i(1, 0), Vec2i(0, 1), Vec2i(1, 1)};
 
 
 void Pipeline::renderToTarget()
 {
-    // traverse all vertices, assemble every 3 vertices as 1 triangle
-    //for (int i = 0; i < vertices.size() - 2; i += 3)
-    for (int i = 0; i < indecies.size() - 2; i += 3)
+    drawTriangles();
+    // in tiled mode, triangles are only binned by now
+    if (state.rasterMode == RASTER_MODE_TILED)
     {
-        ShaderContext vOut0, vOut1, vOut2;
-        // excute vertex shader for 3 vertices, tranform to clipping space
-        pVertexShader->excute(vertices[indecies[i + 0]], vOut0, uniforms, state);
-        pVertexShader->excute(vertices[indecies[i + 1]], vOut1, uniforms, state);
-        pVertexShader->excute(vertices[indecies[i + 2]], vOut2, uniforms, state);
-        if(shouldClip(vOut0.v4f[SV_Position]) || shouldClip(vOut1.v4f[SV_Position]) || shouldClip(vOut2.v4f[SV_Position]))
+        flushTiles();
+    }
+}
+
+void Pipeline::submit(const CommandBuffer& commands)
+{
+    assert(commands.isValid());
+    // triangles binned by draws and not rastered yet
+    bool binned = false;
+    for (const CommandBuffer::Command& command : commands.commands)
+    {
+        // clears, presents and state changes need all draws before them rastered
+        bool needsRaster = command.type == COMMAND_TYPE_CLEAR || command.type == COMMAND_TYPE_PRESENT ||
+            command.type == COMMAND_TYPE_SET_PIPELINE_STATE;
+        if (binned && needsRaster)
+        {
+            flushTiles();
+            binned = false;
+        }
+        switch (command.type)
         {
-            // TODO: clippingTriangle() has no implementation
-            std::vector<ShaderContext> clippedVertex = clippingTriangle(vOut0, vOut1, vOut2);
-            for(int j = 0; j < clippedVertex.size() - 2; j += 3)
+        case COMMAND_TYPE_SET_PIPELINE_STATE:
+            setPipelineState(commands.states[command.argument]);
+            break;
+        case COMMAND_TYPE_SET_SHADERS:
+            setShaders(commands.shaders[command.argument].first, commands.shaders[command.argument].second);
+            break;
+        case COMMAND_TYPE_SET_VERTEX_BUFFER:
+            setVertexBuffer(commands.vertexBuffers[command.argument]);
+            break;
+        case COMMAND_TYPE_SET_INDEX_BUFFER:
+            setIndexBuffer(commands.indexBuffers[command.argument]);
+            break;
+        case COMMAND_TYPE_SET_INSTANCE_BUFFER:
+            setInstanceBuffer(commands.vertexBuffers[command.argument]);
+            break;
+        case COMMAND_TYPE_SET_UNIFORMS:
+            setUniforms(commands.uniforms[command.argument]);
+            break;
+        case COMMAND_TYPE_SET_DRAW_TRANSFORM:
+            setDrawTransform(commands.drawTransforms[command.argument]);
+            break;
+        case COMMAND_TYPE_CLEAR:
+            clearRenderTarget(commands.clears[command.argument].color, commands.clears[command.argument].depth);
+            break;
+        case COMMAND_TYPE_DRAW:
+            drawTriangles(command.argument);
+            if (state.rasterMode == RASTER_MODE_TILED)
             {
-                // do perspective division
-                // and SV_Position will be transformed to NDC space( x: -1~1, y: -1~1, z: 0~1 )
-                doPerspectiveDivision(clippedVertex[i + 0].v4f[SV_Position]);
-                doPerspectiveDivision(clippedVertex[i + 1].v4f[SV_Position]);
-                doPerspectiveDivision(clippedVertex[i + 2].v4f[SV_Position]);
-                // raster, and shade the pixels
-                rasterTriangle(clippedVertex[i], clippedVertex[i + 1], clippedVertex[i + 2]);
+                // visibility buffer draws only write depths and triangle ids, the pixel shader and uniforms
+                // are kept per draw, so binding changes don't need the triangles rastered
+                if (state.shadingMode == SHADING_MODE_VISIBILITY_BUFFER)
+                {
+                    binned = true;
+                }
+                else
+                {
+                    flushTiles();
+                }
             }
+            break;
+        case COMMAND_TYPE_PRESENT:
+            presentToScreen(commands.presents[command.argument].buffer, commands.presents[command.argument].options);
+            break;
         }
-        else
+    }
+    if (binned)
+    {
+        flushTiles();
+    }
+}
+
+void Pipeline::renderToTargetInstanced(int instanceCount)
+{
+    assert(instanceCount > 0 && instanceCount <= instanceBuffer.count);
+    drawTriangles(instanceCount);
+    if (state.rasterMode == RASTER_MODE_TILED)
+    {
+        flushTiles();
+    }
+}
+
+void Pipeline::drawTriangles(int instanceCount)
+{
+    pVertexShader->bind(*pUniforms, drawTransform, state);
+    pPixelShader->bind(*pUniforms, state);
+    statistics = PipelineStatistics();
+    if (state.shadingMode == SHADING_MODE_VISIBILITY_BUFFER && !occluderPass)
+    {
+        // pixels are shaded by presentToScreen(), with the pixel shader and the uniforms of this draw
+        VisibilityDraw draw;
+        draw.pPixelShader = pPixelShader;
+        draw.pixelLayout = pixelLayout;
+        draw.pUniforms = pUniforms;
+        visibilityDraws.push_back(draw);
+    }
+    const VaryingLayout* inputLayout = vertexBuffer.layout;
+    if (instanceCount > 0 && vertexBuffer.layout != nullptr)
+    {
+        instancedLayout = *vertexBuffer.layout;
+        instancedLayout.append(*instanceBuffer.layout);
+        instancedLayout.add(SV_InstanceID, VARYING_TYPE_FLOAT);
+        inputLayout = &instancedLayout;
+    }
+    collectVertices();
+    // the vertices of a chunk of instances are shaded at once, then the triangles of them are processed
+    int drawCount = std::max(instanceCount, 1);
+    int chunkSize = std::max(1, PIPELINE_INSTANCE_CHUNK_VERTICES / std::max(vertexBuffer.count, 1));
+    const int* indices = indexBuffer.data;
+    for (int firstInstance = 0; firstInstance < drawCount; firstInstance += chunkSize)
+    {
+        int chunkCount = std::min(chunkSize, drawCount - firstInstance);
+        // excute vertex shader for all vertices used, tranform to clipping space
+        shadeVertices(inputLayout, firstInstance, chunkCount);
+        for (int instance = 0; instance < chunkCount; ++instance)
+        {
+            const ShaderContext* instanceVertices = &transformedVertices[(size_t)instance * vertexBuffer.count];
+            // traverse all vertices, assemble every 3 vertices as 1 triangle
+            for (int i = 0; i + 2 < indexBuffer.count; i += 3)
+            {
+                // the triangle is clipped and divided in place, so work on copies
+                ShaderContext vOut0 = instanceVertices[indices[i + 0]];
+                ShaderContext vOut1 = instanceVertices[indices[i + 1]];
+                ShaderContext vOut2 = instanceVertices[indices[i + 2]];
+                processTriangle(vOut0, vOut1, vOut2);
+            }// END of loop
+        }
+    }
+    statistics.vertexCacheMisses *= drawCount;
+    statistics.vertexCacheHits *= drawCount;
+}
+
+void Pipeline::collectVertices()
+{
+    const int* indices = indexBuffer.data;
+    // only whole triangles are drawn
+    int indexCount = indexBuffer.count / 3 * 3;
+    // a shared vertex is shaded only once
+    vertexShaded.assign(vertexBuffer.count, 0);
+    shadedIndices.clear();
+    for (int i = 0; i < indexCount; ++i)
+    {
+        if (vertexShaded[indices[i]] == 0)
+        {
+            vertexShaded[indices[i]] = 1;
+            shadedIndices.push_back(indices[i]);
+        }
+    }
+    statistics.vertexCacheMisses = shadedIndices.size();
+    statistics.vertexCacheHits = indexCount - shadedIndices.size();
+}
+
+void Pipeline::shadeVertices(const VaryingLayout* inputLayout, int firstInstance, int instanceCount)
+{
+    const VaryingLayout* vsLayout = &pVertexShader->getOutputLayout();
+    size_t outputCount = (size_t)vertexBuffer.count * instanceCount;
+    if (transformedVertices.size() < outputCount)
+    {
+        transformedVertices.resize(outputCount);
+    }
+    // vertices are independent of each other, so shade them in batches on the thread pool
+    // vertex k of the work is shadedIndices[k % n] of instance k / n, a batch may span instances
+    const int n = (int)shadedIndices.size();
+    const int workCount = n * instanceCount;
+    const bool instanced = inputLayout == &instancedLayout;
+    int batchCount = (workCount + PIPELINE_VERTEX_BATCH_SIZE - 1) / PIPELINE_VERTEX_BATCH_SIZE;
+    threadPool->parallelFor(batchCount, [this, inputLayout, vsLayout, firstInstance, n, workCount, instanced](int batch)
+    {
+        const int vertexFloats = vertexBuffer.layout->floatCount();
+        const int instanceFloats = instanced ? instanceBuffer.layout->floatCount() : 0;
+        int end = std::min((batch + 1) * PIPELINE_VERTEX_BATCH_SIZE, workCount);
+        // a job is split to shader batches of SHADER_BATCH_SIZE vertices
+        for (int first = batch * PIPELINE_VERTEX_BATCH_SIZE; first < end; first += SHADER_BATCH_SIZE)
+        {
+            // vertices are loaded straight from the floats of the vertex buffer, and of the instance buffer
+            ShaderBatch input(inputLayout);
+            ShaderBatch output(vsLayout);
+            input.count = std::min(SHADER_BATCH_SIZE, end - first);
+            output.count = input.count;
+            for (int i = 0; i < input.count; ++i)
+            {
+                int instance = (first + i) / n;
+                input.load(i, vertexBuffer.vertex(shadedIndices[(first + i) % n]), 0, vertexFloats);
+                if (instanced)
+                {
+                    input.load(i, instanceBuffer.vertex(firstInstance + instance), vertexFloats, instanceFloats);
+                    input.data[inputLayout->offsetOf(SV_InstanceID)][i] = (float)(firstInstance + instance);
+                }
+            }
+            pVertexShader->excuteBatch(input, output);
+            for (int i = 0; i < output.count; ++i)
+            {
+                int instance = (first + i) / n;
+                output.store(i, transformedVertices[(size_t)instance * vertexBuffer.count + shadedIndices[(first + i) % n]]);
+            }
+        }
+    });
+}
+
+void Pipeline::processTriangle(ShaderContext& v0, ShaderContext& v1, ShaderContext& v2)
+{
+    uint32_t clipCode0 = getClipCode(v0.v4f(SV_Position));
+    uint32_t clipCode1 = getClipCode(v1.v4f(SV_Position));
+    uint32_t clipCode2 = getClipCode(v2.v4f(SV_Position));
+    ++statistics.trianglesInput;
+    // all 3 vertices are out of the same plane, nothing to draw
+    if ((clipCode0 & clipCode1 & clipCode2) != 0U)
+    {
+        ++statistics.trianglesCulledClipping;
+        return;
+    }
+    // triangles only crossing the edges of the screen are not clipped, they are scissored by the rasterizer
+    uint32_t clipCode = (clipCode0 | clipCode1 | clipCode2) & CLIP_PLANE_CLIPPING_MASK;
+    if(clipCode != 0U)
+    {
+        int vertexCount;
+        ShaderContext* polygon = clippingTriangle(v0, v1, v2, clipCode, vertexCount);
+        // do perspective division
+        // and SV_Position will be transformed to NDC space( x: -1~1, y: -1~1, z: 0~1 )
+        for (int j = 0; j < vertexCount; ++j)
+        {
+            doPerspectiveDivision(polygon[j].v4f(SV_Position));
+        }
+        // the clipped polygon is convex, raster it as a triangle fan
+        for (int j = 1; j + 1 < vertexCount; ++j)
         {
-            // do perspective division
-            // and SV_Position will be transformed to NDC space( x: -1~1, y: -1~1, z: 0~1 )
-            doPerspectiveDivision(vOut0.v4f[SV_Position]);
-            doPerspectiveDivision(vOut1.v4f[SV_Position]);
-            doPerspectiveDivision(vOut2.v4f[SV_Position]);
-            // raster, and shade the pixels
-            rasterTriangle(vOut0, vOut1, vOut2);
+            emitTriangle(polygon[0], polygon[j], polygon[j + 1]);
         }
-    }// END of loop
+    }
+    else
+    {
+        // do perspective division
+        // and SV_Position will be transformed to NDC space( x: -1~1, y: -1~1, z: 0~1 )
+        doPerspectiveDivision(v0.v4f(SV_Position));
+        doPerspectiveDivision(v1.v4f(SV_Position));
+        doPerspectiveDivision(v2.v4f(SV_Position));
+        // raster, and shade the pixels
+        emitTriangle(v0, v1, v2);
+    }
+}
+
+// returns true if a sample at offset in some pixel falls in [lo, hi] on one axis
+static bool sampleInRange(float lo, float hi, float offset)
+{
+    return std::ceil(lo - offset) + offset <= hi;
+}
+
+bool Pipeline::cullTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2)
+{
+    Vec2f p0 = toScreenSpace(v0.v4f(SV_Position));
+    Vec2f p1 = toScreenSpace(v1.v4f(SV_Position));
+    Vec2f p2 = toScreenSpace(v2.v4f(SV_Position));
+    // twice the signed area, positive if counter clockwise on the screen
+    float area2 = Vector_cross(p0 - p2, p1 - p2);
+    if (area2 == 0.0f)
+    {
+        ++statistics.trianglesCulledZeroArea;
+        return true;
+    }
+    if (state.cullMode != CULL_MODE_NONE)
+    {
+        bool frontFacing = (area2 > 0.0f) == (state.frontFace == FRONT_FACE_COUNTER_CLOCKWISE);
+        if (frontFacing == (state.cullMode == CULL_MODE_FRONT))
+        {
+            ++statistics.trianglesCulledFacing;
+            return true;
+        }
+    }
+    // the sample pattern repeats every pixel, so the bounding box covers a sample
+    // if it covers the sample's x and y in some pixel, which can be tested axis by axis
+    // the box is grown a little, the rasterizer may take samples on the edges by rounding
+    Vec2f minP(std::min({ p0.x, p1.x, p2.x }) - PIPELINE_CULL_EPSILON, std::min({ p0.y, p1.y, p2.y }) - PIPELINE_CULL_EPSILON);
+    Vec2f maxP(std::max({ p0.x, p1.x, p2.x }) + PIPELINE_CULL_EPSILON, std::max({ p0.y, p1.y, p2.y }) + PIPELINE_CULL_EPSILON);
+    if (maxP.x - minP.x < 1.0f || maxP.y - minP.y < 1.0f)
+    {
+        bool covered = false;
+        for (int i = 0; i < state.msCount && !covered; ++i)
+        {
+            covered = sampleInRange(minP.x, maxP.x, state.sampleCoords[i].x) && sampleInRange(minP.y, maxP.y, state.sampleCoords[i].y);
+        }
+        if (!covered)
+        {
+            ++statistics.trianglesCulledSubSample;
+            return true;
+        }
+    }
+    return false;
 }
 
-void Pipeline::presentToScreen(uint8_t* buffer)
+void Pipeline::emitTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2)
 {
+    // the cull stage, right after perspective division
+    if (cullTriangle(v0, v1, v2))
+    {
+        return;
+    }
+    ++statistics.trianglesRasterized;
+    if (occluderPass)
+    {
+        rasterOccluder(v0, v1, v2);
+        return;
+    }
+    // keep the triangle for the shading after all draws
+    uint32_t triangleId = 0;
+    if (state.shadingMode == SHADING_MODE_VISIBILITY_BUFFER)
+    {
+        triangleId = (uint32_t)visibilityTriangleDraws.size();
+        visibilityVertices.push_back(v0);
+        visibilityVertices.push_back(v1);
+        visibilityVertices.push_back(v2);
+        visibilityTriangleDraws.push_back((uint32_t)visibilityDraws.size() - 1);
+    }
+    if (state.rasterMode == RASTER_MODE_TILED)
+    {
+        binTriangle(v0, v1, v2, triangleId);
+    }
+    else
+    {
+        rasterTriangle(v0, v1, v2, Vec4i(0, 0, state.width, state.height), triangleId);
+    }
+}
+
+void Pipeline::binTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2, uint32_t triangleId)
+{
+    Vec2f p0 = toScreenSpace(v0.v4f(SV_Position));
+    Vec2f p1 = toScreenSpace(v1.v4f(SV_Position));
+    Vec2f p2 = toScreenSpace(v2.v4f(SV_Position));
+    // the same bounding box as rasterTriangle() uses
+    int xstart = std::max((int)std::min({ p0.x, p1.x, p2.x }), 0);
+    int xend = std::min((int)std::max({ p0.x, p1.x, p2.x }) + 1, state.width);
+    int ystart = std::max((int)std::min({ p0.y, p1.y, p2.y }), 0);
+    int yend = std::min((int)std::max({ p0.y, p1.y, p2.y }) + 1, state.height);
+    if (xstart >= xend || ystart >= yend)
+    {
+        return;
+    }
+    int index = (int)binnedVertices.size() / 3;
+    binnedVertices.push_back(v0);
+    binnedVertices.push_back(v1);
+    binnedVertices.push_back(v2);
+    binnedTriangleIds.push_back(triangleId);
+    // add the triangle to every tile its bounding box overlaps
+    for (int ty = ystart / PIPELINE_TILE_SIZE; ty <= (yend - 1) / PIPELINE_TILE_SIZE; ++ty)
+    {
+        for (int tx = xstart / PIPELINE_TILE_SIZE; tx <= (xend - 1) / PIPELINE_TILE_SIZE; ++tx)
+        {
+            tileBins[tx + ty * tileCountX].push_back(index);
+        }
+    }
+}
+
+void Pipeline::flushTiles()
+{
+    // every tile owns its pixels of the msaa buffers, so tiles need no locking
+    // and triangles of a tile are rastered in submission order, same as RASTER_MODE_IMMEDIATE
+    threadPool->parallelFor(tileCountX * tileCountY, [this](int tile)
+    {
+        std::vector<int>& bin = tileBins[tile];
+        if (bin.empty())
+        {
+            return;
+        }
+        int tx = tile % tileCountX;
+        int ty = tile / tileCountX;
+        Vec4i scissor(
+            tx * PIPELINE_TILE_SIZE,
+            ty * PIPELINE_TILE_SIZE,
+            std::min((tx + 1) * PIPELINE_TILE_SIZE, state.width),
+            std::min((ty + 1) * PIPELINE_TILE_SIZE, state.height));
+        for (int index : bin)
+        {
+            rasterTriangle(binnedVertices[index * 3 + 0], binnedVertices[index * 3 + 1], binnedVertices[index * 3 + 2], scissor,
+                binnedTriangleIds[index]);
+        }
+        bin.clear();
+    });
+    binnedVertices.clear();
+    binnedTriangleIds.clear();
+}
+
+void Pipeline::setShaders(VertexShader* pVS, PixelShader* pPS)
+{
+    pVertexShader = pVS;
+    pPixelShader = pPS;
+    // pixel input is the vertex shader output followed by the built-in values
+    pixelLayout = pVertexShader->getOutputLayout();
+    if (pixelLayout.has(SV_uv))
+    {
+        pixelLayout.add(SV_ddxUV, VARYING_TYPE_VEC2F);
+        pixelLayout.add(SV_ddyUV, VARYING_TYPE_VEC2F);
+    }
+}
+
+void Pipeline::presentToScreen(uint8_t* buffer, const FrameOutputOptions& options)
+{
+    if (state.shadingMode == SHADING_MODE_VISIBILITY_BUFFER)
+    {
+        shadeVisibilityBuffer();
+    }
     mergeMSAARenderTarget();
-    renderTarget.toBitmap(buffer);
+    FrameOutputOptions outputOptions = options;
+    outputOptions.pThreadPool = threadPool.get();
+    convertFrame(renderTarget, buffer, outputOptions);
+}
+
+// true if the msaa buffers of the 2 states are laid out the same
+static bool sameRenderTargets(const PipelineState& a, const PipelineState& b)
+{
+    if (a.width != b.width || a.height != b.height || a.msCount != b.msCount || a.msaaStorage != b.msaaStorage ||
+        a.colorFormat != b.colorFormat || a.depthFormat != b.depthFormat || a.shadingMode != b.shadingMode)
+    {
+        return false;
+    }
+    for (int i = 0; i < a.msCount; ++i)
+    {
+        if (a.sampleCoords[i] != b.sampleCoords[i])
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
 void Pipeline::setPipelineState(const PipelineState& state)
 {
+    assert(state.msCount >= 1 && state.msCount <= PIPELINE_MAX_MS_COUNT);
+    // the buffers are kept if only the rasterizer state changes, e.g. a command buffer sets the same state every frame
+    bool keepRenderTargets = !msaaMask.empty() && sameRenderTargets(this->state, state);
     this->state = state;
+    fullMaskCenter = Vec2f(0.0f, 0.0f);
+    for (int i = 0; i < state.msCount; ++i)
+    {
+        fullMaskCenter += state.sampleCoords[i];
+    }
+    fullMaskCenter /= float(state.msCount);
     resetRenderTargetState();
-    resetMSAARenderTarget();
+    if (!keepRenderTargets)
+    {
+        resetTiles();
+        resetMSAARenderTarget();
+    }
+    resetThreadPool();
+    resetOcclusionBuffer();
 }
 
 void Pipeline::clearRenderTarget(Vec3f color, float depth)
 {
-    // clear msaa render target
-    for (int m = 0; m < state.msCount; ++m)
+    // the msaa buffers are cleared tile by tile when written, the present render target is fully written by the resolve
+    std::fill(tileNeedsClear.begin(), tileNeedsClear.end(), (uint8_t)1);
+    // all samples are at the clear depth, give or take the precision of the depth format
+    float precision = getTexelPrecision(state.depthFormat);
+    std::fill(hiZMin.begin(), hiZMin.end(), depth - precision);
+    std::fill(hiZMax.begin(), hiZMax.end(), depth + precision);
+    lastClearColor = color;
+    lastClearDepth = depth;
+    // triangles of the last frame are not visible any more
+    visibilityVertices.clear();
+    visibilityTriangleDraws.clear();
+    visibilityDraws.clear();
+    for (std::vector<uint32_t>& draws : tileDraws)
+    {
+        draws.clear();
+    }
+}
+
+void Pipeline::clearOcclusionBuffer()
+{
+    std::fill(occlusionDepth.begin(), occlusionDepth.end(), 1.0f);
+    std::fill(occlusionMasks.begin(), occlusionMasks.end(), (uint16_t)0);
+    std::fill(occlusionFarDepths.begin(), occlusionFarDepths.end(), 0.0f);
+}
+
+void Pipeline::renderOccluders()
+{
+    occluderPass = true;
+    drawTriangles();
+    occluderPass = false;
+}
+
+bool Pipeline::queryOcclusion(const Vec3f& boxMin, const Vec3f& boxMax, const Mat4x4f& transform) const
+{
+    // the screen rect of the box in the occlusion buffer, and the nearest depth of it
+    const float scale = 1.0f / (float)state.occlusionDownscale;
+    Vec2f rectMin(1e30f, 1e30f);
+    Vec2f rectMax(-1e30f, -1e30f);
+    float zNear = 1e30f;
+    for (int i = 0; i < 8; ++i)
     {
-        for (int i = 0; i < state.width * state.height; ++i)
+        Vec4f p = Vec4f((i & 1) ? boxMax.x : boxMin.x, (i & 2) ? boxMax.y : boxMin.y, (i & 4) ? boxMax.z : boxMin.z, 1.0f) * transform;
+        // the box gets through the near plane, it may cover the whole screen
+        if (p.w < state.near)
         {
-            msaaColorBuffer[m].data[i] = color;
-            msaaDepthBuffer[m].data[i] = depth;
+            return true;
         }
+        doPerspectiveDivision(p);
+        Vec2f screen = toScreenSpace(p) * scale;
+        rectMin = Vector_min(rectMin, screen);
+        rectMax = Vector_max(rectMax, screen);
+        zNear = std::min(zNear, p.z);
     }
-    // clear present render target
-    for (int i = 0; i < state.width * state.height; ++i)
+    int xstart = std::max((int)std::floor(rectMin.x), 0);
+    int xend = std::min((int)std::floor(rectMax.x), occlusionWidth - 1);
+    int ystart = std::max((int)std::floor(rectMin.y), 0);
+    int yend = std::min((int)std::floor(rectMax.y), occlusionHeight - 1);
+    // a sample of the box passes the depth test if it is nearer than the occluders in some texel
+    for (int y = ystart; y <= yend; ++y)
     {
-        renderTarget.data[i] = color;
-        depthBuffer.data[i] = depth;
+        const float* row = &occlusionDepth[y * occlusionWidth];
+        for (int x = xstart; x <= xend; ++x)
+        {
+            if (zNear < row[x])
+            {
+                return true;
+            }
+        }
     }
-    lastClearColor = color;
-    lastClearDepth = depth;
+    return false;
 }
 
-void Pipeline::rasterTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2)
+void Pipeline::rasterTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2, const Vec4i& scissor, uint32_t triangleId)
 {
-    // TODO?: test per tile of 4x8 pixels
     int xstart, xend, ystart, yend;
     int x, y, i, j;
     // get the SV_Position of all input
-    const Vec4f& pos0 = v0.v4f.at(SV_Position);
-    const Vec4f& pos1 = v1.v4f.at(SV_Position);
-    const Vec4f& pos2 = v2.v4f.at(SV_Position);
+    const Vec4f& pos0 = v0.v4f(SV_Position);
+    const Vec4f& pos1 = v1.v4f(SV_Position);
+    const Vec4f& pos2 = v2.v4f(SV_Position);
     // transform input positions to screen space
-    Vec2f p0 = (pos0.xy() + Vec2f(1.0f, 1.0f)) * Vec2f(0.5f, 0.5f) * Vec2f((float)state.width, (float)state.height);
-    Vec2f p1 = (pos1.xy() + Vec2f(1.0f, 1.0f)) * Vec2f(0.5f, 0.5f) * Vec2f((float)state.width, (float)state.height);
-    Vec2f p2 = (pos2.xy() + Vec2f(1.0f, 1.0f)) * Vec2f(0.5f, 0.5f) * Vec2f((float)state.width, (float)state.height);
-    // if triangle in screen space or NDC space is 0 in size, clip
-    if(triangleIsZeroInSize(p0, p1, p2) || triangleIsZeroInSize(pos0.xy(), pos1.xy(), pos2.xy()))
+    Vec2f p0 = toScreenSpace(pos0);
+    Vec2f p1 = toScreenSpace(pos1);
+    Vec2f p2 = toScreenSpace(pos2);
+    // get the bounding box of triangle in the scissor rect, from (xstart, ystart) to (xend, yend)(not include)
+    xstart = std::max((int)std::min({ p0.x, p1.x, p2.x }), scissor[0]);
+    xend = std::min((int)std::max({ p0.x, p1.x, p2.x }) + 1, scissor[2]);
+    ystart = std::max((int)std::min({ p0.y, p1.y, p2.y }), scissor[1]);
+    yend = std::min((int)std::max({ p0.y, p1.y, p2.y }) + 1, scissor[3]);
+    if (xstart >= xend || ystart >= yend)
     {
         return;
     }
-    // get the bounding box of triangle, from (xstart, ystart) to (xend, yend)(not include)
-    xstart = std::max((int)std::min({ p0.x, p1.x, p2.x }), 0);
-    xend = std::min((int)std::max({ p0.x, p1.x, p2.x }) + 1, state.width);
-    ystart = std::max((int)std::min({ p0.y, p1.y, p2.y }), 0);
-    yend = std::min((int)std::max({ p0.y, p1.y, p2.y }) + 1, state.height);
     // for processing 2x2 pixels
     xstart = xstart & (~1);
     xend = (xend + 1) & (~1);
     ystart = ystart & (~1);
     yend = (yend + 1) & (~1);
-    // traverse all possible pixels
-    for (x = xstart; x < xend; x += 2)
+    TriangleSetup setup;
+    if (!setupTriangle(setup, Vec3f(p0, pos0.z), Vec3f(p1, pos1.z), Vec3f(p2, pos2.z), state.sampleCoords.data(), state.msCount))
     {
-        for (y = ystart; y < yend; y += 2)
+        return;
+    }
+    const uint32_t fullMask = (1U << state.msCount) - 1U;
+    const bool visibility = state.shadingMode == SHADING_MODE_VISIBILITY_BUFFER;
+    // traverse all 8x8 blocks overlapping the bounding box
+    for (int by = ystart & (~7); by < yend; by += 8)
+    {
+        for (int bx = xstart & (~7); bx < xend; bx += 8)
         {
-            Vec2f avgCenters[4] = { {0.0f, 0.0f}, {0.0f, 0.0f}, {0.0f, 0.0f}, {0.0f, 0.0f} };
-            // if one of the 2x2 pixels should shade, the bit would be set to 1
-            uint32_t shadingMask = 0;
-            uint32_t newMasks[4] = {0U, 0U, 0U, 0U};
-            for(j = 0; j < 4; j++)
+            // trivial reject
+            float eBlock[3];
+            bool inside;
+            if (!testBlockCoverage(setup, bx, by, eBlock, inside))
             {
-                int coverCount = 0;
-                // (px, py) is the real coord of this very pixel
-                int px = x + pixel2x2Steps[j].x;
-                int py = y + pixel2x2Steps[j].y;
-                for (i = 0; i < state.msCount; ++i)
+                continue;
+            }
+            // reject the block if it is hidden
+            float blockZMin, blockZMax;
+            DepthTestResult depthTest = testBlockDepth(setup, bx, by, blockZMin, blockZMax);
+            if (depthTest == DEPTH_TEST_ALL_FAIL)
+            {
+                continue;
+            }
+            // blocks are in one tile, the first one may write fills the tile with the clear values
+            int tile = bx / PIPELINE_TILE_SIZE + (by / PIPELINE_TILE_SIZE) * tileCountX;
+            if (tileNeedsClear[tile] != 0)
+            {
+                clearTile(tile);
+            }
+            bool written = false;
+            int qxstart = std::max(bx, xstart);
+            int qxend = std::min(bx + 8, xend);
+            int qystart = std::max(by, ystart);
+            int qyend = std::min(by + 8, yend);
+            for (y = qystart; y < qyend; y += 2)
+            {
+                for (x = qxstart; x < qxend; x += 2)
                 {
-                    Vec2f p = Vec2f(float(px) + state.sampleCoords[i].x, float(py) + state.sampleCoords[i].y);
-                    // test if triangle covers this sample
-                    if (pointInTriangle(p, p0, p1, p2))
+                    // the edge functions of the 2x2 pixels only depend on the block and the position in it
+                    float eQuad[3];
+                    for (i = 0; i < 3; ++i)
                     {
-                        avgCenters[j] += state.sampleCoords[i];
-                        ++coverCount;
-                        newMasks[j] |= (1U << i);
+                        eQuad[i] = eBlock[i] + setup.A[i] * (float)(x - bx) + setup.B[i] * (float)(y - by);
+                    }
+                    uint32_t newMasks[4];
+                    if (inside)
+                    {
+                        // trivial accept, all samples of the block are covered
+                        newMasks[0] = newMasks[1] = newMasks[2] = newMasks[3] = fullMask;
+                    }
+                    else
+                    {
+                        // test all samples of the 2x2 pixels at once, lane j * msCount + i is sample i of pixel j
+                        uint64_t covered = getQuadCoverage(setup, eQuad);
+                        for (j = 0; j < 4; ++j)
+                        {
+                            newMasks[j] = (uint32_t)(covered >> (j * state.msCount)) & fullMask;
+                        }
+                    }
+                    // the 2x2 pixels may go out of the scissor rect by 1 pixel
+                    if (x + 1 >= scissor[2])
+                    {
+                        newMasks[1] = newMasks[3] = 0U;
+                    }
+                    if (y + 1 >= scissor[3])
+                    {
+                        newMasks[2] = newMasks[3] = 0U;
+                    }
+                    if ((newMasks[0] | newMasks[1] | newMasks[2] | newMasks[3]) != 0U)
+                    {
+                        written = (visibility ? writeQuadVisibility(x, y, newMasks, setup, depthTest, triangleId) :
+                            shadeQuad(x, y, newMasks, setup, depthTest, v0, v1, v2)) || written;
                     }
                 }
-                // get the average center of covered msaa sample points
-                // if triangle covers no sample, set the center to (0.5f, 0.5f)
-                if(coverCount > 0)
-                {
-                    avgCenters[j] /= float(coverCount);
-                    // if triangle covers at list 1 sample in 4 pixels, shade the 4 pixels
-                    shadingMask |= (1U << j);
-                }
-                else
-                {
-                    avgCenters[j] = Vec2f(0.5f, 0.5f);
-                }
-                avgCenters[j] += Vec2f((float)px, (float)py);
-                // to ndc space
-                avgCenters[j].x /= (float)state.width;
-                avgCenters[j].y /= (float)state.height;
-                avgCenters[j] *= Vec2f(2.0f, 2.0f);
-                avgCenters[j] -= Vec2f(1.0f, 1.0f);
             }
-            if(shadingMask == 0U)
+            if (written)
+            {
+                updateBlockDepth(bx, by, blockZMin, blockZMax, inside);
+            }
+        }
+    }
+}
+
+void Pipeline::rasterOccluder(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2)
+{
+    int x, y, i, j, k;
+    const Vec4f& pos0 = v0.v4f(SV_Position);
+    const Vec4f& pos1 = v1.v4f(SV_Position);
+    const Vec4f& pos2 = v2.v4f(SV_Position);
+    // transform input positions to the screen space of the occlusion buffer
+    const float scale = 1.0f / (float)state.occlusionDownscale;
+    Vec2f p0 = toScreenSpace(pos0) * scale;
+    Vec2f p1 = toScreenSpace(pos1) * scale;
+    Vec2f p2 = toScreenSpace(pos2) * scale;
+    int xstart = std::max((int)std::min({ p0.x, p1.x, p2.x }), 0);
+    int xend = std::min((int)std::max({ p0.x, p1.x, p2.x }) + 1, occlusionWidth);
+    int ystart = std::max((int)std::min({ p0.y, p1.y, p2.y }), 0);
+    int yend = std::min((int)std::max({ p0.y, p1.y, p2.y }) + 1, occlusionHeight);
+    if (xstart >= xend || ystart >= yend)
+    {
+        return;
+    }
+    // for processing 2x2 texels, the ones out of the buffer are skipped
+    xstart = xstart & (~1);
+    xend = (xend + 1) & (~1);
+    ystart = ystart & (~1);
+    yend = (yend + 1) & (~1);
+    // the pixel centers of a texel are its samples, as msaa samples of a pixel
+    const int sampleCount = (int)occlusionSampleCoords.size();
+    const uint32_t fullMask = (1U << sampleCount) - 1U;
+    TriangleSetup setup;
+    if (!setupTriangle(setup, Vec3f(p0, pos0.z), Vec3f(p1, pos1.z), Vec3f(p2, pos2.z), occlusionSampleCoords.data(), sampleCount))
+    {
+        return;
+    }
+    for (int by = ystart & (~7); by < yend; by += 8)
+    {
+        for (int bx = xstart & (~7); bx < xend; bx += 8)
+        {
+            float eBlock[3];
+            bool inside;
+            if (!testBlockCoverage(setup, bx, by, eBlock, inside))
             {
                 continue;
             }
-            // gen pixel input for 2x2 pixels
-            ShaderContext pIn[4];
-            Vec3f f00 = getPerspectiveCorrectFactor(avgCenters[0], pos0, pos1, pos2);
-            Vec3f f10 = getPerspectiveCorrectFactor(avgCenters[1], pos0, pos1, pos2);
-            Vec3f f01 = getPerspectiveCorrectFactor(avgCenters[2], pos0, pos1, pos2);
-            Vec3f f11 = getPerspectiveCorrectFactor(avgCenters[3], pos0, pos1, pos2);
-            shaderContextLerp(pIn[0], f00, v0, v1, v2);
-            shaderContextLerp(pIn[1], f10, v0, v1, v2);
-            shaderContextLerp(pIn[2], f01, v0, v1, v2);
-            shaderContextLerp(pIn[3], f11, v0, v1, v2);
-            // set ddxUV and ddyUV
-            pIn[0].v2f[SV_ddxUV] = pIn[1].v2f[SV_ddxUV] = pIn[1].v2f[SV_uv] - pIn[0].v2f[SV_uv];
-            pIn[2].v2f[SV_ddxUV] = pIn[3].v2f[SV_ddxUV] = pIn[3].v2f[SV_uv] - pIn[2].v2f[SV_uv];
-            pIn[0].v2f[SV_ddyUV] = pIn[2].v2f[SV_ddyUV] = pIn[2].v2f[SV_uv] - pIn[0].v2f[SV_uv];
-            pIn[1].v2f[SV_ddyUV] = pIn[3].v2f[SV_ddyUV] = pIn[3].v2f[SV_uv] - pIn[1].v2f[SV_uv];
-            // shade the covered pixel, and get the depth
-            for(j = 0; j < 4; j++)
-            {
-                if((shadingMask & (1U << j))  != 0)
+            int qxstart = std::max(bx, xstart);
+            int qxend = std::min(bx + 8, xend);
+            int qystart = std::max(by, ystart);
+            int qyend = std::min(by + 8, yend);
+            for (y = qystart; y < qyend; y += 2)
+            {
+                for (x = qxstart; x < qxend; x += 2)
                 {
-                    float newDepth = pIn[j].v4f[SV_Position].z;
-                    Vec4f color = pPixelShader->excute(pIn[j], uniforms, state);
-                    // (px, py) is the real coord of this very pixel
-                    int px = x + pixel2x2Steps[j].x;
-                    int py = y + pixel2x2Steps[j].y;
-                    for (i = 0; i < state.msCount; ++i)
+                    float eQuad[3];
+                    for (i = 0; i < 3; ++i)
                     {
-                        if ((newMasks[j] & (1U << i)) != 0U)
+                        eQuad[i] = eBlock[i] + setup.A[i] * (float)(x - bx) + setup.B[i] * (float)(y - by);
+                    }
+                    uint64_t covered = inside ? ~0ULL : getQuadCoverage(setup, eQuad);
+                    float quadDepth = setup.evaluateDepth((float)x, (float)y);
+                    for (j = 0; j < 4; ++j)
+                    {
+                        int tx = x + pixel2x2Steps[j].x;
+                        int ty = y + pixel2x2Steps[j].y;
+                        uint32_t mask = (uint32_t)(covered >> (j * sampleCount)) & fullMask;
+                        if (mask == 0U || tx >= occlusionWidth || ty >= occlusionHeight)
+                        {
+                            continue;
+                        }
+                        // the farthest depth of the triangle at the covered samples, the lane depths are relative
+                        // to quadDepth and may be negative, so the max starts from the first covered lane
+                        float depth = 0.0f;
+                        bool firstLane = true;
+                        for (k = 0; k < sampleCount; ++k)
                         {
-                            // if the new depth is smaller,
-                            // or this sample have not been writen
-                            if (msaaDepthBuffer[i].data[px + py * state.width] > newDepth)
+                            if ((mask & (1U << k)) != 0U)
                             {
-                                msaaColorBuffer[i].data[px + py * state.width] = color.xyz();
-                                msaaDepthBuffer[i].data[px + py * state.width] = newDepth;
+                                float laneDepth = setup.laneDepths[j * sampleCount + k];
+                                depth = firstLane ? laneDepth : std::max(depth, laneDepth);
+                                firstLane = false;
                             }
                         }
+                        depth = std::min(quadDepth + depth, setup.zMax);
+                        // every sample is covered by an occluder at least as near as the farthest depth
+                        int texel = tx + ty * occlusionWidth;
+                        occlusionMasks[texel] |= (uint16_t)mask;
+                        occlusionFarDepths[texel] = std::max(occlusionFarDepths[texel], depth);
+                        if (occlusionMasks[texel] == fullMask)
+                        {
+                            occlusionDepth[texel] = occlusionFarDepths[texel];
+                        }
                     }
-                    // refresh the msaa sample mask
-                    msaaMask[px + py * state.width] |= newMasks[j];
                 }
             }
-            // END OF operation for pixels
         }
     }
 }
 
-std::vector<ShaderContext> Pipeline::clippingTriangle(ShaderContext& v0, ShaderContext& v1, ShaderContext& v2)
+bool Pipeline::testBlockCoverage(const TriangleSetup& setup, int bx, int by, float eBlock[3], bool& inside) const
+{
+    // all samples in the block are in [bx, bx + 8] x [by, by + 8]
+    // test the corners of it which are the farthest along and against each edge normal
+    bool outside = false;
+    inside = true;
+    for (int i = 0; i < 3; ++i)
+    {
+        eBlock[i] = setup.evaluateBlock(i, bx, by);
+        float eMax = eBlock[i] + std::max(setup.A[i], 0.0f) * 8.0f + std::max(setup.B[i], 0.0f) * 8.0f;
+        float eMin = eBlock[i] + std::min(setup.A[i], 0.0f) * 8.0f + std::min(setup.B[i], 0.0f) * 8.0f;
+        outside = outside || eMax < 0.0f;
+        inside = inside && (setup.edgeInclusive[i] ? eMin >= 0.0f : eMin > 0.0f);
+    }
+    return !outside;
+}
+
+uint64_t Pipeline::getQuadCoverage(const TriangleSetup& setup, const float eQuad[3]) const
+{
+    return simdNotNegativeMask(eQuad[0], setup.laneOffsets[0], setup.laneCount, setup.edgeInclusive[0])
+        & simdNotNegativeMask(eQuad[1], setup.laneOffsets[1], setup.laneCount, setup.edgeInclusive[1])
+        & simdNotNegativeMask(eQuad[2], setup.laneOffsets[2], setup.laneCount, setup.edgeInclusive[2]);
+}
+
+bool Pipeline::setupTriangle(TriangleSetup& setup, Vec3f p0, Vec3f p1, Vec3f p2, const Vec2f* sampleCoords, int sampleCount) const
+{
+    // edge i is the edge opposite to vertex i
+    const Vec2f starts[3] = { p1.xy(), p2.xy(), p0.xy() };
+    const Vec2f ends[3] = { p2.xy(), p0.xy(), p1.xy() };
+    int i, j, k;
+    // twice the signed area
+    float area2 = (p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x);
+    if (area2 == 0.0f)
+    {
+        return false;
+    }
+    // make the inside positive whatever the winding is
+    setup.edgeSign = area2 < 0.0f ? -1.0f : 1.0f;
+    area2 = std::abs(area2);
+    // the origin only depends on the triangle, so are the depths
+    setup.origin = Vec2f((float)((int)std::floor(std::min({ p0.x, p1.x, p2.x })) & (~7)), (float)((int)std::floor(std::min({ p0.y, p1.y, p2.y })) & (~7)));
+    float C[3];
+    for (i = 0; i < 3; ++i)
+    {
+        setup.edgeStart[i] = starts[i];
+        setup.edgeEnd[i] = ends[i];
+        setup.A[i] = (starts[i].y - ends[i].y) * setup.edgeSign;
+        setup.B[i] = (ends[i].x - starts[i].x) * setup.edgeSign;
+        // the edge which the inside is at the right of, or below if it is horizontal, covers the samples on it
+        // the same edge of the triangle at the other side gets the opposite A and B, and doesn't
+        setup.edgeInclusive[i] = setup.A[i] > 0.0f || (setup.A[i] == 0.0f && setup.B[i] > 0.0f);
+        Vec2f a = starts[i] - setup.origin;
+        Vec2f b = ends[i] - setup.origin;
+        C[i] = (a.x * b.y - a.y * b.x) * setup.edgeSign;
+    }
+    // barycentric factor of vertex i is E(i) / area2, so depth is the sum of E(i) * z(i) / area2
+    const float z[3] = { p0.z, p1.z, p2.z };
+    setup.zA = (setup.A[0] * z[0] + setup.A[1] * z[1] + setup.A[2] * z[2]) / area2;
+    setup.zB = (setup.B[0] * z[0] + setup.B[1] * z[1] + setup.B[2] * z[2]) / area2;
+    setup.zC = (C[0] * z[0] + C[1] * z[1] + C[2] * z[2]) / area2;
+    setup.zMin = std::min({ z[0], z[1], z[2] });
+    setup.zMax = std::max({ z[0], z[1], z[2] });
+    // offsets of all samples of the 2x2 pixels from the left top of them
+    setup.laneCount = 4 * sampleCount;
+    for (i = 0; i < 3; ++i)
+    {
+        for (j = 0; j < 4; ++j)
+        {
+            for (k = 0; k < sampleCount; ++k)
+            {
+                float dx = (float)pixel2x2Steps[j].x + sampleCoords[k].x;
+                float dy = (float)pixel2x2Steps[j].y + sampleCoords[k].y;
+                setup.laneOffsets[i][j * sampleCount + k] = setup.A[i] * dx + setup.B[i] * dy;
+                if (i == 0)
+                {
+                    setup.laneDepths[j * sampleCount + k] = setup.zA * dx + setup.zB * dy;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+DepthTestResult Pipeline::testBlockDepth(const TriangleSetup& setup, int bx, int by, float& blockZMin, float& blockZMax) const
+{
+    // depth range of the triangle in the block, from the corners of the block and the vertices
+    float z = setup.evaluateDepth((float)bx, (float)by);
+    blockZMin = std::max(z + std::min(setup.zA, 0.0f) * 8.0f + std::min(setup.zB, 0.0f) * 8.0f, setup.zMin);
+    blockZMax = std::min(z + std::max(setup.zA, 0.0f) * 8.0f + std::max(setup.zB, 0.0f) * 8.0f, setup.zMax);
+    if (!state.enableDepthTest)
+    {
+        return DEPTH_TEST_ALL_PASS;
+    }
+    int block = (bx >> 3) + (by >> 3) * hiZWidth;
+    // a sample passes if it is nearer than the stored depth
+    if (blockZMin >= hiZMax[block])
+    {
+        return DEPTH_TEST_ALL_FAIL;
+    }
+    if (blockZMax < hiZMin[block])
+    {
+        return DEPTH_TEST_ALL_PASS;
+    }
+    return DEPTH_TEST_PER_SAMPLE;
+}
+
+void Pipeline::updateBlockDepth(int bx, int by, float blockZMin, float blockZMax, bool fullyCovered)
+{
+    int block = (bx >> 3) + (by >> 3) * hiZWidth;
+    // the stored depths are rounded to the depth format
+    float precision = getTexelPrecision(state.depthFormat);
+    blockZMin -= precision;
+    blockZMax += precision;
+    hiZMin[block] = std::min(hiZMin[block], blockZMin);
+    if (!state.enableDepthTest)
+    {
+        // without depth test, the written depth may be greater than the stored one
+        hiZMax[block] = std::max(hiZMax[block], blockZMax);
+    }
+    else if (fullyCovered)
+    {
+        // every sample either passed and got a depth not greater than blockZMax, or failed and was already nearer
+        hiZMax[block] = std::min(hiZMax[block], blockZMax);
+    }
+}
+
+bool Pipeline::shadeQuad(int x, int y, uint32_t newMasks[4], const TriangleSetup& setup, DepthTestResult depthTest,
+    const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2)
+{
+    // depth of the left top of the 2x2 pixels, sample depths are relative to it
+    float quadDepth = setup.evaluateDepth((float)x, (float)y);
+    // early depth test, pixel shaders can't write depth so hidden samples can be dropped before shading
+    if (depthTest == DEPTH_TEST_PER_SAMPLE && !testQuadDepth(x, y, newMasks, setup, quadDepth))
+    {
+        return false;
+    }
+    // gen pixel input for 2x2 pixels
+    ShaderContext pIn[4] = { ShaderContext(&pixelLayout), ShaderContext(&pixelLayout), ShaderContext(&pixelLayout), ShaderContext(&pixelLayout) };
+    // if one of the 2x2 pixels should shade, the bit would be set to 1
+    uint32_t shadingMask = interpolateQuad(x, y, newMasks, v0, v1, v2, pIn);
+    // shade the covered pixels, and write the samples passed the depth test
+    Vec4f colors[4];
+    pPixelShader->excuteQuad(pIn, shadingMask, colors);
+    for(int j = 0; j < 4; j++)
+    {
+        if((shadingMask & (1U << j))  != 0)
+        {
+            const Vec4f& color = colors[j];
+            // (px, py) is the real coord of this very pixel
+            int px = x + pixel2x2Steps[j].x;
+            int py = y + pixel2x2Steps[j].y;
+            writeSamples(px, py, newMasks[j], color.xyz(), quadDepth, &setup.laneDepths[j * state.msCount]);
+            // refresh the msaa sample mask
+            msaaMask[px + py * state.width] |= newMasks[j];
+        }
+    }
+    return true;
+}
+
+bool Pipeline::writeQuadVisibility(int x, int y, uint32_t newMasks[4], const TriangleSetup& setup, DepthTestResult depthTest, uint32_t triangleId)
+{
+    float quadDepth = setup.evaluateDepth((float)x, (float)y);
+    if (depthTest == DEPTH_TEST_PER_SAMPLE && !testQuadDepth(x, y, newMasks, setup, quadDepth))
+    {
+        return false;
+    }
+    for (int j = 0; j < 4; ++j)
+    {
+        if (newMasks[j] == 0U)
+        {
+            continue;
+        }
+        int pixel = x + pixel2x2Steps[j].x + (y + pixel2x2Steps[j].y) * state.width;
+        for (int i = 0; i < state.msCount; ++i)
+        {
+            if ((newMasks[j] & (1U << i)) != 0U)
+            {
+                size_t index = sampleIndex(pixel, i);
+                msaaDepthBuffer.store(index, quadDepth + setup.laneDepths[j * state.msCount + i]);
+                msaaTriangleIds[index] = triangleId;
+            }
+        }
+        msaaMask[pixel] |= newMasks[j];
+    }
+    // the 2x2 pixels are in one tile, and draws come in order
+    uint32_t draw = visibilityTriangleDraws[triangleId];
+    std::vector<uint32_t>& draws = tileDraws[x / PIPELINE_TILE_SIZE + (y / PIPELINE_TILE_SIZE) * tileCountX];
+    if (draws.empty() || draws.back() != draw)
+    {
+        draws.push_back(draw);
+    }
+    return true;
+}
+
+bool Pipeline::testQuadDepth(int x, int y, uint32_t newMasks[4], const TriangleSetup& setup, float quadDepth) const
+{
+    for (int j = 0; j < 4; j++)
+    {
+        if (newMasks[j] == 0U)
+        {
+            continue;
+        }
+        int index = x + pixel2x2Steps[j].x + (y + pixel2x2Steps[j].y) * state.width;
+        for (int i = 0; i < state.msCount; ++i)
+        {
+            float newDepth = quadDepth + setup.laneDepths[j * state.msCount + i];
+            // the new depth must be smaller
+            if ((newMasks[j] & (1U << i)) != 0U && !(msaaDepthBuffer.load(sampleIndex(index, i)) > newDepth))
+            {
+                newMasks[j] &= ~(1U << i);
+            }
+        }
+    }
+    return (newMasks[0] | newMasks[1] | newMasks[2] | newMasks[3]) != 0U;
+}
+
+uint32_t Pipeline::interpolateQuad(int x, int y, const uint32_t masks[4],
+    const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2, ShaderContext pIn[4]) const
+{
+    int i, j;
+    const Vec4f& pos0 = v0.v4f(SV_Position);
+    const Vec4f& pos1 = v1.v4f(SV_Position);
+    const Vec4f& pos2 = v2.v4f(SV_Position);
+    Vec2f avgCenters[4];
+    uint32_t shadingMask = 0;
+    for(j = 0; j < 4; j++)
+    {
+        // (px, py) is the real coord of this very pixel
+        int px = x + pixel2x2Steps[j].x;
+        int py = y + pixel2x2Steps[j].y;
+        // get the average center of covered msaa sample points
+        // if triangle covers no sample, set the center to (0.5f, 0.5f)
+        if (masks[j] == (1U << state.msCount) - 1U)
+        {
+            avgCenters[j] = fullMaskCenter;
+            shadingMask |= (1U << j);
+        }
+        else if (masks[j] != 0U)
+        {
+            int coverCount = 0;
+            avgCenters[j] = Vec2f(0.0f, 0.0f);
+            for (i = 0; i < state.msCount; ++i)
+            {
+                if ((masks[j] & (1U << i)) != 0U)
+                {
+                    avgCenters[j] += state.sampleCoords[i];
+                    ++coverCount;
+                }
+            }
+            avgCenters[j] /= float(coverCount);
+            // if triangle covers at list 1 sample in 4 pixels, shade the 4 pixels
+            shadingMask |= (1U << j);
+        }
+        else
+        {
+            avgCenters[j] = Vec2f(0.5f, 0.5f);
+        }
+        avgCenters[j] += Vec2f((float)px, (float)py);
+        // to ndc space
+        avgCenters[j].x /= (float)state.width;
+        avgCenters[j].y /= (float)state.height;
+        avgCenters[j] *= Vec2f(2.0f, 2.0f);
+        avgCenters[j] -= Vec2f(1.0f, 1.0f);
+    }
+    Vec3f f00 = getPerspectiveCorrectFactor(avgCenters[0], pos0, pos1, pos2);
+    Vec3f f10 = getPerspectiveCorrectFactor(avgCenters[1], pos0, pos1, pos2);
+    Vec3f f01 = getPerspectiveCorrectFactor(avgCenters[2], pos0, pos1, pos2);
+    Vec3f f11 = getPerspectiveCorrectFactor(avgCenters[3], pos0, pos1, pos2);
+    shaderContextLerp(pIn[0], f00, v0, v1, v2);
+    shaderContextLerp(pIn[1], f10, v0, v1, v2);
+    shaderContextLerp(pIn[2], f01, v0, v1, v2);
+    shaderContextLerp(pIn[3], f11, v0, v1, v2);
+    // set ddxUV and ddyUV if the pixel input has uv
+    if (pIn[0].layout->has(SV_ddxUV))
+    {
+        pIn[0].v2f(SV_ddxUV) = pIn[1].v2f(SV_ddxUV) = pIn[1].v2f(SV_uv) - pIn[0].v2f(SV_uv);
+        pIn[2].v2f(SV_ddxUV) = pIn[3].v2f(SV_ddxUV) = pIn[3].v2f(SV_uv) - pIn[2].v2f(SV_uv);
+        pIn[0].v2f(SV_ddyUV) = pIn[2].v2f(SV_ddyUV) = pIn[2].v2f(SV_uv) - pIn[0].v2f(SV_uv);
+        pIn[1].v2f(SV_ddyUV) = pIn[3].v2f(SV_ddyUV) = pIn[3].v2f(SV_uv) - pIn[1].v2f(SV_uv);
+    }
+    return shadingMask;
+}
+
+// colors in the pools of MSAA_STORAGE_COMPRESSED are packed like the msaa color buffer
+static void packColor(TexelFormat format, const Vec3f& color, uint8_t* dst)
+{
+    if (format == TEXEL_FORMAT_FLOAT)
+    {
+        memcpy(dst, &color, sizeof(Vec3f));
+        return;
+    }
+    packTexel(format, (const float*)&color, 3, dst);
+}
+
+static Vec3f unpackColor(TexelFormat format, const uint8_t* src)
+{
+    Vec3f color;
+    if (format == TEXEL_FORMAT_FLOAT)
+    {
+        memcpy((float*)&color, src, sizeof(Vec3f));
+        return color;
+    }
+    unpackTexel(format, src, (float*)&color, 3);
+    return color;
+}
+
+void Pipeline::writeSamples(int px, int py, uint32_t mask, const Vec3f& color, float depth, const float* depthOffsets)
+{
+    int i;
+    int pixel = px + py * state.width;
+    for (i = 0; i < state.msCount; ++i)
+    {
+        if ((mask & (1U << i)) != 0U)
+        {
+            msaaDepthBuffer.store(sampleIndex(pixel, i), depth + depthOffsets[i]);
+        }
+    }
+    writeSampleColors(px, py, mask, color);
+}
+
+void Pipeline::writeSampleColors(int px, int py, uint32_t mask, const Vec3f& color)
+{
+    int i;
+    int pixel = px + py * state.width;
+    if (state.msaaStorage != MSAA_STORAGE_COMPRESSED)
+    {
+        for (i = 0; i < state.msCount; ++i)
+        {
+            if ((mask & (1U << i)) != 0U)
+            {
+                msaaColorBuffer.store(sampleIndex(pixel, i), color);
+            }
+        }
+        return;
+    }
+    uint32_t& slot = msaaColorSlots[pixel];
+    // all samples get the color, the pixel is uniform again, its old slot is left unused until the next clear
+    if (mask == (1U << state.msCount) - 1U)
+    {
+        slot = PIPELINE_MSAA_UNIFORM;
+        msaaColorBuffer.store(pixel, color);
+        return;
+    }
+    std::vector<uint8_t>& pool = msaaColorPools[px / PIPELINE_TILE_SIZE + (py / PIPELINE_TILE_SIZE) * tileCountX];
+    const size_t slotBytes = msaaColorBytes * state.msCount;
+    if (slot == PIPELINE_MSAA_UNIFORM)
+    {
+        // expand the pixel, every sample starts with the uniform color
+        slot = (uint32_t)(pool.size() / slotBytes);
+        pool.resize(pool.size() + slotBytes);
+        packColor(msaaColorBuffer.format, msaaColorBuffer.load(pixel), &pool[slot * slotBytes]);
+        for (i = 1; i < state.msCount; ++i)
+        {
+            memcpy(&pool[slot * slotBytes + i * msaaColorBytes], &pool[slot * slotBytes], msaaColorBytes);
+        }
+    }
+    uint8_t* colors = &pool[slot * slotBytes];
+    for (i = 0; i < state.msCount; ++i)
+    {
+        if ((mask & (1U << i)) != 0U)
+        {
+            packColor(msaaColorBuffer.format, color, colors + i * msaaColorBytes);
+        }
+    }
+}
+
+Vec3f Pipeline::loadSampleColor(int pixel, int i) const
+{
+    if (state.msaaStorage != MSAA_STORAGE_COMPRESSED)
+    {
+        return msaaColorBuffer.load(sampleIndex(pixel, i));
+    }
+    uint32_t slot = msaaColorSlots[pixel];
+    if (slot == PIPELINE_MSAA_UNIFORM)
+    {
+        return msaaColorBuffer.load(pixel);
+    }
+    int px = pixel % state.width;
+    int py = pixel / state.width;
+    const std::vector<uint8_t>& pool = msaaColorPools[px / PIPELINE_TILE_SIZE + (py / PIPELINE_TILE_SIZE) * tileCountX];
+    return unpackColor(msaaColorBuffer.format, &pool[(slot * state.msCount + i) * msaaColorBytes]);
+}
+
+// signed distance of the vertex in clipping space to the plane, not negative if inside
+static float clipDistance(const Vec4f& v, uint32_t plane, float near, float far)
+{
+    switch (plane)
+    {
+    case CLIP_PLANE_NEAR:
+        return v.w - near;
+    case CLIP_PLANE_FAR:
+        return far - v.w;
+    case CLIP_PLANE_GUARD_LEFT:
+        return v.x + PIPELINE_GUARD_BAND * v.w;
+    case CLIP_PLANE_GUARD_RIGHT:
+        return PIPELINE_GUARD_BAND * v.w - v.x;
+    case CLIP_PLANE_GUARD_BOTTOM:
+        return v.y + PIPELINE_GUARD_BAND * v.w;
+    case CLIP_PLANE_GUARD_TOP:
+        return PIPELINE_GUARD_BAND * v.w - v.y;
+    default:
+        return 0.0f;
+    }
+}
+
+ShaderContext* Pipeline::clippingTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2, uint32_t clipCode, int& vertexCount)
+{
+    ShaderContext* src = clippingBuffer[0];
+    ShaderContext* dst = clippingBuffer[1];
+    src[0] = v0;
+    src[1] = v1;
+    src[2] = v2;
+    vertexCount = 3;
+    const int floatCount = v0.layout->floatCount();
+    float distances[PIPELINE_MAX_CLIP_VERTICES];
+    // clip the polygon by every plane some vertex is out of
+    for (uint32_t plane = 1U; plane <= clipCode && vertexCount >= 3; plane <<= 1)
+    {
+        if ((clipCode & plane) == 0U)
+        {
+            continue;
+        }
+        int i;
+        for (i = 0; i < vertexCount; ++i)
+        {
+            distances[i] = clipDistance(src[i].v4f(SV_Position), plane, state.near, state.far);
+        }
+        int count = 0;
+        for (i = 0; i < vertexCount; ++i)
+        {
+            int next = (i + 1) % vertexCount;
+            // keep the vertex inside
+            if (distances[i] >= 0.0f)
+            {
+                dst[count++] = src[i];
+            }
+            // add the intersection if the edge crosses the plane
+            if ((distances[i] >= 0.0f) != (distances[next] >= 0.0f))
+            {
+                float t = distances[i] / (distances[i] - distances[next]);
+                ShaderContext& out = dst[count++];
+                out.layout = src[i].layout;
+                for (int k = 0; k < floatCount; ++k)
+                {
+                    out.data[k] = src[i].data[k] + (src[next].data[k] - src[i].data[k]) * t;
+                }
+            }
+        }
+        vertexCount = count;
+        std::swap(src, dst);
+    }
+    if (vertexCount < 3)
+    {
+        vertexCount = 0;
+    }
+    return src;
+}
+
+void Pipeline::clearTile(int tile)
 {
-    // TODO: implementing clipping
-    return std::vector<ShaderContext>();
+    int x0 = (tile % tileCountX) * PIPELINE_TILE_SIZE;
+    int y0 = (tile / tileCountX) * PIPELINE_TILE_SIZE;
+    int count = std::min(x0 + PIPELINE_TILE_SIZE, state.width) - x0;
+    int y1 = std::min(y0 + PIPELINE_TILE_SIZE, state.height);
+    bool compressed = state.msaaStorage == MSAA_STORAGE_COMPRESSED;
+    for (int y = y0; y < y1; ++y)
+    {
+        int pixel = x0 + y * state.width;
+        std::fill(msaaMask.begin() + pixel, msaaMask.begin() + pixel + count, 0U);
+        if (state.msaaStorage == MSAA_STORAGE_PLANAR)
+        {
+            for (int i = 0; i < state.msCount; ++i)
+            {
+                msaaColorBuffer.fill(sampleIndex(pixel, i), count, lastClearColor);
+                msaaDepthBuffer.fill(sampleIndex(pixel, i), count, lastClearDepth);
+            }
+            continue;
+        }
+        // the samples of a row of pixels are together
+        msaaDepthBuffer.fill(sampleIndex(pixel, 0), (size_t)count * state.msCount, lastClearDepth);
+        if (compressed)
+        {
+            msaaColorBuffer.fill(pixel, count, lastClearColor);
+            std::fill(msaaColorSlots.begin() + pixel, msaaColorSlots.begin() + pixel + count, PIPELINE_MSAA_UNIFORM);
+        }
+        else
+        {
+            msaaColorBuffer.fill(sampleIndex(pixel, 0), (size_t)count * state.msCount, lastClearColor);
+        }
+    }
+    if (compressed)
+    {
+        msaaColorPools[tile].clear();
+    }
+    tileNeedsClear[tile] = 0;
 }
 
 void Pipeline::resetMSAARenderTarget()
 {
-    // reset msaa render targets count
-    if (state.msCount != (int)msaaColorBuffer.size())
+    // samples are planes one under another, or side by side in a row of pixels
+    int colorCount = state.msaaStorage == MSAA_STORAGE_COMPRESSED ? 1 : state.msCount;
+    if (state.msaaStorage == MSAA_STORAGE_PLANAR)
     {
-        msaaColorBuffer.clear();
-        msaaDepthBuffer.clear();
-        msaaColorBuffer.reserve(state.msCount);
-        msaaDepthBuffer.reserve(state.msCount);
+        msaaColorBuffer = Texture2D3F(state.width, state.height * colorCount, lastClearColor);
+        msaaDepthBuffer = Texture2D1F(state.width, state.height * state.msCount, lastClearDepth);
     }
-    // clear all msaa render targets
-    for (int i = 0; i < state.msCount; ++i)
+    else
     {
-        msaaColorBuffer.emplace_back(renderTarget.width, renderTarget.height, lastClearColor);
-        msaaDepthBuffer.emplace_back(renderTarget.width, renderTarget.height, lastClearDepth);
+        msaaColorBuffer = Texture2D3F(state.width * colorCount, state.height, lastClearColor);
+        msaaDepthBuffer = Texture2D1F(state.width * state.msCount, state.height, lastClearDepth);
     }
+    msaaColorBuffer.pack(state.colorFormat);
+    msaaDepthBuffer.pack(state.depthFormat);
+    msaaColorBytes = state.colorFormat == TEXEL_FORMAT_FLOAT ? sizeof(Vec3f) : getTexelBytes(state.colorFormat);
+    // all pixels start uniform
+    bool compressed = state.msaaStorage == MSAA_STORAGE_COMPRESSED;
+    msaaColorSlots.assign(compressed ? state.width * state.height : 0, PIPELINE_MSAA_UNIFORM);
+    msaaColorPools.clear();
+    msaaColorPools.resize(compressed ? tileCountX * tileCountY : 0);
     // clear masks to 0
     msaaMask.clear();
-    msaaMask.resize(renderTarget.width * renderTarget.height, 0);
+    msaaMask.resize(state.width * state.height, 0);
+    bool visibility = state.shadingMode == SHADING_MODE_VISIBILITY_BUFFER;
+    msaaTriangleIds.assign(visibility ? (size_t)state.width * state.height * state.msCount : 0, 0U);
+    visibilityVertices.clear();
+    visibilityTriangleDraws.clear();
+    visibilityDraws.clear();
+    tileDraws.clear();
+    tileDraws.resize(tileCountX * tileCountY);
+    // the new buffers hold the clear values
+    tileNeedsClear.assign(tileCountX * tileCountY, 0);
+    // the tent is 1 pixel in radius around the pixel center, the samples of the pixel itself always have weights
+    tentWeights.resize(9 * state.msCount);
+    for (int oy = -1; oy <= 1; ++oy)
+    {
+        for (int ox = -1; ox <= 1; ++ox)
+        {
+            for (int i = 0; i < state.msCount; ++i)
+            {
+                float dx = (float)ox + state.sampleCoords[i].x - 0.5f;
+                float dy = (float)oy + state.sampleCoords[i].y - 0.5f;
+                tentWeights[(ox + 1 + (oy + 1) * 3) * state.msCount + i] =
+                    std::max(1.0f - std::abs(dx), 0.0f) * std::max(1.0f - std::abs(dy), 0.0f);
+            }
+        }
+    }
+    // reset the hierarchical z buffer
+    hiZWidth = (state.width + 7) / 8;
+    float precision = getTexelPrecision(state.depthFormat);
+    hiZMin.assign(hiZWidth * ((state.height + 7) / 8), lastClearDepth - precision);
+    hiZMax.assign(hiZWidth * ((state.height + 7) / 8), lastClearDepth + precision);
 }
 
 void Pipeline::resetRenderTargetState()
 {
-    // if size of the render target changed, recreate it
-    if (renderTarget.width != state.width || renderTarget.height != state.height)
+    // if size or format of the render target changed, recreate it
+    if (renderTarget.width != (size_t)state.width || renderTarget.height != (size_t)state.height ||
+        renderTarget.format != state.colorFormat || depthBuffer.format != state.depthFormat)
     {
         renderTarget = Texture2D3F(state.width, state.height);
         depthBuffer = Texture2D1F(state.width, state.height);
+        renderTarget.pack(state.colorFormat);
+        depthBuffer.pack(state.depthFormat);
     }
 }
 
-void Pipeline::mergeMSAARenderTarget()
+void Pipeline::resetTiles()
 {
-    int i, c, x, y;
-    float d;
-    Vec3f color;
-    for (x = 0; x < state.width; ++x)
+    tileCountX = (state.width + PIPELINE_TILE_SIZE - 1) / PIPELINE_TILE_SIZE;
+    tileCountY = (state.height + PIPELINE_TILE_SIZE - 1) / PIPELINE_TILE_SIZE;
+    tileBins.clear();
+    tileBins.resize(tileCountX * tileCountY);
+    binnedVertices.clear();
+    binnedTriangleIds.clear();
+}
+
+void Pipeline::resetOcclusionBuffer()
+{
+    assert(state.occlusionDownscale >= 1 && state.occlusionDownscale * state.occlusionDownscale <= PIPELINE_MAX_MS_COUNT);
+    int width = (state.width + state.occlusionDownscale - 1) / state.occlusionDownscale;
+    int height = (state.height + state.occlusionDownscale - 1) / state.occlusionDownscale;
+    int sampleCount = state.occlusionDownscale * state.occlusionDownscale;
+    if (width != occlusionWidth || height != occlusionHeight || (int)occlusionSampleCoords.size() != sampleCount)
     {
-        for (y = 0; y < state.height; ++y)
+        occlusionWidth = width;
+        occlusionHeight = height;
+        occlusionDepth.resize((size_t)width * height);
+        occlusionMasks.resize((size_t)width * height);
+        occlusionFarDepths.resize((size_t)width * height);
+        clearOcclusionBuffer();
+        occlusionSampleCoords.clear();
+        for (int y = 0; y < state.occlusionDownscale; ++y)
         {
-            c = 0;
-            d = 2.0f;
-            color = { 0.0f, 0.0f, 0.0f };
-            for (i = 0; i < state.msCount; ++i)
+            for (int x = 0; x < state.occlusionDownscale; ++x)
             {
-                if ((msaaMask[x + y * state.width] & (1U << i)) != 0)
+                occlusionSampleCoords.push_back(Vec2f(((float)x + 0.5f) / state.occlusionDownscale, ((float)y + 0.5f) / state.occlusionDownscale));
+            }
+        }
+    }
+}
+
+void Pipeline::resetThreadPool()
+{
+    // the vertex stage uses the thread pool in all raster modes
+    int threadCount = state.threadCount > 0 ? state.threadCount : std::max(1, (int)std::thread::hardware_concurrency());
+    if (!threadPool || threadPool->getThreadCount() != threadCount)
+    {
+        threadPool.reset(new ThreadPool(threadCount));
+    }
+}
+
+void Pipeline::shadeVisibilityBuffer()
+{
+    // a pixel shader is bound to the uniforms of one draw at a time, so draws are shaded one after another,
+    // each on the tiles it has samples in, in parallel
+    for (uint32_t draw = 0; draw < (uint32_t)visibilityDraws.size(); ++draw)
+    {
+        const VisibilityDraw& d = visibilityDraws[draw];
+        d.pPixelShader->bind(*d.pUniforms, state);
+        threadPool->parallelFor(tileCountX * tileCountY, [this, draw](int tile)
+        {
+            const std::vector<uint32_t>& draws = tileDraws[tile];
+            if (tileNeedsClear[tile] == 0 && std::binary_search(draws.begin(), draws.end(), draw))
+            {
+                shadeVisibilityTile(tile, draw);
+            }
+        });
+    }
+}
+
+void Pipeline::shadeVisibilityTile(int tile, uint32_t draw)
+{
+    const VisibilityDraw& d = visibilityDraws[draw];
+    int x0 = (tile % tileCountX) * PIPELINE_TILE_SIZE;
+    int y0 = (tile / tileCountX) * PIPELINE_TILE_SIZE;
+    int x1 = std::min(x0 + PIPELINE_TILE_SIZE, state.width);
+    int y1 = std::min(y0 + PIPELINE_TILE_SIZE, state.height);
+    uint32_t ids[4][PIPELINE_MAX_MS_COUNT];
+    for (int y = y0; y < y1; y += 2)
+    {
+        for (int x = x0; x < x1; x += 2)
+        {
+            int i, j;
+            // the written samples of the 2x2 pixels whose triangles belong to the draw
+            uint32_t pending[4];
+            for (j = 0; j < 4; ++j)
+            {
+                pending[j] = 0U;
+                int px = x + pixel2x2Steps[j].x;
+                int py = y + pixel2x2Steps[j].y;
+                if (px >= x1 || py >= y1)
+                {
+                    continue;
+                }
+                int pixel = px + py * state.width;
+                uint32_t mask = msaaMask[pixel];
+                for (i = 0; i < state.msCount; ++i)
                 {
-                    ++c;
-                    if (d > msaaDepthBuffer[i].get(x, y))
+                    if ((mask & (1U << i)) != 0U)
                     {
-                        d = msaaDepthBuffer[i].get(x, y);
+                        ids[j][i] = msaaTriangleIds[sampleIndex(pixel, i)];
+                        if (visibilityTriangleDraws[ids[j][i]] == draw)
+                        {
+                            pending[j] |= 1U << i;
+                        }
                     }
-                    color += msaaColorBuffer[i].get(x, y);
                 }
             }
-            if (c > 0)
+            // shade the 2x2 pixels once for every triangle visible in them
+            while ((pending[0] | pending[1] | pending[2] | pending[3]) != 0U)
             {
-                renderTarget.get(x, y) = color / float(state.msCount);
-                depthBuffer.get(x, y) = d;
+                // the triangle of the first pending sample
+                for (j = 0; pending[j] == 0U; ++j);
+                for (i = 0; (pending[j] & (1U << i)) == 0U; ++i);
+                uint32_t triangle = ids[j][i];
+                uint32_t masks[4];
+                for (j = 0; j < 4; ++j)
+                {
+                    masks[j] = 0U;
+                    for (i = 0; i < state.msCount; ++i)
+                    {
+                        if ((pending[j] & (1U << i)) != 0U && ids[j][i] == triangle)
+                        {
+                            masks[j] |= 1U << i;
+                        }
+                    }
+                    pending[j] &= ~masks[j];
+                }
+                const ShaderContext* v = &visibilityVertices[triangle * 3];
+                ShaderContext pIn[4] = { ShaderContext(&d.pixelLayout), ShaderContext(&d.pixelLayout), ShaderContext(&d.pixelLayout), ShaderContext(&d.pixelLayout) };
+                uint32_t shadingMask = interpolateQuad(x, y, masks, v[0], v[1], v[2], pIn);
+                Vec4f colors[4];
+                d.pPixelShader->excuteQuad(pIn, shadingMask, colors);
+                for (j = 0; j < 4; ++j)
+                {
+                    if ((shadingMask & (1U << j)) != 0U)
+                    {
+                        writeSampleColors(x + pixel2x2Steps[j].x, y + pixel2x2Steps[j].y, masks[j], colors[j].xyz());
+                    }
+                }
             }
         }
     }
 }
 
-bool Pipeline::shouldClip(Vec4f& v)
+void Pipeline::mergeMSAARenderTarget()
 {
-    return v.w < state.near || v.w > state.far ||
-        v.x < -v.w || v.x > v.w ||
-        v.y < -v.w || v.y > v.w;
+    // tiles write their own pixels of the present render target and only read the msaa buffers
+    threadPool->parallelFor(tileCountX * tileCountY, [this](int tile)
+    {
+        resolveTile(tile);
+    });
 }
 
-void shaderContextLerp(ShaderContext& out, Vec3f factor, const ShaderContext& in0, const ShaderContext& in1, const ShaderContext& in2)
+const float* Pipeline::getSampleColors(int pixel) const
 {
-    int key;
-    for (auto itr = in0.f.begin(); itr != in0.f.end(); ++itr)
+    if (msaaColorBuffer.format != TEXEL_FORMAT_FLOAT)
     {
-        key = itr->first;
-        out.f[key] = factor.x * in0.f.at(key) + factor.y * in1.f.at(key) + factor.z * in2.f.at(key);
+        return nullptr;
     }
-    for (auto itr = in0.v2f.begin(); itr != in0.v2f.end(); ++itr)
+    if (state.msaaStorage == MSAA_STORAGE_INTERLEAVED)
     {
-        key = itr->first;
-        out.v2f[key] = factor.x * in0.v2f.at(key) + factor.y * in1.v2f.at(key) + factor.z * in2.v2f.at(key);
+        return (const float*)&msaaColorBuffer.data[sampleIndex(pixel, 0)];
     }
-    for (auto itr = in0.v3f.begin(); itr != in0.v3f.end(); ++itr)
+    if (state.msaaStorage == MSAA_STORAGE_COMPRESSED && msaaColorSlots[pixel] != PIPELINE_MSAA_UNIFORM)
     {
-        key = itr->first;
-        out.v3f[key] = factor.x * in0.v3f.at(key) + factor.y * in1.v3f.at(key) + factor.z * in2.v3f.at(key);
+        int px = pixel % state.width;
+        int py = pixel / state.width;
+        const std::vector<uint8_t>& pool = msaaColorPools[px / PIPELINE_TILE_SIZE + (py / PIPELINE_TILE_SIZE) * tileCountX];
+        return (const float*)&pool[(size_t)msaaColorSlots[pixel] * state.msCount * msaaColorBytes];
     }
-    for (auto itr = in0.v4f.begin(); itr != in0.v4f.end(); ++itr)
+    return nullptr;
+}
+
+void Pipeline::resolveTile(int tile)
+{
+    int i, x, y;
+    int x0 = (tile % tileCountX) * PIPELINE_TILE_SIZE;
+    int y0 = (tile / tileCountX) * PIPELINE_TILE_SIZE;
+    int x1 = std::min(x0 + PIPELINE_TILE_SIZE, state.width);
+    int y1 = std::min(y0 + PIPELINE_TILE_SIZE, state.height);
+    // nothing is written to the tile since the last clear, but the tent filter reaches the neighbor tiles
+    if (tileNeedsClear[tile] != 0 && state.resolveFilter == RESOLVE_FILTER_BOX)
     {
-        key = itr->first;
-        out.v4f[key] = factor.x * in0.v4f.at(key) + factor.y * in1.v4f.at(key) + factor.z * in2.v4f.at(key);
+        for (y = y0; y < y1; ++y)
+        {
+            renderTarget.fill(x0 + y * state.width, x1 - x0, lastClearColor);
+            depthBuffer.fill(x0 + y * state.width, x1 - x0, lastClearDepth);
+        }
+        return;
     }
-    for (auto itr = in0.m4x4.begin(); itr != in0.m4x4.end(); ++itr)
+    // samples of a pixel are together, sum them 4 at a time
+    const bool simdSamples = state.msaaStorage != MSAA_STORAGE_PLANAR && state.msCount % 4 == 0;
+    const bool simdDepth = simdSamples && msaaDepthBuffer.format == TEXEL_FORMAT_FLOAT;
+    for (y = y0; y < y1; ++y)
+    {
+        for (x = x0; x < x1; ++x)
+        {
+            int pixel = x + y * state.width;
+            // the samples of the pixel all hold the clear values
+            if (tileNeedsClear[tile] != 0 || msaaMask[pixel] == 0U)
+            {
+                renderTarget.store(pixel, state.resolveFilter == RESOLVE_FILTER_TENT ? resolveTent(x, y) : lastClearColor);
+                depthBuffer.store(pixel, lastClearDepth);
+                continue;
+            }
+            // depth of all samples, the ones not written are at the clear depth
+            float zMin, zMax;
+            if (simdDepth)
+            {
+                simdMinMax(&msaaDepthBuffer.data[sampleIndex(pixel, 0)], state.msCount, zMin, zMax);
+            }
+            else
+            {
+                zMin = zMax = msaaDepthBuffer.load(sampleIndex(pixel, 0));
+                for (i = 1; i < state.msCount; ++i)
+                {
+                    float z = msaaDepthBuffer.load(sampleIndex(pixel, i));
+                    zMin = std::min(zMin, z);
+                    zMax = std::max(zMax, z);
+                }
+            }
+            depthBuffer.store(pixel, state.depthResolve == DEPTH_RESOLVE_MAX ? zMax : zMin);
+            Vec3f color;
+            if (state.resolveFilter == RESOLVE_FILTER_TENT)
+            {
+                color = resolveTent(x, y);
+            }
+            else if (state.msaaStorage == MSAA_STORAGE_COMPRESSED && msaaColorSlots[pixel] == PIPELINE_MSAA_UNIFORM)
+            {
+                color = msaaColorBuffer.load(pixel);
+            }
+            else
+            {
+                const float* colors = simdSamples ? getSampleColors(pixel) : nullptr;
+                if (colors != nullptr)
+                {
+                    float sum[3];
+                    simdSumVec3(colors, state.msCount, sum);
+                    color = Vec3f(sum[0], sum[1], sum[2]);
+                }
+                else
+                {
+                    color = loadSampleColor(pixel, 0);
+                    for (i = 1; i < state.msCount; ++i)
+                    {
+                        color += loadSampleColor(pixel, i);
+                    }
+                }
+                color /= float(state.msCount);
+            }
+            renderTarget.store(pixel, color);
+        }
+    }
+}
+
+Vec3f Pipeline::resolveTent(int px, int py) const
+{
+    Vec3f color(0.0f, 0.0f, 0.0f);
+    float weightSum = 0.0f;
+    for (int oy = -1; oy <= 1; ++oy)
+    {
+        for (int ox = -1; ox <= 1; ++ox)
+        {
+            int x = px + ox;
+            int y = py + oy;
+            // neighbors out of the screen are left out
+            if (x < 0 || x >= state.width || y < 0 || y >= state.height)
+            {
+                continue;
+            }
+            int pixel = x + y * state.width;
+            const float* weights = &tentWeights[(ox + 1 + (oy + 1) * 3) * state.msCount];
+            bool cleared = tileNeedsClear[x / PIPELINE_TILE_SIZE + (y / PIPELINE_TILE_SIZE) * tileCountX] != 0;
+            for (int i = 0; i < state.msCount; ++i)
+            {
+                if (weights[i] > 0.0f)
+                {
+                    color += weights[i] * (cleared ? lastClearColor : loadSampleColor(pixel, i));
+                    weightSum += weights[i];
+                }
+            }
+        }
+    }
+    return color / weightSum;
+}
+
+uint32_t Pipeline::getClipCode(const Vec4f& v) const
+{
+    uint32_t clipCode = 0U;
+    clipCode |= v.w < state.near ? (uint32_t)CLIP_PLANE_NEAR : 0U;
+    clipCode |= v.w > state.far ? (uint32_t)CLIP_PLANE_FAR : 0U;
+    clipCode |= v.x < -PIPELINE_GUARD_BAND * v.w ? (uint32_t)CLIP_PLANE_GUARD_LEFT : 0U;
+    clipCode |= v.x > PIPELINE_GUARD_BAND * v.w ? (uint32_t)CLIP_PLANE_GUARD_RIGHT : 0U;
+    clipCode |= v.y < -PIPELINE_GUARD_BAND * v.w ? (uint32_t)CLIP_PLANE_GUARD_BOTTOM : 0U;
+    clipCode |= v.y > PIPELINE_GUARD_BAND * v.w ? (uint32_t)CLIP_PLANE_GUARD_TOP : 0U;
+    clipCode |= v.x < -v.w ? (uint32_t)CLIP_PLANE_LEFT : 0U;
+    clipCode |= v.x > v.w ? (uint32_t)CLIP_PLANE_RIGHT : 0U;
+    clipCode |= v.y < -v.w ? (uint32_t)CLIP_PLANE_BOTTOM : 0U;
+    clipCode |= v.y > v.w ? (uint32_t)CLIP_PLANE_TOP : 0U;
+    return clipCode;
+}
+
+Vec2f Pipeline::toScreenSpace(const Vec4f& ndcPosition) const
+{
+    return (ndcPosition.xy() + Vec2f(1.0f, 1.0f)) * Vec2f(0.5f, 0.5f) * Vec2f((float)state.width, (float)state.height);
+}
+
+void shaderContextLerp(ShaderContext& out, Vec3f factor, const ShaderContext& in0, const ShaderContext& in1, const ShaderContext& in2)
+{
+    // all the values are packed floats, so lerp them in one loop
+    // the output may have more values than the input (e.g. built-in values), they are not touched
+    int count = in0.layout->floatCount();
+    float* dst = out.data;
+    const float* src0 = in0.data;
+    const float* src1 = in1.data;
+    const float* src2 = in2.data;
+    for (int i = 0; i < count; ++i)
     {
-        key = itr->first;
-        out.m4x4[key] = factor.x * in0.m4x4.at(key) + factor.y * in1.m4x4.at(key) + factor.z * in2.m4x4.at(key);
+        dst[i] = factor.x * src0[i] + factor.y * src1[i] + factor.z * src2[i];
     }
 }
@@ -1,7 +1,142 @@
 #pragma once
 
+#include <memory>
+#include "CommandBuffer.h"
+#include "FrameOutput.h"
+#include "Mesh.h"
 #include "Shader.h"
+#include "ThreadPool.h"
 
+// size of the screen tiles triangles are binned to in RASTER_MODE_TILED, must be even
+constexpr int PIPELINE_TILE_SIZE = 64;
+// max msaa sample count, all samples of 2x2 pixels are tested in one 64 bit mask
+constexpr int PIPELINE_MAX_MS_COUNT = 16;
+// triangles are clipped against x/y planes only when they get out of the guard band, which is
+// PIPELINE_GUARD_BAND times as wide as the view volume, the rest is left to the rasterizer's scissor
+constexpr float PIPELINE_GUARD_BAND = 4.0f;
+// every clipping plane adds at most 1 vertex to the triangle
+constexpr int PIPELINE_MAX_CLIP_VERTICES = 3 + 6;
+// in pixels, triangles closer than this to a sample are never culled as sub-sample
+constexpr float PIPELINE_CULL_EPSILON = 1.0f / 256.0f;
+// slot of a pixel in MSAA_STORAGE_COMPRESSED whose samples all have the color in the msaa color buffer
+constexpr uint32_t PIPELINE_MSAA_UNIFORM = 0xffffffffU;
+// count of vertices shaded by one job of the vertex stage
+constexpr int PIPELINE_VERTEX_BATCH_SIZE = 256;
+static_assert(PIPELINE_VERTEX_BATCH_SIZE % SHADER_BATCH_SIZE == 0, "a job must be whole shader batches");
+// instanced draws shade the vertices of as many instances as fit in this many vertices at once, at least 1
+constexpr int PIPELINE_INSTANCE_CHUNK_VERTICES = 16384;
+
+// bits of the clipping outcode, set if the vertex is out of the plane
+enum ClipPlane
+{
+    // planes triangles are really clipped against
+    CLIP_PLANE_NEAR = 1 << 0,
+    CLIP_PLANE_FAR = 1 << 1,
+    CLIP_PLANE_GUARD_LEFT = 1 << 2,
+    CLIP_PLANE_GUARD_RIGHT = 1 << 3,
+    CLIP_PLANE_GUARD_BOTTOM = 1 << 4,
+    CLIP_PLANE_GUARD_TOP = 1 << 5,
+    // planes of the view volume, only for rejecting triangles out of the screen
+    CLIP_PLANE_LEFT = 1 << 6,
+    CLIP_PLANE_RIGHT = 1 << 7,
+    CLIP_PLANE_BOTTOM = 1 << 8,
+    CLIP_PLANE_TOP = 1 << 9,
+
+    CLIP_PLANE_CLIPPING_MASK = (1 << 6) - 1,
+};
+
+/*
+* struct TriangleSetup
+* edge functions of a triangle in screen space, E(x, y) = A * (x - x0) + B * (y - y0) + C(x0, y0)
+* edge i is opposite to vertex i, a point is in the triangle if all 3 edge functions are not negative,
+* or positive for the edges which are not top-left ones, so a sample on an edge shared by 2 triangles is covered once
+* C is evaluated at the left top of every block from the vertices, so the coverage of a sample doesn't depend on
+* where the rasterization of the triangle starts, and a shared edge has exactly opposite edge functions in both triangles
+*/
+struct TriangleSetup
+{
+    float A[3];
+    float B[3];
+    // the vertices of edge i, from edgeStart[i] to edgeEnd[i], and the sign making the inside positive
+    Vec2f edgeStart[3];
+    Vec2f edgeEnd[3];
+    float edgeSign;
+    // edge i covers the samples on it
+    bool edgeInclusive[3];
+    // the left top of the 8x8 block the bounding box of the triangle starts in, not clamped to any scissor rect
+    Vec2f origin;
+    // the edge functions of every sample of 2x2 pixels, relative to the left top of the 2x2 pixels
+    alignas(16) float laneOffsets[3][4 * PIPELINE_MAX_MS_COUNT];
+    int laneCount;
+    // NDC depth is linear in screen space, z(x, y) = zA * (x - origin.x) + zB * (y - origin.y) + zC
+    float zA;
+    float zB;
+    float zC;
+    // depth of every sample of 2x2 pixels, relative to the left top of the 2x2 pixels
+    alignas(16) float laneDepths[4 * PIPELINE_MAX_MS_COUNT];
+    // depth range of the 3 vertices
+    float zMin;
+    float zMax;
+
+    // edge function e at the left top of the block at (bx, by)
+    float evaluateBlock(int e, int bx, int by) const
+    {
+        const Vec2f block((float)bx, (float)by);
+        Vec2f a = edgeStart[e] - block;
+        Vec2f b = edgeEnd[e] - block;
+        return (a.x * b.y - a.y * b.x) * edgeSign;
+    }
+
+    float evaluateDepth(float x, float y) const
+    {
+        return zA * (x - origin.x) + zB * (y - origin.y) + zC;
+    }
+};
+
+// how the samples of a block pass the depth test, decided by the hierarchical z buffer
+enum DepthTestResult
+{
+    DEPTH_TEST_PER_SAMPLE,
+    DEPTH_TEST_ALL_PASS,
+    DEPTH_TEST_ALL_FAIL,
+};
+
+
+/*
+* struct PipelineStatistics
+* counters of the last draw
+*/
+struct PipelineStatistics
+{
+    // vertex fetches by the triangles, a hit is served by an already shaded vertex
+    uint64_t vertexCacheHits = 0;
+    // vertices run through the vertex shader
+    uint64_t vertexCacheMisses = 0;
+    // triangles assembled from the index buffer
+    uint64_t trianglesInput = 0;
+    // triangles entirely out of one of the clipping planes
+    uint64_t trianglesCulledClipping = 0;
+    // triangles culled by CullMode
+    uint64_t trianglesCulledFacing = 0;
+    // triangles 0 in size on the screen
+    uint64_t trianglesCulledZeroArea = 0;
+    // triangles whose bounding box covers no sample
+    uint64_t trianglesCulledSubSample = 0;
+    // triangles sent to the rasterizer, may be more than the input after clipping
+    uint64_t trianglesRasterized = 0;
+};
+
+/*
+* struct VisibilityDraw
+* what SHADING_MODE_VISIBILITY_BUFFER needs to shade the triangles of a draw later
+*/
+struct VisibilityDraw
+{
+    PixelShader* pPixelShader;
+    VaryingLayout pixelLayout;
+    // draws share the uniforms until setUniforms() is called
+    std::shared_ptr<const ShaderUniform> pUniforms;
+};
 
 /*
 * class Pipeline
@@ -9,59 +144,293 @@
 * 1. set pipeline sim_pipelineState, vertices and indecies input, shaders, uniforms
 * 2. call clear render target
 * 3. call renderToTarget to draw objects to the msaa buffer
-* 4. repeat 3
-* 5. call presentToScreen to merge the msaa buffer to the outer buffer
+* 4. repeat 3, or call renderToTargetInstanced to draw many instances of the objects in one call
+* 5. call presentToScreen to resolve the msaa buffer to the outer buffer
 * 6. repeat 2
+* or record all of these in a CommandBuffer once and submit it every frame
+* occlusion queries :
+* 1. call clearOcclusionBuffer, then renderOccluders to draw big objects near the camera to the occlusion buffer
+* 2. call queryOcclusion with the bounding box of an object, and skip its draw if it is hidden
 */
 class Pipeline
 {
 public:
     void renderToTarget();
 
-    void presentToScreen(uint8_t* buffer);
+    // draw the bound buffers instanceCount times, instance i reads vertex i of the instance buffer
+    // the vertex shader input has the values of the vertex, then the values of the instance, then SV_InstanceID
+    void renderToTargetInstanced(int instanceCount);
+
+    // run the commands of a valid command buffer in order
+    // in RASTER_MODE_TILED with SHADING_MODE_VISIBILITY_BUFFER, triangles of consecutive draws are binned together
+    // and the tiles are rastered once for all of them
+    void submit(const CommandBuffer& commands);
+
+    // resolve the msaa buffers and convert the render target to buffer on the thread pool, BGR8 by default
+    void presentToScreen(uint8_t* buffer, const FrameOutputOptions& options = FrameOutputOptions());
 
     void clearRenderTarget(Vec3f color, float depth);
 
     void setPipelineState(const PipelineState& state);
 
-    void setVertexBuffer(const std::vector<ShaderContext>& v) { vertices = v; }
+    // copy the buffers and bind the copies
+    void setVertexBuffer(const std::vector<ShaderContext>& v) { vertices = v; vertexBuffer = VertexBufferView(vertices); }
+
+    void setIndexBuffer(const std::vector<int>& i) { indecies = i; indexBuffer = IndexBufferView(indecies); }
+
+    // bind buffers in place without copying, they must outlive the draws using them
+    void setVertexBuffer(const VertexBufferView& view) { vertexBuffer = view; }
+
+    void setIndexBuffer(const IndexBufferView& view) { indexBuffer = view; }
+
+    // bind per instance values in place for renderToTargetInstanced(), e.g. transforms and colors
+    // the keys of its layout must not be in the vertex layout
+    void setInstanceBuffer(const VertexBufferView& view) { instanceBuffer = view; }
+
+    // bind the vertices and indices of the mesh in place, the mesh must outlive the draws
+    void setMesh(const Mesh* mesh) { setVertexBuffer(mesh->getVertexBufferView()); setIndexBuffer(mesh->getIndexBufferView()); }
+
+    void setShaders(VertexShader* pVS, PixelShader* pPS);
+
+    // share uniforms no one changes any more, e.g. a material bound to many draws, nothing is copied
+    void setUniforms(const std::shared_ptr<const ShaderUniform>& uni) { pUniforms = uni; }
+
+    // the per object part of the shader inputs, e.g. world * view * projection, so objects can share their uniforms
+    // vertex shaders read it by getDrawTransform(), it is the identity until set
+    void setDrawTransform(const Mat4x4f& transform) { drawTransform = transform; }
+
+    const PipelineStatistics& getStatistics() const { return statistics; }
+
+    // the threads the pipeline runs its stages on, created by setPipelineState() with state.threadCount threads
+    // e.g. to generate the mipmaps of textures between frames, null before the first setPipelineState()
+    ThreadPool* getThreadPool() const { return threadPool.get(); }
 
-    void setIndexBuffer(const std::vector<int>& i) { indecies = i; }
+    // fill the occlusion buffer with the far depth 1.0
+    void clearOcclusionBuffer();
 
-    void setShaders(VertexShader* pVS, PixelShader* pPS) { pVertexShader = pVS; pPixelShader = pPS; }
+    // draw the bound buffers to the occlusion buffer only, with the bound vertex shader and the cull mode
+    // the occluders are sampled at the centers of the pixels of every texel, once all of them are covered
+    // the texel takes the farthest depth the occluders have at them, so the tests are never more hidden than the pixels
+    void renderOccluders();
 
-    void setUniforms(const ShaderUniform& uni) { uniforms = uni; }
+    // returns false if no part of the box can be seen, as it is out of the screen or behind the occluders
+    // the box is transformed to clipping space by transform as row vectors, e.g. world * view * projection
+    bool queryOcclusion(const Vec3f& boxMin, const Vec3f& boxMax, const Mat4x4f& transform) const;
 
 protected:
-    void rasterTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2);
+    // shade the vertices and process the triangles of a draw, in RASTER_MODE_TILED they are only binned
+    // instanceCount 0 draws without the instance buffer
+    void drawTriangles(int instanceCount = 0);
 
-    std::vector<ShaderContext> clippingTriangle(ShaderContext& v0, ShaderContext& v1, ShaderContext& v2);
+    // collect the vertices the draw uses to shadedIndices
+    void collectVertices();
 
+    // run the vertex shader once for every vertex the draw uses in instances [firstInstance, firstInstance + instanceCount),
+    // in parallel batches across the instances, the outputs of an instance follow the ones of the one before it
+    // inputLayout is the layout the vertex shader reads, instancedLayout for instanced draws
+    void shadeVertices(const VaryingLayout* inputLayout, int firstInstance, int instanceCount);
+
+    // clip, do perspective division and send the triangle to the rasterizer
+    void processTriangle(ShaderContext& v0, ShaderContext& v1, ShaderContext& v2);
+
+    // returns true if the triangle is culled by facing, area or sample coverage, vertices are in NDC space
+    bool cullTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2);
+
+    // raster in place or bin the triangle by the raster mode, vertices are in NDC space
+    void emitTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2);
+
+    // triangleId is the index in visibilityVertices in SHADING_MODE_VISIBILITY_BUFFER
+    void binTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2, uint32_t triangleId);
+
+    // raster all binned triangles tile by tile on the thread pool, and clear the bins
+    void flushTiles();
+
+    // only pixels in the scissor rect [x0, x1) x [y0, y1) are touched, x0 and y0 must be multiples of 8
+    void rasterTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2, const Vec4i& scissor, uint32_t triangleId);
+
+    // renderOccluders() : add the pixel centers the triangle covers to the texels of the occlusion buffer
+    void rasterOccluder(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2);
+
+    // evaluate the edge functions at the left top of the 8x8 block at (bx, by) to eBlock
+    // returns false if the block is entirely out of the triangle, inside is set if it is entirely in it
+    bool testBlockCoverage(const TriangleSetup& setup, int bx, int by, float eBlock[3], bool& inside) const;
+
+    // returns false if the triangle is 0 in size, z of p0, p1, p2 is the NDC depth
+    // the lanes of the setup are sampleCount samples at sampleCoords in each of the 2x2 pixels
+    bool setupTriangle(TriangleSetup& setup, Vec3f p0, Vec3f p1, Vec3f p2, const Vec2f* sampleCoords, int sampleCount) const;
+
+    // bit i is set if lane i of the 2x2 pixels is covered, eQuad are the edge functions at the left top of them
+    uint64_t getQuadCoverage(const TriangleSetup& setup, const float eQuad[3]) const;
+
+    // test the depth range of the triangle in the 8x8 block at (bx, by) against the hierarchical z buffer
+    DepthTestResult testBlockDepth(const TriangleSetup& setup, int bx, int by, float& blockZMin, float& blockZMax) const;
+
+    // refresh the hierarchical z buffer after samples in the block are written
+    void updateBlockDepth(int bx, int by, float blockZMin, float blockZMax, bool fullyCovered);
+
+    // depth test, shade the 2x2 pixels at (x, y) and write the covered samples
+    // returns false if no sample is written
+    bool shadeQuad(int x, int y, uint32_t newMasks[4], const TriangleSetup& setup, DepthTestResult depthTest,
+        const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2);
+
+    // SHADING_MODE_VISIBILITY_BUFFER : depth test the 2x2 pixels at (x, y) and write the depths and the triangle id of the covered samples
+    // returns false if no sample is written
+    bool writeQuadVisibility(int x, int y, uint32_t newMasks[4], const TriangleSetup& setup, DepthTestResult depthTest, uint32_t triangleId);
+
+    // clear the bits of the samples failing the depth test, returns false if no sample is left
+    bool testQuadDepth(int x, int y, uint32_t newMasks[4], const TriangleSetup& setup, float quadDepth) const;
+
+    // interpolate the pixel inputs of the 2x2 pixels at (x, y) at the centers of the samples in masks, pIn have the pixel layout
+    // returns the mask of pixels having samples in masks
+    uint32_t interpolateQuad(int x, int y, const uint32_t masks[4],
+        const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2, ShaderContext pIn[4]) const;
+
+    // SHADING_MODE_VISIBILITY_BUFFER : shade every pixel once for each visible triangle in it
+    void shadeVisibilityBuffer();
+
+    // shade the visible triangles of the draw in the tile
+    void shadeVisibilityTile(int tile, uint32_t draw);
+
+    // index of sample i of the pixel in the msaa depth buffer, and in the msaa color buffer unless MSAA_STORAGE_COMPRESSED
+    inline size_t sampleIndex(int pixel, int i) const
+    {
+        return state.msaaStorage == MSAA_STORAGE_PLANAR ?
+            (size_t)i * state.width * state.height + pixel : (size_t)pixel * state.msCount + i;
+    }
+
+    // write the color and the depths of the samples in mask of the pixel (px, py)
+    // depth of sample i is depth + depthOffsets[i]
+    void writeSamples(int px, int py, uint32_t mask, const Vec3f& color, float depth, const float* depthOffsets);
+
+    void writeSampleColors(int px, int py, uint32_t mask, const Vec3f& color);
+
+    Vec3f loadSampleColor(int pixel, int i) const;
+
+    // clip the triangle against the planes in clipCode (Sutherland-Hodgman) in homogeneous space
+    // returns the clipped convex polygon in the clipping scratch buffer, valid until the next call
+    ShaderContext* clippingTriangle(const ShaderContext& v0, const ShaderContext& v1, const ShaderContext& v2, uint32_t clipCode, int& vertexCount);
+
+    // resolve the msaa buffers to the present render target, tile by tile on the thread pool
     void mergeMSAARenderTarget();
 
+    void resolveTile(int tile);
+
+    // RESOLVE_FILTER_TENT color of the pixel (px, py)
+    Vec3f resolveTent(int px, int py) const;
+
+    // the colors of the samples of the pixel as state.msCount Vec3f one after another, null if not stored so
+    const float* getSampleColors(int pixel) const;
+
+    // fill the msaa buffers of the tile with the clear values, for the first write after clearRenderTarget()
+    void clearTile(int tile);
+
     void resetMSAARenderTarget();
 
     void resetRenderTargetState();
 
-    bool shouldClip(Vec4f& v);
+    void resetTiles();
+
+    void resetThreadPool();
+
+    void resetOcclusionBuffer();
+
+    Vec2f toScreenSpace(const Vec4f& ndcPosition) const;
+
+    // returns the ClipPlane bits the vertex in clipping space is out of
+    uint32_t getClipCode(const Vec4f& v) const;
 
 protected:
     Texture2D3F renderTarget;
     Texture2D1F depthBuffer;
+    // copies made by setVertexBuffer() and setIndexBuffer() of vectors
     std::vector<ShaderContext> vertices;
     std::vector<int> indecies;
+    // the buffers draws read
+    VertexBufferView vertexBuffer;
+    IndexBufferView indexBuffer;
+    VertexBufferView instanceBuffer;
+    // the vertex layout, the instance layout appended and SV_InstanceID
+    VaryingLayout instancedLayout;
     VertexShader* pVertexShader;
     PixelShader* pPixelShader;
-    ShaderUniform uniforms;
+    std::shared_ptr<const ShaderUniform> pUniforms = std::make_shared<const ShaderUniform>();
+    Mat4x4f drawTransform = matrix_set_identity();
+    // vertex shader outputs of the current draw, indexed by the vertex index
+    // instanced draws keep vertexBuffer.count outputs for each instance of the chunk being drawn
+    std::vector<ShaderContext> transformedVertices;
+    // the vertex indices used by the current draw, each once
+    std::vector<int> shadedIndices;
+    std::vector<uint8_t> vertexShaded;
+    PipelineStatistics statistics;
+    // layout of the pixel shader input, the vertex shader output and the built-in values
+    VaryingLayout pixelLayout;
 
-    std::vector<Texture2D3F> msaaColorBuffer;
-    std::vector<Texture2D1F> msaaDepthBuffer;
+    // samples of all pixels ordered by state.msaaStorage, see sampleIndex()
+    // MSAA_STORAGE_COMPRESSED keeps one color per pixel in msaaColorBuffer
+    Texture2D3F msaaColorBuffer;
+    Texture2D1F msaaDepthBuffer;
     std::vector<uint32_t> msaaMask;
+    // MSAA_STORAGE_COMPRESSED : the slot of every pixel in the color pool of its tile, or PIPELINE_MSAA_UNIFORM
+    std::vector<uint32_t> msaaColorSlots;
+    // MSAA_STORAGE_COMPRESSED : colors of the expanded pixels of every tile, state.msCount packed colors per slot
+    // a tile is only written by one thread, and the pools are emptied by clearRenderTarget()
+    std::vector<std::vector<uint8_t>> msaaColorPools;
+    // bytes of a packed color in the pools
+    size_t msaaColorBytes = 0;
+    // RESOLVE_FILTER_TENT weight of sample i of the neighbor (ox, oy) at [(ox + 1 + (oy + 1) * 3) * msCount + i]
+    std::vector<float> tentWeights;
+    // hierarchical z buffer, the min and max depth of all samples in every 8x8 block
+    // kept conservative : the real min is never smaller and the real max is never greater
+    std::vector<float> hiZMin;
+    std::vector<float> hiZMax;
+    int hiZWidth = 0;
 
     PipelineState state;
 
+    // the average of all sample coords, center of fully covered pixels
+    Vec2f fullMaskCenter;
+
     Vec3f lastClearColor;
-    float lastClearDepth;
+    float lastClearDepth = 1.0f;
+
+    // triangles binned in RASTER_MODE_TILED, 3 vertices each in NDC space
+    std::vector<ShaderContext> binnedVertices;
+    // indices of binned triangles overlapping each tile, in submission order
+    std::vector<std::vector<int>> tileBins;
+    int tileCountX = 0;
+    int tileCountY = 0;
+    // clearRenderTarget() only sets these, a tile is filled with the clear values by the first block written to it,
+    // and tiles still set are resolved straight to the clear values
+    std::vector<uint8_t> tileNeedsClear;
+    std::unique_ptr<ThreadPool> threadPool;
+
+    // SHADING_MODE_VISIBILITY_BUFFER, all kept until clearRenderTarget()
+    // the triangle of every sample, indexed the same as the msaa depth buffer
+    std::vector<uint32_t> msaaTriangleIds;
+    // 3 vertices of every triangle in NDC space, and the draw it belongs to
+    std::vector<ShaderContext> visibilityVertices;
+    std::vector<uint32_t> visibilityTriangleDraws;
+    std::vector<VisibilityDraw> visibilityDraws;
+    // the draws having samples in every tile, in submission order
+    std::vector<std::vector<uint32_t>> tileDraws;
+    // triangle ids of binnedVertices
+    std::vector<uint32_t> binnedTriangleIds;
+
+    // the depth of the occluders, occlusionWidth x occlusionHeight texels of state.occlusionDownscale pixels
+    // 1.0 until the centers of all pixels of the texel are covered
+    std::vector<float> occlusionDepth;
+    // the pixel centers of every texel covered by occluders, and the farthest depth they are covered at
+    std::vector<uint16_t> occlusionMasks;
+    std::vector<float> occlusionFarDepths;
+    // the pixel centers of a texel in texels, the samples of the occluder setup
+    std::vector<Vec2f> occlusionSampleCoords;
+    int occlusionWidth = 0;
+    int occlusionHeight = 0;
+    // renderOccluders() is running, triangles go to the occlusion buffer
+    bool occluderPass = false;
+
+    // scratch buffer of clippingTriangle(), polygons are clipped from one to the other plane by plane
+    ShaderContext clippingBuffer[2][PIPELINE_MAX_CLIP_VERTICES];
 
     static const Vec2i pixel2x2Steps[4];
 };
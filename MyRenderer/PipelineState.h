@@ -1,10 +1,75 @@
 #pragma once
 #include <vector>
 #include "MathHelper.h"
+#include "TexelFormat.h"
 
 #undef near
 #undef far
 
+enum RasterMode
+{
+    // rasterize and shade every triangle right after its vertices are shaded
+    RASTER_MODE_IMMEDIATE,
+    // bin all triangles of a draw to screen tiles, then rasterize the tiles in parallel
+    RASTER_MODE_TILED,
+};
+
+enum CullMode
+{
+    CULL_MODE_NONE,
+    // cull triangles facing the viewer
+    CULL_MODE_FRONT,
+    // cull triangles facing away from the viewer
+    CULL_MODE_BACK,
+};
+
+// how the samples of the msaa render target are stored
+enum MSAAStorage
+{
+    // a full screen plane for every sample
+    MSAA_STORAGE_PLANAR,
+    // the samples of a pixel next to each other
+    MSAA_STORAGE_INTERLEAVED,
+    // interleaved depth, and one color for a pixel until its samples get different colors,
+    // the colors of such edge pixels are expanded to pools of their tiles
+    MSAA_STORAGE_COMPRESSED,
+};
+
+// how the samples are weighted when the msaa render target is resolved
+enum ResolveFilter
+{
+    // average of the samples of the pixel
+    RESOLVE_FILTER_BOX,
+    // samples of the pixel and its neighbors, weighted by their distance to the pixel center, up to 1 pixel
+    RESOLVE_FILTER_TENT,
+};
+
+// which sample depth a resolved pixel gets
+enum DepthResolve
+{
+    // the nearest
+    DEPTH_RESOLVE_MIN,
+    // the farthest
+    DEPTH_RESOLVE_MAX,
+};
+
+// when pixels are shaded
+enum ShadingMode
+{
+    // every triangle is shaded as it is rasterized, hidden samples written before are shaded too
+    SHADING_MODE_FORWARD,
+    // draws only write the depth and the triangle of every sample, the visible triangles are shaded
+    // once per pixel by presentToScreen(), uniforms are kept per draw until clearRenderTarget()
+    SHADING_MODE_VISIBILITY_BUFFER,
+};
+
+// the winding order of front facing triangles on the screen
+enum FrontFace
+{
+    FRONT_FACE_COUNTER_CLOCKWISE,
+    FRONT_FACE_CLOCKWISE,
+};
+
 struct PipelineState
 {
     int width = 800;
@@ -15,4 +80,18 @@ struct PipelineState
     std::vector<Vec2f> sampleCoords = {Vec2f(0.5f, 0.5f)};
     int msCount = 1;
     bool enableDepthTest = true;
+    CullMode cullMode = CULL_MODE_NONE;
+    FrontFace frontFace = FRONT_FACE_COUNTER_CLOCKWISE;
+    RasterMode rasterMode = RASTER_MODE_IMMEDIATE;
+    // threads used by the vertex stage and RASTER_MODE_TILED, 0 means one thread per hardware thread
+    int threadCount = 0;
+    MSAAStorage msaaStorage = MSAA_STORAGE_COMPRESSED;
+    ResolveFilter resolveFilter = RESOLVE_FILTER_BOX;
+    DepthResolve depthResolve = DEPTH_RESOLVE_MIN;
+    // storage of the color and depth of every sample and of the resolved render target
+    TexelFormat colorFormat = TEXEL_FORMAT_FLOAT;
+    TexelFormat depthFormat = TEXEL_FORMAT_FLOAT;
+    ShadingMode shadingMode = SHADING_MODE_FORWARD;
+    // a texel of the occlusion buffer covers occlusionDownscale x occlusionDownscale pixels, 1 to 4
+    int occlusionDownscale = 4;
 };
\ No newline at end of file
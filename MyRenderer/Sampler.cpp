@@ -1,10 +1,12 @@
+#include <cmath>
 #include "Sampler.h"
+#include "SimdHelper.h"
 
 template <class T>
-T Sampler2D<T>::sample(const Texture2D<T> &tex, Vec2f uv, Vec2f ddxUV, Vec2f ddyUV, const PipelineState &pipelineState) const
+T Sampler2D<T>::sample(const Texture2D<T> &tex, Vec2f uv, Vec2f ddxUV, Vec2f ddyUV) const
 {
     // in address mode, if uv out of border, just return the border color
-    if(addressMode == ADDRESS_MODE_CLAMP_TO_BORDER && (uv.u > 0.0f || uv.u < 1.0f || uv.v < 0.0f || uv.v > 1.0f))
+    if(addressMode == ADDRESS_MODE_CLAMP_TO_BORDER && (uv.u < 0.0f || uv.u > 1.0f || uv.v < 0.0f || uv.v > 1.0f))
     {
         return borderColor;
     }
@@ -29,24 +31,19 @@ T Sampler2D<T>::sample(const Texture2D<T> &tex, Vec2f uv, Vec2f ddxUV, Vec2f ddy
 
     case MIPMAP_MODE_NEAREST:
     {
-        // use long edge to calculate mipmap level
-        float scale = std::max(ddxUV.x * (float)tex.width, ddyUV.y * (float)tex.height);
-        int mip = fmodf(scale, 1.0f) > 0.5f ? (int)scale : (int)scale - 1;
-        mip = clamp(mip, 0, tex.maxMipmapLevel);
-
+        int mip = clamp((int)(getLod(tex, ddxUV, ddyUV) + 0.5f), 0, (int)tex.maxMipmapLevel);
         result = sampleFromMipmapLevel(tex, sampleUV, mip);
         break;
     }
 
     case MIPMAP_MODE_LINEAR:
     {
-        // use long edge to calculate mipmap level
-        float scale = std::max(ddxUV.x * (float)tex.width, ddyUV.y * (float)tex.height);
-        int mip1 = clamp((int)scale - 1, 0, tex.maxMipmapLevel);
-        int mip2 = clamp((int)scale, 0, tex.maxMipmapLevel);
+        float lod = getLod(tex, ddxUV, ddyUV);
+        int mip1 = clamp((int)lod, 0, (int)tex.maxMipmapLevel);
+        int mip2 = clamp((int)lod + 1, 0, (int)tex.maxMipmapLevel);
 
         // get the blend factor
-        float factor = 1.0f - fmodf(scale, 1.0f);
+        float factor = 1.0f - (lod - std::floor(lod));
 
         // sample and blend
         result += factor * sampleFromMipmapLevel(tex, sampleUV, mip1);
@@ -59,6 +56,239 @@ T Sampler2D<T>::sample(const Texture2D<T> &tex, Vec2f uv, Vec2f ddxUV, Vec2f ddy
     return result;
 }
 
+template <class T>
+void Sampler2D<T>::sampleQuad(const Texture2D<T>& tex, const Vec2f uv[4], Vec2f ddxUV, Vec2f ddyUV, T result[4]) const
+{
+    int j;
+    // anisotropic filter takes a different footprint for every pixel
+    if (filterMode == FILTER_MODE_ANISOTROPIC)
+    {
+        for (j = 0; j < 4; ++j)
+        {
+            result[j] = (addressMode == ADDRESS_MODE_CLAMP_TO_BORDER && (uv[j].u < 0.0f || uv[j].u > 1.0f || uv[j].v < 0.0f || uv[j].v > 1.0f)) ?
+                borderColor : sampleAnisotropic(tex, uv[j], ddxUV, ddyUV);
+        }
+        return;
+    }
+
+    // address all 4 uvs in lanes
+    alignas(16) float u[4] = { uv[0].u, uv[1].u, uv[2].u, uv[3].u };
+    alignas(16) float v[4] = { uv[0].v, uv[1].v, uv[2].v, uv[3].v };
+    // bit j is set if uv j is out of the border in ADDRESS_MODE_CLAMP_TO_BORDER
+    int borderMask = 0;
+#if defined(SIMD_SSE2)
+    __m128 u4 = _mm_load_ps(u);
+    __m128 v4 = _mm_load_ps(v);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    switch (addressMode)
+    {
+    case ADDRESS_MODE_REPEAT:
+        // mapping u, v to [0.0, 1.0)
+        u4 = _mm_sub_ps(u4, simdFloor(u4));
+        v4 = _mm_sub_ps(v4, simdFloor(v4));
+        break;
+
+    case ADDRESS_MODE_MIRRORED_REPEAT:
+    {
+        // mapping u, v to [0.0, 1.0]
+        const __m128 two = _mm_set1_ps(2.0f);
+        const __m128 half = _mm_set1_ps(0.5f);
+        u4 = simdAbs(u4);
+        v4 = simdAbs(v4);
+        u4 = _mm_sub_ps(u4, _mm_mul_ps(two, simdFloor(_mm_mul_ps(u4, half))));
+        v4 = _mm_sub_ps(v4, _mm_mul_ps(two, simdFloor(_mm_mul_ps(v4, half))));
+        u4 = _mm_sub_ps(one, simdAbs(_mm_sub_ps(u4, one)));
+        v4 = _mm_sub_ps(one, simdAbs(_mm_sub_ps(v4, one)));
+        break;
+    }
+
+    case ADDRESS_MODE_CLAMP_TO_BORDER:
+    case ADDRESS_MODE_CLAMP_TO_EDGE:
+        // uvs in the border get the border color, and are clamped to [0.0, 1.0] like the others
+        if (addressMode == ADDRESS_MODE_CLAMP_TO_BORDER)
+        {
+            borderMask = _mm_movemask_ps(_mm_or_ps(
+                _mm_or_ps(_mm_cmplt_ps(u4, zero), _mm_cmpgt_ps(u4, one)),
+                _mm_or_ps(_mm_cmplt_ps(v4, zero), _mm_cmpgt_ps(v4, one))));
+        }
+        u4 = _mm_min_ps(_mm_max_ps(u4, zero), one);
+        v4 = _mm_min_ps(_mm_max_ps(v4, zero), one);
+        break;
+    }
+    _mm_store_ps(u, u4);
+    _mm_store_ps(v, v4);
+#else
+    for (j = 0; j < 4; ++j)
+    {
+        if (addressMode == ADDRESS_MODE_CLAMP_TO_BORDER && (u[j] < 0.0f || u[j] > 1.0f || v[j] < 0.0f || v[j] > 1.0f))
+        {
+            borderMask |= 1 << j;
+        }
+        Vec2f sampleUV = addressMode == ADDRESS_MODE_CLAMP_TO_BORDER ?
+            Vec2f(clamp(u[j], 0.0f, 1.0f), clamp(v[j], 0.0f, 1.0f)) : getSampleUV(Vec2f(u[j], v[j]));
+        u[j] = sampleUV.u;
+        v[j] = sampleUV.v;
+    }
+#endif
+
+    // the mipmap level is chosen once for the quad
+    switch (mipmapMode)
+    {
+    case MIPMAP_MODE_NO_MIPMAP:
+        sampleQuadFromMipmapLevel(tex, u, v, 0, result);
+        break;
+
+    case MIPMAP_MODE_NEAREST:
+        sampleQuadFromMipmapLevel(tex, u, v, clamp((int)(getLod(tex, ddxUV, ddyUV) + 0.5f), 0, (int)tex.maxMipmapLevel), result);
+        break;
+
+    case MIPMAP_MODE_LINEAR:
+    {
+        float lod = getLod(tex, ddxUV, ddyUV);
+        int mip1 = clamp((int)lod, 0, (int)tex.maxMipmapLevel);
+        int mip2 = clamp((int)lod + 1, 0, (int)tex.maxMipmapLevel);
+        float factor = 1.0f - (lod - std::floor(lod));
+        sampleQuadFromMipmapLevel(tex, u, v, mip1, result);
+        if (mip2 != mip1)
+        {
+            T result2[4];
+            sampleQuadFromMipmapLevel(tex, u, v, mip2, result2);
+            for (j = 0; j < 4; ++j)
+            {
+                result[j] = factor * result[j] + (1.0f - factor) * result2[j];
+            }
+        }
+        break;
+    }
+    }
+
+    for (j = 0; j < 4; ++j)
+    {
+        if ((borderMask & (1 << j)) != 0)
+        {
+            result[j] = borderColor;
+        }
+    }
+}
+
+template <class T>
+float Sampler2D<T>::getLod(const Texture2D<T>& tex, Vec2f ddxUV, Vec2f ddyUV) const
+{
+    Vec2f size = { (float)tex.width, (float)tex.height };
+    float scale = std::max(Vector_length(ddxUV * size), Vector_length(ddyUV * size));
+    return scale > 1.0f ? std::log2(scale) : 0.0f;
+}
+
+template <class T>
+void Sampler2D<T>::sampleQuadFromMipmapLevel(const Texture2D<T>& tex, const float u[4], const float v[4], int mipmapLevel, T result[4]) const
+{
+    int j;
+    const MipLevel& level = tex.getMipLevel(mipmapLevel);
+    // texel coords of the 4 lanes, x0 and y0 are the only ones used by point filter
+    alignas(16) int x0[4], x1[4], y0[4], y1[4];
+    // blend factors of texel x1 and y1
+    alignas(16) float kx[4], ky[4];
+    bool linear = filterMode == FILTER_MODE_LINEAR;
+#if defined(SIMD_SSE2)
+    const __m128 w4 = _mm_set1_ps((float)level.width);
+    const __m128 h4 = _mm_set1_ps((float)level.height);
+    const __m128i maxX = _mm_set1_epi32(level.width - 1);
+    const __m128i maxY = _mm_set1_epi32(level.height - 1);
+    if (linear)
+    {
+        // texel centers are at .5, the sample point is between texel x0 and x0 + 1
+        const __m128 half = _mm_set1_ps(0.5f);
+        __m128 xf = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(u), w4), half);
+        __m128 yf = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(v), h4), half);
+        __m128 xFloor = simdFloor(xf);
+        __m128 yFloor = simdFloor(yf);
+        _mm_store_ps(kx, _mm_sub_ps(xf, xFloor));
+        _mm_store_ps(ky, _mm_sub_ps(yf, yFloor));
+        __m128i ix0 = _mm_cvttps_epi32(xFloor);
+        __m128i iy0 = _mm_cvttps_epi32(yFloor);
+        __m128i ix1 = _mm_add_epi32(ix0, _mm_set1_epi32(1));
+        __m128i iy1 = _mm_add_epi32(iy0, _mm_set1_epi32(1));
+        if (addressMode == ADDRESS_MODE_REPEAT)
+        {
+            // x0 is -1 on the left of the leftmost texel center, x1 is width on the right of the rightmost one
+            ix0 = simdSelect(_mm_cmplt_epi32(ix0, _mm_setzero_si128()), maxX, ix0);
+            iy0 = simdSelect(_mm_cmplt_epi32(iy0, _mm_setzero_si128()), maxY, iy0);
+            ix1 = simdSelect(_mm_cmpgt_epi32(ix1, maxX), _mm_setzero_si128(), ix1);
+            iy1 = simdSelect(_mm_cmpgt_epi32(iy1, maxY), _mm_setzero_si128(), iy1);
+        }
+        else
+        {
+            ix0 = simdClamp(ix0, _mm_setzero_si128(), maxX);
+            iy0 = simdClamp(iy0, _mm_setzero_si128(), maxY);
+            ix1 = simdClamp(ix1, _mm_setzero_si128(), maxX);
+            iy1 = simdClamp(iy1, _mm_setzero_si128(), maxY);
+        }
+        _mm_store_si128((__m128i*)x1, ix1);
+        _mm_store_si128((__m128i*)y1, iy1);
+        _mm_store_si128((__m128i*)x0, ix0);
+        _mm_store_si128((__m128i*)y0, iy0);
+    }
+    else
+    {
+        // uv is in [0.0, 1.0], so only the right and bottom edges need clamping
+        __m128i ix = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(u), w4));
+        __m128i iy = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(v), h4));
+        _mm_store_si128((__m128i*)x0, simdClamp(ix, _mm_setzero_si128(), maxX));
+        _mm_store_si128((__m128i*)y0, simdClamp(iy, _mm_setzero_si128(), maxY));
+    }
+#else
+    for (j = 0; j < 4; ++j)
+    {
+        if (linear)
+        {
+            float xf = u[j] * (float)level.width - 0.5f;
+            float yf = v[j] * (float)level.height - 0.5f;
+            float xFloor = std::floor(xf);
+            float yFloor = std::floor(yf);
+            kx[j] = xf - xFloor;
+            ky[j] = yf - yFloor;
+            x0[j] = (int)xFloor;
+            y0[j] = (int)yFloor;
+            x1[j] = x0[j] + 1;
+            y1[j] = y0[j] + 1;
+            if (addressMode == ADDRESS_MODE_REPEAT)
+            {
+                x0[j] = x0[j] < 0 ? level.width - 1 : x0[j];
+                y0[j] = y0[j] < 0 ? level.height - 1 : y0[j];
+                x1[j] = x1[j] > level.width - 1 ? 0 : x1[j];
+                y1[j] = y1[j] > level.height - 1 ? 0 : y1[j];
+            }
+            else
+            {
+                x0[j] = clamp(x0[j], 0, level.width - 1);
+                y0[j] = clamp(y0[j], 0, level.height - 1);
+                x1[j] = clamp(x1[j], 0, level.width - 1);
+                y1[j] = clamp(y1[j], 0, level.height - 1);
+            }
+        }
+        else
+        {
+            x0[j] = clamp((int)(u[j] * (float)level.width), 0, level.width - 1);
+            y0[j] = clamp((int)(v[j] * (float)level.height), 0, level.height - 1);
+        }
+    }
+#endif
+    // fetch through the layout of the texture and blend
+    for (j = 0; j < 4; ++j)
+    {
+        if (linear)
+        {
+            result[j] = (1.0f - ky[j]) * ((1.0f - kx[j]) * tex.fetch(x0[j], y0[j], level) + kx[j] * tex.fetch(x1[j], y0[j], level)) +
+                ky[j] * ((1.0f - kx[j]) * tex.fetch(x0[j], y1[j], level) + kx[j] * tex.fetch(x1[j], y1[j], level));
+        }
+        else
+        {
+            result[j] = tex.fetch(x0[j], y0[j], level);
+        }
+    }
+}
+
 template <class T>
 T Sampler2D<T>::sampleFromMipmapLevel(const Texture2D<T>& tex, Vec2f uv, int mipmapLevel) const
 {
@@ -96,9 +326,10 @@ T Sampler2D<T>::sampleAnisotropic(const Texture2D<T>& tex, Vec2f rawUV, Vec2f dd
     blen = Vector_length(b);
 
     // get two mipmap levels and the blend factor
-    int mip1 = clamp((int)blen - 1, 0, tex.maxMipmapLevel);
-    int mip2 = clamp((int)blen, 0, tex.maxMipmapLevel);
-    float mipmapFactor = fmodf(blen, 1.0f);
+    float lod = blen > 1.0f ? std::log2(blen) : 0.0f;
+    int mip1 = clamp((int)lod, 0, (int)tex.maxMipmapLevel);
+    int mip2 = clamp((int)lod + 1, 0, (int)tex.maxMipmapLevel);
+    float mipmapFactor = 1.0f - (lod - std::floor(lod));
 
     // get actual sample points count
     int sampleCount = clamp((int)(alen / blen + 0.5f), 1, anisotropicLevel);
@@ -114,8 +345,8 @@ T Sampler2D<T>::sampleAnisotropic(const Texture2D<T>& tex, Vec2f rawUV, Vec2f dd
     {
         Vec2f mainDirection = { a.x / (float)tex.width, a.y / (float)tex.height };
         mainDirection -= Vector_normalize(mainDirection) * blen;
-        Vec2f sampleStart = rawUV - (mainDirection / 2);
-        Vec2f sampleEnd = rawUV + (mainDirection / 2);
+        Vec2f sampleStart = rawUV - (mainDirection / 2.0f);
+        Vec2f sampleEnd = rawUV + (mainDirection / 2.0f);
         for (int i = 0; i < sampleCount; ++i)
         {
             float f = (float)i / (float)(sampleCount - 1);
@@ -140,118 +371,60 @@ template <class T>
 T Sampler2D<T>::samplePoint(const Texture2D<T>& tex, Vec2f uv, int mipmapLevel) const
 {
     // get width and height of current mipmap level
-    int w = (int)tex.width >> mipmapLevel;
-    int h = (int)tex.height >> mipmapLevel;
+    const MipLevel& level = tex.getMipLevel(mipmapLevel);
     // get texel coord of current mipmap level
-    int x = std::min((int)(uv.u * w), w - 1);
-    int y = std::min((int)(uv.v * h), h - 1);
+    int x = clamp((int)(uv.u * level.width), 0, level.width - 1);
+    int y = clamp((int)(uv.v * level.height), 0, level.height - 1);
 
-    return tex.getMipmapped(x, y, mipmapLevel);
+    return tex.fetch(x, y, level);
 }
 
 template <class T>
 T Sampler2D<T>::sampleLinear(const Texture2D<T>& tex, Vec2f uv, int mipmapLevel) const
 {
     // get width and height of current mipmap level
-    int w = (int)tex.width >> mipmapLevel;
-    int h = (int)tex.height >> mipmapLevel;
+    const MipLevel& level = tex.getMipLevel(mipmapLevel);
+    int w = level.width;
+    int h = level.height;
 
     // get sample point in texture space of current mipmap level
-    float xf = uv.u * (float)w;
-    float yf = uv.v * (float)h;
-
-    // texel coords
-    int x0, x1, y0, y1;
-    // blend factor
-    float ku, kv;
-    // the output color
-    T result = {};
-
-    // calculate 4 texel coords and 2 factors to blend
-    if (uv.u == 1.0f)
-    {
-        // if address mode is ADDRESS_MODE_REPEAT, uv.u can't be 1.0f
-        // so dont call fmod here
-        ku = 1.0f;
-        x0 = x1 = w - 1;
-    }
-    else if (fmodf(xf, 1.0f) < 0.5f)
-    {
-        // sample point in left half of texel
-        // when fractional part of xf is in [0.0, 0.5)
+    // texel centers are at .5, so the sample point is between texel x0 and x0 + 1
+    float xf = uv.u * (float)w - 0.5f;
+    float yf = uv.v * (float)h - 0.5f;
+    float xFloor = std::floor(xf);
+    float yFloor = std::floor(yf);
 
-        ku = 0.5f - fmodf(xf, 1.0f);
-        x1 = int(xf);
-        if (addressMode == ADDRESS_MODE_REPEAT && x1 == 0)
-        {
-            // when x1 is the leftmost and address mode is ADDRESS_MODE_REPEAT
-            // the x0 should be the rightmost
-            x0 = w - 1;
-        }
-        else
-        {
-            // common case, x0 is x1's left
-            x0 = std::max(x1 - 1, 0);
-        }
-    }
-    else
-    {
-        // sample point in right half of texel
-        // when fractional part of xf is in [0.5, 1.0)
-
-        ku = 1.5f - fmodf(xf, 1.0f);
-        x0 = int(xf);
-        if (addressMode == ADDRESS_MODE_REPEAT && x0 == w - 1)
-        {
-            // when x0 is the rightmost and address mode is ADDRESS_MODE_REPEAT
-            // the x1 should be the leftmost
-            x1 = 0;
-        }
-        else
-        {
-            // common case, x1 is x0's right
-            x1 = std::min(x0 + 1, int(w - 1));
-        }
-    }
+    // blend factor of x1 and y1
+    float kx = xf - xFloor;
+    float ky = yf - yFloor;
 
-    // do the same to vertical
-    if (uv.v == 1.0f)
-    {
-        kv = 1.0f;
-        y0 = y1 = h - 1;
-    }
-    else if (fmodf(yf, 1.0f) < 0.5f)
+    // texel coords
+    int x0 = (int)xFloor;
+    int y0 = (int)yFloor;
+    int x1 = x0 + 1;
+    int y1 = y0 + 1;
+    if (addressMode == ADDRESS_MODE_REPEAT)
     {
-        kv = 0.5f - fmodf(yf, 1.0f);
-        y1 = int(yf);
-        if (addressMode == ADDRESS_MODE_REPEAT && y1 == 0)
-        {
-            y0 = h - 1;
-        }
-        else
-        {
-            y0 = std::max(y1 - 1, 0);
-        }
+        // the leftmost texel blends with the rightmost one, and so on
+        x0 = x0 < 0 ? w - 1 : x0;
+        y0 = y0 < 0 ? h - 1 : y0;
+        x1 = x1 > w - 1 ? 0 : x1;
+        y1 = y1 > h - 1 ? 0 : y1;
     }
     else
     {
-        kv = 1.5f - fmodf(yf, 1.0f);
-        y0 = int(yf);
-        if (addressMode == ADDRESS_MODE_REPEAT && y0 == h - 1)
-        {
-            y1 = 0;
-        }
-        else
-        {
-            y1 = std::min(y0 + 1, int(h - 1));
-        }
+        x0 = clamp(x0, 0, w - 1);
+        y0 = clamp(y0, 0, h - 1);
+        x1 = clamp(x1, 0, w - 1);
+        y1 = clamp(y1, 0, h - 1);
     }
 
     // sample and blend the color
-    result += (ku + 0) * (kv + 0) * tex.getMipmapped(x0, y0, mipmapLevel);
-    result += (1 - ku) * (kv + 0) * tex.getMipmapped(x1, y0, mipmapLevel);
-    result += (ku + 0) * (1 - kv) * tex.getMipmapped(x0, y1, mipmapLevel);
-    result += (1 - ku) * (1 - kv) * tex.getMipmapped(x1, y1, mipmapLevel);
+    T result = {};
+    result += (1 - kx) * (1 - ky) * tex.fetch(x0, y0, level);
+    result += (kx + 0) * (1 - ky) * tex.fetch(x1, y0, level);
+    result += (1 - kx) * (ky + 0) * tex.fetch(x0, y1, level);
+    result += (kx + 0) * (ky + 0) * tex.fetch(x1, y1, level);
 
     return result;
 }
@@ -265,17 +438,18 @@ Vec2f Sampler2D<T>::getSampleUV(Vec2f rawUV) const
     {
     case ADDRESS_MODE_REPEAT:
         // mapping u, v to [0.0, 1.0)
-        uv.u = rawUV.u >= 0.0f ? fmod(rawUV.u, 1.0f) : fmod(rawUV.u, 1.0f) + 1.0f;
-        uv.v = rawUV.v >= 0.0f ? fmod(rawUV.v, 1.0f) : fmod(rawUV.v, 1.0f) + 1.0f;
+        uv.u = rawUV.u - std::floor(rawUV.u);
+        uv.v = rawUV.v - std::floor(rawUV.v);
         break;
 
     case ADDRESS_MODE_MIRRORED_REPEAT:
         // mapping u, v to [0.0, 1.0]
         uv.u = 1.0f - std::abs(fmod(std::abs(rawUV.u), 2.0f) - 1.0f);
-        uv.u = 1.0f - std::abs(fmod(std::abs(rawUV.v), 2.0f) - 1.0f);
+        uv.v = 1.0f - std::abs(fmod(std::abs(rawUV.v), 2.0f) - 1.0f);
         break;
 
     case ADDRESS_MODE_CLAMP_TO_EDGE:
+    case ADDRESS_MODE_CLAMP_TO_BORDER:
         // clamp u, v to [0.0, 1.0]
         uv.u = clamp(rawUV.u, 0.0f, 1.0f);
         uv.v = clamp(rawUV.v, 0.0f, 1.0f);
@@ -284,3 +458,7 @@ Vec2f Sampler2D<T>::getSampleUV(Vec2f rawUV) const
 
     return uv;
 }
+
+// the samplers used by the shaders
+template class Sampler2D<Vec3f>;
+template class Sampler2D<float>;
@@ -34,7 +34,10 @@ class Sampler2D
 {
 public:
 
-    T sample(const Texture2D<T>& tex, Vec2f uv, Vec2f ddxUV, Vec2f ddyUV, const PipelineState& pipelineState) const;
+    T sample(const Texture2D<T>& tex, Vec2f uv, Vec2f ddxUV, Vec2f ddyUV) const;
+
+    // sample at the uvs of 2x2 pixels at once, the mipmap level is chosen once by the derivatives of the quad
+    void sampleQuad(const Texture2D<T>& tex, const Vec2f uv[4], Vec2f ddxUV, Vec2f ddyUV, T result[4]) const;
 
     void setAddressMode(AddressMode a) { addressMode = a; }
 
@@ -42,9 +45,14 @@ public:
 
     void setFilterMode(FilterMode f, int a) { filterMode = f; this->anisotropicLevel = a; }
 
-    void setBorderColor(Vec4f b) { borderColor = b; }
+    void setBorderColor(T b) { borderColor = b; }
 
 protected:
+    // log2 of the texel count a pixel covers along the longer derivative
+    float getLod(const Texture2D<T>& tex, Vec2f ddxUV, Vec2f ddyUV) const;
+
+    void sampleQuadFromMipmapLevel(const Texture2D<T>& tex, const float u[4], const float v[4], int mipmapLevel, T result[4]) const;
+
     T sampleFromMipmapLevel(const Texture2D<T>& tex, Vec2f uv, int mipmapLevel) const;
 
     T sampleAnisotropic(const Texture2D<T>& tex, Vec2f rawUV, Vec2f ddxUV, Vec2f ddyUV) const;
@@ -0,0 +1,334 @@
+#include <algorithm>
+#include "Scene.h"
+
+//---------------------------------------------------------------------
+// bounding boxes and frustums
+//---------------------------------------------------------------------
+
+void BoundingBox::expand(const Vec3f& p)
+{
+    min = Vector_min(min, p);
+    max = Vector_max(max, p);
+}
+
+void BoundingBox::expand(const BoundingBox& box)
+{
+    min = Vector_min(min, box.min);
+    max = Vector_max(max, box.max);
+}
+
+BoundingBox BoundingBox::transform(const Mat4x4f& m) const
+{
+    BoundingBox box;
+    if (isEmpty())
+    {
+        return box;
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        Vec4f corner((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z, 1.0f);
+        Vec4f p = corner * m;
+        box.expand(Vec3f(p.x, p.y, p.z));
+    }
+    return box;
+}
+
+Frustum::Frustum(const Mat4x4f& viewProjection)
+{
+    // clip coord i of a point is dot((p, 1), column i)
+    Vec4f x = viewProjection.Col(0);
+    Vec4f y = viewProjection.Col(1);
+    Vec4f z = viewProjection.Col(2);
+    Vec4f w = viewProjection.Col(3);
+    planes[0] = w + x;
+    planes[1] = w - x;
+    planes[2] = w + y;
+    planes[3] = w - y;
+    planes[4] = z;
+    planes[5] = w - z;
+}
+
+bool Frustum::testBox(const BoundingBox& box, uint32_t& mask) const
+{
+    if (box.isEmpty())
+    {
+        return false;
+    }
+    for (int i = 0; i < 6; ++i)
+    {
+        if ((mask & (1U << i)) == 0U)
+        {
+            continue;
+        }
+        const Vec4f& plane = planes[i];
+        // the corners farthest in and farthest out along the normal of the plane
+        Vec3f pIn(plane.x >= 0.0f ? box.max.x : box.min.x, plane.y >= 0.0f ? box.max.y : box.min.y, plane.z >= 0.0f ? box.max.z : box.min.z);
+        Vec3f pOut(plane.x >= 0.0f ? box.min.x : box.max.x, plane.y >= 0.0f ? box.min.y : box.max.y, plane.z >= 0.0f ? box.min.z : box.max.z);
+        if (plane.x * pIn.x + plane.y * pIn.y + plane.z * pIn.z + plane.w < 0.0f)
+        {
+            return false;
+        }
+        if (plane.x * pOut.x + plane.y * pOut.y + plane.z * pOut.z + plane.w >= 0.0f)
+        {
+            mask &= ~(1U << i);
+        }
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+// scene
+//---------------------------------------------------------------------
+
+int Scene::addNode(int parent, const Mat4x4f& local)
+{
+    assert(parent >= -1 && parent < (int)nodes.size());
+    Node node;
+    node.parent = parent;
+    node.local = local;
+    node.world = local;
+    nodes.push_back(node);
+    return (int)nodes.size() - 1;
+}
+
+void Scene::setDrawable(int node, const Mesh* mesh, VertexShader* pVS, PixelShader* pPS, const std::shared_ptr<const ShaderUniform>& uniforms)
+{
+    assert(mesh != nullptr && pVS != nullptr && pPS != nullptr && uniforms);
+    Node& n = nodes[node];
+    n.mesh = mesh;
+    n.pVertexShader = pVS;
+    n.pPixelShader = pPS;
+    n.uniforms = uniforms;
+    n.localBounds = BoundingBox();
+    mesh->getBounds(n.localBounds.min, n.localBounds.max);
+    n.moved = true;
+    if (n.leaf < 0)
+    {
+        bvhDirty = true;
+    }
+}
+
+void Scene::setLocalTransform(int node, const Mat4x4f& local)
+{
+    nodes[node].local = local;
+    nodes[node].moved = true;
+}
+
+void Scene::update()
+{
+    movedLeaves.clear();
+    // parents are before their children, so a moved parent is refreshed before them
+    for (Node& node : nodes)
+    {
+        if (node.parent >= 0 && nodes[node.parent].moved)
+        {
+            node.moved = true;
+        }
+        if (!node.moved)
+        {
+            continue;
+        }
+        node.world = node.parent >= 0 ? node.local * nodes[node.parent].world : node.local;
+        if (node.mesh != nullptr)
+        {
+            node.worldBounds = node.localBounds.transform(node.world);
+            if (node.leaf >= 0)
+            {
+                movedLeaves.push_back(node.leaf);
+            }
+        }
+    }
+    for (Node& node : nodes)
+    {
+        node.moved = false;
+    }
+    statistics.nodesRefitted = 0;
+    if (bvhDirty)
+    {
+        rebuild();
+        return;
+    }
+    // refit the leaves of the moved objects and the nodes above them
+    // a node whose bounds didn't change keeps the nodes above it as they are
+    std::sort(movedLeaves.begin(), movedLeaves.end());
+    movedLeaves.erase(std::unique(movedLeaves.begin(), movedLeaves.end()), movedLeaves.end());
+    for (int leaf : movedLeaves)
+    {
+        for (int node = leaf; node >= 0 && refitNode(node); node = bvhNodes[node].parent)
+        {
+            ++statistics.nodesRefitted;
+        }
+    }
+}
+
+void Scene::rebuild()
+{
+    bvhObjects.clear();
+    for (int i = 0; i < (int)nodes.size(); ++i)
+    {
+        if (nodes[i].mesh != nullptr)
+        {
+            bvhObjects.push_back(i);
+        }
+    }
+    bvhNodes.clear();
+    if (!bvhObjects.empty())
+    {
+        // a binary tree of n leaves has 2n - 1 nodes
+        bvhNodes.reserve(bvhObjects.size() * 2);
+        bvhNodes.push_back(BvhNode());
+        buildNode(0, 0, (int)bvhObjects.size());
+    }
+    bvhDirty = false;
+}
+
+void Scene::buildNode(int node, int first, int count)
+{
+    BoundingBox bounds;
+    BoundingBox centers;
+    for (int i = first; i < first + count; ++i)
+    {
+        bounds.expand(nodes[bvhObjects[i]].worldBounds);
+        centers.expand(nodes[bvhObjects[i]].worldBounds.center());
+    }
+    bvhNodes[node].bounds = bounds;
+    bvhNodes[node].first = first;
+    bvhNodes[node].count = count;
+    if (count <= SCENE_BVH_LEAF_SIZE)
+    {
+        bvhNodes[node].left = -1;
+        for (int i = first; i < first + count; ++i)
+        {
+            nodes[bvhObjects[i]].leaf = node;
+        }
+        return;
+    }
+    // split at the median of the centers along the longest axis of them
+    Vec3f extent = centers.max - centers.min;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    int half = count / 2;
+    std::nth_element(bvhObjects.begin() + first, bvhObjects.begin() + first + half, bvhObjects.begin() + first + count,
+        [this, axis](int a, int b) { return nodes[a].worldBounds.center()[axis] < nodes[b].worldBounds.center()[axis]; });
+    int left = (int)bvhNodes.size();
+    BvhNode child;
+    child.parent = node;
+    bvhNodes.push_back(child);
+    bvhNodes.push_back(child);
+    bvhNodes[node].left = left;
+    buildNode(left, first, half);
+    buildNode(left + 1, first + half, count - half);
+}
+
+bool Scene::refitNode(int node)
+{
+    const BvhNode& n = bvhNodes[node];
+    BoundingBox bounds;
+    if (n.left < 0)
+    {
+        for (int i = n.first; i < n.first + n.count; ++i)
+        {
+            bounds.expand(nodes[bvhObjects[i]].worldBounds);
+        }
+    }
+    else
+    {
+        bounds = bvhNodes[n.left].bounds;
+        bounds.expand(bvhNodes[n.left + 1].bounds);
+    }
+    if (bounds == n.bounds)
+    {
+        return false;
+    }
+    bvhNodes[node].bounds = bounds;
+    return true;
+}
+
+void Scene::cull(const Frustum& frustum, std::vector<int>& visible)
+{
+    assert(!bvhDirty);
+    visible.clear();
+    statistics.objects = (int)bvhObjects.size();
+    statistics.objectsVisible = 0;
+    statistics.nodesTested = 0;
+    if (bvhNodes.empty())
+    {
+        return;
+    }
+    cullStack.clear();
+    cullStack.push_back(std::make_pair(0, FRUSTUM_ALL_PLANES));
+    while (!cullStack.empty())
+    {
+        int node = cullStack.back().first;
+        uint32_t mask = cullStack.back().second;
+        cullStack.pop_back();
+        const BvhNode& n = bvhNodes[node];
+        ++statistics.nodesTested;
+        if (!frustum.testBox(n.bounds, mask))
+        {
+            continue;
+        }
+        // entirely in the frustum, all objects below are visible
+        if (mask == 0U)
+        {
+            visible.insert(visible.end(), bvhObjects.begin() + n.first, bvhObjects.begin() + n.first + n.count);
+            continue;
+        }
+        if (n.left >= 0)
+        {
+            cullStack.push_back(std::make_pair(n.left, mask));
+            cullStack.push_back(std::make_pair(n.left + 1, mask));
+            continue;
+        }
+        for (int i = n.first; i < n.first + n.count; ++i)
+        {
+            uint32_t objectMask = mask;
+            if (frustum.testBox(nodes[bvhObjects[i]].worldBounds, objectMask))
+            {
+                visible.push_back(bvhObjects[i]);
+            }
+        }
+    }
+    statistics.objectsVisible = (int)visible.size();
+}
+
+void Scene::bindObject(Pipeline& pipeline, int node, const Mat4x4f& viewProjection) const
+{
+    const Node& n = nodes[node];
+    pipeline.setMesh(n.mesh);
+    pipeline.setShaders(n.pVertexShader, n.pPixelShader);
+    // the uniforms are shared by the objects, only the transform is per draw
+    pipeline.setUniforms(n.uniforms);
+    pipeline.setDrawTransform(n.world * viewProjection);
+}
+
+int Scene::draw(Pipeline& pipeline, const Mat4x4f& view, const Mat4x4f& projection)
+{
+    Mat4x4f viewProjection = view * projection;
+    cull(Frustum(viewProjection), visibleObjects);
+    statistics.objectsOccluded = 0;
+    // the occluders fill the occlusion buffer before the others are tested against it
+    auto firstOccludee = std::stable_partition(visibleObjects.begin(), visibleObjects.end(), [this](int i) { return nodes[i].occluder; });
+    bool occlusion = firstOccludee != visibleObjects.begin();
+    if (occlusion)
+    {
+        pipeline.clearOcclusionBuffer();
+    }
+    int drawn = 0;
+    for (auto it = visibleObjects.begin(); it != visibleObjects.end(); ++it)
+    {
+        const Node& node = nodes[*it];
+        if (it >= firstOccludee && occlusion && !pipeline.queryOcclusion(node.worldBounds.min, node.worldBounds.max, viewProjection))
+        {
+            ++statistics.objectsOccluded;
+            continue;
+        }
+        bindObject(pipeline, *it, viewProjection);
+        if (it < firstOccludee)
+        {
+            pipeline.renderOccluders();
+        }
+        pipeline.renderToTarget();
+        ++drawn;
+    }
+    return drawn;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "Mesh.h"
+#include "Pipeline.h"
+
+// max count of objects in a leaf of the BVH
+constexpr int SCENE_BVH_LEAF_SIZE = 4;
+
+/*
+* struct BoundingBox
+* axis aligned box, empty if min is greater than max on any axis
+*/
+struct BoundingBox
+{
+    BoundingBox() : min(1e30f, 1e30f, 1e30f), max(-1e30f, -1e30f, -1e30f) {}
+
+    BoundingBox(const Vec3f& min, const Vec3f& max) : min(min), max(max) {}
+
+    bool isEmpty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+    Vec3f center() const { return (min + max) * 0.5f; }
+
+    void expand(const Vec3f& p);
+
+    void expand(const BoundingBox& box);
+
+    // box of the 8 corners transformed by m as row vectors, empty boxes stay empty
+    BoundingBox transform(const Mat4x4f& m) const;
+
+    Vec3f min;
+    Vec3f max;
+};
+
+inline bool operator == (const BoundingBox& a, const BoundingBox& b)
+{
+    return a.min == b.min && a.max == b.max;
+}
+
+/*
+* struct Frustum
+* the 6 planes of the view volume in world space, p is inside a plane if dot(p, plane.xyz) + plane.w >= 0
+*/
+struct Frustum
+{
+    // planes of the clip space of row vectors transformed by viewProjection, -w <= x, y <= w and 0 <= z <= w,
+    // as matrix_set_lookat() * matrix_set_perspective()
+    explicit Frustum(const Mat4x4f& viewProjection);
+
+    // returns false if the box is entirely out of one of the planes in mask
+    // the planes the box is entirely in are cleared from mask, boxes in them need no test against them
+    bool testBox(const BoundingBox& box, uint32_t& mask) const;
+
+    Vec4f planes[6];
+};
+
+// bits of all planes of a frustum
+constexpr uint32_t FRUSTUM_ALL_PLANES = (1U << 6) - 1;
+
+/*
+* struct SceneStatistics
+* counters of the last Scene::cull() and draw()
+*/
+struct SceneStatistics
+{
+    // objects in the BVH
+    int objects = 0;
+    // objects whose bounds intersect the frustum
+    int objectsVisible = 0;
+    // visible objects draw() skipped as they are behind the occluders
+    int objectsOccluded = 0;
+    // BVH nodes tested against the frustum, subtrees entirely in it are not tested
+    int nodesTested = 0;
+    // BVH nodes refitted by the last update()
+    int nodesRefitted = 0;
+};
+
+/*
+* class Scene
+* a hierarchy of transforms, the nodes with a mesh are objects drawn by their shaders and uniforms
+* every object is drawn with world * view * projection as the draw transform of the pipeline
+* the world bounds of the objects are kept in a BVH to cull them against the camera before any draw
+* usage :
+* 1. addNode() to build the hierarchy, setDrawable() to give nodes a mesh
+* 2. setLocalTransform() to move nodes, then update() once to refresh the world transforms and refit the BVH
+* 3. draw() to cull the objects and draw the visible ones with a pipeline, or cull() to get them
+*    the visible objects set as occluders are drawn first, and the others hidden behind them are skipped
+* refitting keeps the BVH correct but looser as objects move far, call rebuild() to make it tight again
+*/
+class Scene
+{
+public:
+    // returns the index of the node, parent is an existing node or -1 for a root
+    // world transform of a node is local * the world transform of the parent, as row vectors
+    int addNode(int parent, const Mat4x4f& local);
+
+    // draw the mesh of the node with the shaders and the uniforms, the mesh must outlive the scene
+    // the uniforms are bound as they are, objects of the same material share them
+    void setDrawable(int node, const Mesh* mesh, VertexShader* pVS, PixelShader* pPS, const std::shared_ptr<const ShaderUniform>& uniforms);
+
+    void setLocalTransform(int node, const Mat4x4f& local);
+
+    // draw() renders the object to the occlusion buffer of the pipeline before the others, and tests them against it
+    // good occluders are big and near the camera, e.g. terrain and buildings
+    void setOccluder(int node, bool occluder) { nodes[node].occluder = occluder; }
+
+    // valid after update()
+    const Mat4x4f& getWorldTransform(int node) const { return nodes[node].world; }
+
+    const BoundingBox& getWorldBounds(int node) const { return nodes[node].worldBounds; }
+
+    int getNodeCount() const { return (int)nodes.size(); }
+
+    // refresh the world transforms and bounds of the moved nodes and their children, and refit the BVH nodes above them
+    // the BVH is rebuilt if objects were added since it was built
+    void update();
+
+    // build the BVH from the world bounds of all objects
+    void rebuild();
+
+    // nodes of the objects whose world bounds intersect the frustum, in no particular order
+    void cull(const Frustum& frustum, std::vector<int>& visible);
+
+    // cull by view * projection, and draw the visible objects one after another, occluders first
+    // if any occluder is visible, objects behind the occluders are not drawn
+    // the state of the pipeline is kept, its near and far must fit the projection
+    // returns the count of objects drawn
+    int draw(Pipeline& pipeline, const Mat4x4f& view, const Mat4x4f& projection);
+
+    const SceneStatistics& getStatistics() const { return statistics; }
+
+protected:
+    struct Node
+    {
+        int parent = -1;
+        Mat4x4f local;
+        Mat4x4f world;
+        // the world transform of the node or of a parent changed since the last update()
+        bool moved = true;
+        const Mesh* mesh = nullptr;
+        VertexShader* pVertexShader = nullptr;
+        PixelShader* pPixelShader = nullptr;
+        std::shared_ptr<const ShaderUniform> uniforms;
+        bool occluder = false;
+        // bounds of the mesh, and the world bounds of them
+        BoundingBox localBounds;
+        BoundingBox worldBounds;
+        // leaf of the BVH holding the object, -1 if not in it
+        int leaf = -1;
+    };
+
+    // objects [first, first + count) of bvhObjects are in the subtree of a BVH node
+    // a leaf has no children, the children of an interior node are left and left + 1
+    struct BvhNode
+    {
+        BoundingBox bounds;
+        int parent = -1;
+        int left = -1;
+        int first = 0;
+        int count = 0;
+    };
+
+    // make a BVH node the root of the subtree of bvhObjects [first, first + count), its parent must be set
+    void buildNode(int node, int first, int count);
+
+    // set the bounds of a BVH node to the union of its children or objects, returns false if they didn't change
+    bool refitNode(int node);
+
+    // bind the mesh, shaders, uniforms and draw transform of the object to the pipeline
+    void bindObject(Pipeline& pipeline, int node, const Mat4x4f& viewProjection) const;
+
+protected:
+    // parents are always before their children
+    std::vector<Node> nodes;
+    std::vector<BvhNode> bvhNodes;
+    // node indices of the objects, ordered by the BVH leaves
+    std::vector<int> bvhObjects;
+    // objects were added since the BVH was built
+    bool bvhDirty = true;
+    // scratch of cull() and update()
+    std::vector<std::pair<int, uint32_t>> cullStack;
+    std::vector<int> movedLeaves;
+    std::vector<int> visibleObjects;
+    SceneStatistics statistics;
+};
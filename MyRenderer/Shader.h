@@ -1,6 +1,9 @@
 #pragma once
 
+#include <memory>
 #include <unordered_map>
+#include <initializer_list>
+#include <utility>
 #include "Texture.h"
 #include "Sampler.h"
 #include "PipelineState.h"
@@ -8,12 +11,274 @@
 // some constants to use as key in the shader context
 constexpr int SV_Position = 0;
 constexpr int SV_uv = 1;
+constexpr int SV_normal = 2;
 constexpr int SV_ddxUV = -3;
 constexpr int SV_ddyUV = -4;
 constexpr int SV_screenX = -1;
 constexpr int SV_screenY = -2;
+// index of the instance as a float, in the vertex shader input of instanced draws
+constexpr int SV_InstanceID = -5;
 
+// types of the values in the shader context, the value of each type is its count of floats
+enum VaryingType
+{
+    VARYING_TYPE_NONE = 0,
+    VARYING_TYPE_FLOAT = 1,
+    VARYING_TYPE_VEC2F = 2,
+    VARYING_TYPE_VEC3F = 3,
+    VARYING_TYPE_VEC4F = 4,
+    VARYING_TYPE_MAT4X4F = 16,
+};
+
+// max count of floats in one shader context
+constexpr int SHADER_CONTEXT_MAX_FLOATS = 64;
+// count of vertices the vertex shader takes in one batch
+constexpr int SHADER_BATCH_SIZE = 8;
+// range of keys can be used in a varying layout
+constexpr int VARYING_KEY_MIN = -8;
+constexpr int VARYING_KEY_MAX = 55;
+
+/*
+* class VaryingLayout
+* declares the values of a shader context up front, like an input layout:
+* every key gets a fixed slot in a packed float array, in the order they are added
+* a layout must outlive all the shader contexts using it
+*/
+class VaryingLayout
+{
+public:
+    VaryingLayout()
+    {
+        for (int k = 0; k < VARYING_KEY_MAX - VARYING_KEY_MIN + 1; ++k)
+        {
+            offsets[k] = -1;
+            types[k] = VARYING_TYPE_NONE;
+        }
+    }
+
+    VaryingLayout(const std::initializer_list<std::pair<int, VaryingType>>& u) : VaryingLayout()
+    {
+        for (auto& item : u)
+        {
+            add(item.first, item.second);
+        }
+    }
+
+    // add a value to the layout, returns the offset of it
+    int add(int key, VaryingType type)
+    {
+        assert(key >= VARYING_KEY_MIN && key <= VARYING_KEY_MAX);
+        assert(offsets[key - VARYING_KEY_MIN] < 0);
+        assert(count + (int)type <= SHADER_CONTEXT_MAX_FLOATS);
+        offsets[key - VARYING_KEY_MIN] = (int8_t)count;
+        types[key - VARYING_KEY_MIN] = (uint8_t)type;
+        count += (int)type;
+        return offsets[key - VARYING_KEY_MIN];
+    }
+
+    // add all the values of other in the order of their offsets, so values packed by other
+    // are packed the same from the old floatCount() on
+    void append(const VaryingLayout& other)
+    {
+        for (int offset = 0; offset < other.count;)
+        {
+            int k = 0;
+            while (other.offsets[k] != offset)
+            {
+                ++k;
+            }
+            add(k + VARYING_KEY_MIN, (VaryingType)other.types[k]);
+            offset += other.types[k];
+        }
+    }
+
+    bool has(int key) const
+    {
+        return key >= VARYING_KEY_MIN && key <= VARYING_KEY_MAX && offsets[key - VARYING_KEY_MIN] >= 0;
+    }
+
+    int offsetOf(int key) const
+    {
+        assert(has(key));
+        return offsets[key - VARYING_KEY_MIN];
+    }
+
+    VaryingType typeOf(int key) const
+    {
+        return has(key) ? (VaryingType)types[key - VARYING_KEY_MIN] : VARYING_TYPE_NONE;
+    }
+
+    // count of floats of all the values
+    int floatCount() const { return count; }
+
+protected:
+    int8_t offsets[VARYING_KEY_MAX - VARYING_KEY_MIN + 1];
+    uint8_t types[VARYING_KEY_MAX - VARYING_KEY_MIN + 1];
+    int count = 0;
+};
+
+/*
+* struct ShaderContext
+* values of a vertex or a pixel, packed as floats by the layout
+* copying a shader context allocates nothing
+*/
 struct ShaderContext
+{
+    ShaderContext() : layout(nullptr) {}
+
+    explicit ShaderContext(const VaryingLayout* layout) : layout(layout)
+    {
+        for (int i = 0; i < layout->floatCount(); ++i)
+        {
+            data[i] = 0.0f;
+        }
+    }
+
+    float& f(int key) { return *reinterpret_cast<float*>(slot(key, VARYING_TYPE_FLOAT)); }
+    Vec2f& v2f(int key) { return *reinterpret_cast<Vec2f*>(slot(key, VARYING_TYPE_VEC2F)); }
+    Vec3f& v3f(int key) { return *reinterpret_cast<Vec3f*>(slot(key, VARYING_TYPE_VEC3F)); }
+    Vec4f& v4f(int key) { return *reinterpret_cast<Vec4f*>(slot(key, VARYING_TYPE_VEC4F)); }
+    Mat4x4f& m4x4(int key) { return *reinterpret_cast<Mat4x4f*>(slot(key, VARYING_TYPE_MAT4X4F)); }
+
+    const float& f(int key) const { return *reinterpret_cast<const float*>(slot(key, VARYING_TYPE_FLOAT)); }
+    const Vec2f& v2f(int key) const { return *reinterpret_cast<const Vec2f*>(slot(key, VARYING_TYPE_VEC2F)); }
+    const Vec3f& v3f(int key) const { return *reinterpret_cast<const Vec3f*>(slot(key, VARYING_TYPE_VEC3F)); }
+    const Vec4f& v4f(int key) const { return *reinterpret_cast<const Vec4f*>(slot(key, VARYING_TYPE_VEC4F)); }
+    const Mat4x4f& m4x4(int key) const { return *reinterpret_cast<const Mat4x4f*>(slot(key, VARYING_TYPE_MAT4X4F)); }
+
+    float* slot(int key, VaryingType type)
+    {
+        assert(layout->typeOf(key) == type);
+        return data + layout->offsetOf(key);
+    }
+
+    const float* slot(int key, VaryingType type) const
+    {
+        assert(layout->typeOf(key) == type);
+        return data + layout->offsetOf(key);
+    }
+
+    const VaryingLayout* layout;
+    float data[SHADER_CONTEXT_MAX_FLOATS];
+};
+
+/*
+* struct VertexBufferView
+* vertices the pipeline reads in place, vertex i is layout->floatCount() floats at stride * i bytes from data
+* a view owns nothing, the vertices must outlive the draws using them
+*/
+struct VertexBufferView
+{
+    VertexBufferView() {}
+
+    VertexBufferView(const VaryingLayout* layout, const float* data, size_t stride, int count)
+        : layout(layout), data(data), stride(stride), count(count) {}
+
+    // shader contexts of one layout
+    explicit VertexBufferView(const std::vector<ShaderContext>& vertices)
+        : layout(vertices.empty() ? nullptr : vertices[0].layout), data(vertices.empty() ? nullptr : vertices[0].data),
+        stride(sizeof(ShaderContext)), count((int)vertices.size()) {}
+
+    const float* vertex(int i) const { return (const float*)((const uint8_t*)data + stride * i); }
+
+    const VaryingLayout* layout = nullptr;
+    const float* data = nullptr;
+    size_t stride = 0;
+    int count = 0;
+};
+
+// indices the pipeline reads in place, 3 per triangle, owns nothing as VertexBufferView
+struct IndexBufferView
+{
+    IndexBufferView() {}
+
+    IndexBufferView(const int* data, int count) : data(data), count(count) {}
+
+    explicit IndexBufferView(const std::vector<int>& indices) : data(indices.data()), count((int)indices.size()) {}
+
+    const int* data = nullptr;
+    int count = 0;
+};
+
+/*
+* struct ShaderBatch
+* values of SHADER_BATCH_SIZE vertices as structure of arrays, every float of the layout is a stream of lanes
+* component c of the value of key in lane i is stream(key, type)[c * SHADER_BATCH_SIZE + i]
+*/
+struct ShaderBatch
+{
+    ShaderBatch() : layout(nullptr), count(0) {}
+
+    explicit ShaderBatch(const VaryingLayout* layout) : layout(layout), count(0)
+    {
+        for (int i = 0; i < layout->floatCount(); ++i)
+        {
+            for (int j = 0; j < SHADER_BATCH_SIZE; ++j)
+            {
+                data[i][j] = 0.0f;
+            }
+        }
+    }
+
+    float* stream(int key, VaryingType type)
+    {
+        assert(layout->typeOf(key) == type);
+        return data[layout->offsetOf(key)];
+    }
+
+    const float* stream(int key, VaryingType type) const
+    {
+        assert(layout->typeOf(key) == type);
+        return data[layout->offsetOf(key)];
+    }
+
+    // copy the values of a vertex to a lane
+    void load(int lane, const ShaderContext& context)
+    {
+        for (int i = 0; i < layout->floatCount(); ++i)
+        {
+            data[i][lane] = context.data[i];
+        }
+    }
+
+    // copy the values of a vertex packed as floats by the layout to a lane
+    void load(int lane, const float* values)
+    {
+        for (int i = 0; i < layout->floatCount(); ++i)
+        {
+            data[i][lane] = values[i];
+        }
+    }
+
+    // copy count floats to a lane from the float at offset on, e.g. the values of one of the layouts appended
+    void load(int lane, const float* values, int offset, int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            data[offset + i][lane] = values[i];
+        }
+    }
+
+    // copy the values of a lane to a vertex
+    void store(int lane, ShaderContext& context) const
+    {
+        context.layout = layout;
+        for (int i = 0; i < layout->floatCount(); ++i)
+        {
+            context.data[i] = data[i][lane];
+        }
+    }
+
+    const VaryingLayout* layout;
+    // count of used lanes, the values of the other lanes are meaningless
+    int count;
+    alignas(32) float data[SHADER_CONTEXT_MAX_FLOATS][SHADER_BATCH_SIZE];
+};
+
+// the maps are owned by value, so a copy of the uniforms copies all of them, only the textures are shared
+// build the uniforms once and bind them to any count of draws through a std::shared_ptr<const ShaderUniform>,
+// nobody may change them once they are bound
+struct ShaderUniform
 {
     std::unordered_map<int, float> f;
     std::unordered_map<int, Vec2f> v2f;
@@ -21,12 +286,8 @@ struct ShaderContext
     std::unordered_map<int, Vec4f> v4f;
     std::unordered_map<int, Mat4x4f> m4x4;
     std::unordered_map<int, int> i;
-};
-
-struct ShaderUniform : public ShaderContext
-{
     std::unordered_map<int, Sampler2D<Vec3f>> sampler2D3F;
-    std::vector<Texture2D3F> textures;
+    std::vector<std::shared_ptr<const Texture2D3F>> textures;
 };
 
 // class VertexShader
@@ -35,18 +296,58 @@ class VertexShader
 public:
     // DON'T use these functions in the derived class
     // these are for the Pipeline object
-    void excute(ShaderContext& input, ShaderContext& output, ShaderUniform& uniform, const PipelineState& pipelineState)
+    // bind() is called once before a draw, excute() may run on many threads after it
+    void bind(const ShaderUniform& uniform, const Mat4x4f& drawTransform, const PipelineState& pipelineState)
     {
+        this->pUniform = &uniform;
+        this->pDrawTransform = &drawTransform;
         this->pPipelineState = &pipelineState;
-        excute(input, output, uniform);
     }
+
+    void excute(ShaderContext& input, ShaderContext& output)
+    {
+        excute(input, output, *pUniform);
+    }
+
+    void excuteBatch(const ShaderBatch& input, ShaderBatch& output)
+    {
+        excuteBatch(input, output, *pUniform);
+    }
+
+    // layout of the output, every output of excute() has this layout
+    const VaryingLayout& getOutputLayout() const { return outputLayout; }
+
 protected:
     // override this function to imply your own vertex shader
-    virtual void excute(ShaderContext& input, ShaderContext& output, ShaderUniform& uniform) = 0;
+    virtual void excute(ShaderContext& input, ShaderContext& output, const ShaderUniform& uniform) = 0;
+
+    // override this function to shade a batch of vertices in one call, output has outputLayout
+    // all SHADER_BATCH_SIZE lanes may be shaded, only the first input.count lanes are used
+    // by default, every lane is shaded by excute()
+    virtual void excuteBatch(const ShaderBatch& input, ShaderBatch& output, const ShaderUniform& uniform)
+    {
+        ShaderContext in;
+        for (int i = 0; i < input.count; ++i)
+        {
+            ShaderContext out(&outputLayout);
+            input.store(i, in);
+            excute(in, out, uniform);
+            output.load(i, out);
+        }
+    }
+
+    // these are some built-in functions, USE them in the override function
+    // the transform of the object being drawn, set by Pipeline::setDrawTransform() for each draw
+    const Mat4x4f& getDrawTransform() const { return *pDrawTransform; }
 
 protected:
+    // declare the output layout in the constructor of the derived class
+    VaryingLayout outputLayout;
+
     // don't use them in excute() directly
-    const PipelineState* pPipelineState;
+    const PipelineState* pPipelineState = nullptr;
+    const ShaderUniform* pUniform = nullptr;
+    const Mat4x4f* pDrawTransform = nullptr;
 
 };
 
@@ -56,12 +357,24 @@ class PixelShader
 public:
     // DON'T use these functions in the derived class
     // these are for the Pipeline object
-    Vec4f excute(const ShaderContext& input, const ShaderUniform& uniform, const PipelineState& pipelineState)
+    // bind() is called once before a draw, excute() may run on many threads after it
+    void bind(const ShaderUniform& uniform, const PipelineState& pipelineState)
     {
-        this->pInput = &input;
         this->pUniform = &uniform;
         this->pPipelineState = &pipelineState;
-        return excute(input, uniform);
+    }
+
+    Vec4f excute(const ShaderContext& input)
+    {
+        currentInput() = &input;
+        return excute(input, *pUniform);
+    }
+
+    // shade 2x2 pixels, bit j of mask is set if pixel j is covered
+    void excuteQuad(const ShaderContext input[4], uint32_t mask, Vec4f output[4])
+    {
+        currentInput() = &input[0];
+        excuteQuad(input, mask, output, *pUniform);
     }
 
 protected:
@@ -71,16 +384,49 @@ protected:
         const ShaderUniform& uniform
     ) = 0;
 
+    // override this function to shade 2x2 pixels in one call, e.g. to use sampleQuad()
+    // pixels not in mask may be shaded as helpers, their outputs are dropped
+    // by default, every covered pixel is shaded by excute()
+    virtual void excuteQuad(
+        const ShaderContext input[4],
+        uint32_t mask,
+        Vec4f output[4],
+        const ShaderUniform& uniform)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            if ((mask & (1U << j)) != 0U)
+            {
+                currentInput() = &input[j];
+                output[j] = excute(input[j], uniform);
+            }
+        }
+    }
+
 protected:
     // these are some built-in functions, USE them in the override function
     Vec3f sample(const Sampler2D<Vec3f>& sampler, const Texture2D3F& tex, Vec2f uv)
     {
-        sampler.sample(tex, uv, pUniform->v2f.at(SV_ddxUV), pUniform->v2f.at(SV_ddyUV), *pPipelineState);
+        const ShaderContext* pInput = currentInput();
+        return sampler.sample(tex, uv, pInput->v2f(SV_ddxUV), pInput->v2f(SV_ddyUV));
+    }
+
+    // sample for all 2x2 pixels in excuteQuad(), the derivatives of the top row choose the mipmap level
+    void sampleQuad(const Sampler2D<Vec3f>& sampler, const Texture2D3F& tex, const Vec2f uv[4], Vec3f result[4])
+    {
+        const ShaderContext* pInput = currentInput();
+        sampler.sampleQuad(tex, uv, pInput->v2f(SV_ddxUV), pInput->v2f(SV_ddyUV), result);
+    }
+
+    // the input being shaded on this thread
+    static const ShaderContext*& currentInput()
+    {
+        static thread_local const ShaderContext* pInput = nullptr;
+        return pInput;
     }
 
 protected:
     // don't use them in excute() directly
-    const PipelineState* pPipelineState;
-    const ShaderContext* pInput;
-    const ShaderUniform* pUniform;
+    const PipelineState* pPipelineState = nullptr;
+    const ShaderUniform* pUniform = nullptr;
 };
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <cstdint>
+#include "MathHelper.h"
+
+// SSE2 is always there on x64, and on x86 unless built with /arch:IA32
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// AVX only when the compiler is told to use it (/arch:AVX, -mavx)
+#if defined(__AVX__)
+#define SIMD_AVX 1
+#include <immintrin.h>
+#endif
+
+//---------------------------------------------------------------------
+// lane operations
+//---------------------------------------------------------------------
+
+#if defined(SIMD_SSE2)
+// SSE2 has no round instructions, x must be in the range of int
+inline __m128 simdFloor(__m128 x)
+{
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    // truncation rounds negative values up
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+}
+
+inline __m128 simdAbs(__m128 x)
+{
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+}
+
+// a where mask is set, else b
+inline __m128i simdSelect(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// SSE2 has no min and max of 32 bit ints
+inline __m128i simdClamp(__m128i x, __m128i lo, __m128i hi)
+{
+    x = simdSelect(_mm_cmplt_epi32(x, lo), lo, x);
+    return simdSelect(_mm_cmpgt_epi32(x, hi), hi, x);
+}
+#endif
+
+// y[i] += a * x[i] for i in [0, count)
+inline void simdAxpy(float a, const float* x, float* y, int count)
+{
+    int i = 0;
+#if defined(SIMD_AVX)
+    const __m256 a8 = _mm256_set1_ps(a);
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_mul_ps(a8, _mm256_loadu_ps(x + i))));
+    }
+#endif
+#if defined(SIMD_SSE2)
+    const __m128 a4 = _mm_set1_ps(a);
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(a4, _mm_loadu_ps(x + i))));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        y[i] += a * x[i];
+    }
+}
+
+// sum of count vectors of 3 floats stored one after another, count must be a multiple of 4
+inline void simdSumVec3(const float* v, int count, float sum[3])
+{
+#if defined(SIMD_SSE2)
+    // 4 vectors are 3 registers, [x0 y0 z0 x1] [y1 z1 x2 y2] [z2 x3 y3 z3]
+    __m128 a = _mm_setzero_ps();
+    __m128 b = _mm_setzero_ps();
+    __m128 c = _mm_setzero_ps();
+    for (int i = 0; i < count * 3; i += 12)
+    {
+        a = _mm_add_ps(a, _mm_loadu_ps(v + i));
+        b = _mm_add_ps(b, _mm_loadu_ps(v + i + 4));
+        c = _mm_add_ps(c, _mm_loadu_ps(v + i + 8));
+    }
+    alignas(16) float fa[4], fb[4], fc[4];
+    _mm_store_ps(fa, a);
+    _mm_store_ps(fb, b);
+    _mm_store_ps(fc, c);
+    sum[0] = fa[0] + fa[3] + fb[2] + fc[1];
+    sum[1] = fa[1] + fb[0] + fb[3] + fc[2];
+    sum[2] = fa[2] + fb[1] + fc[0] + fc[3];
+#else
+    sum[0] = sum[1] = sum[2] = 0.0f;
+    for (int i = 0; i < count; ++i)
+    {
+        sum[0] += v[i * 3 + 0];
+        sum[1] += v[i * 3 + 1];
+        sum[2] += v[i * 3 + 2];
+    }
+#endif
+}
+
+// min and max of count floats, count must be a multiple of 4
+inline void simdMinMax(const float* v, int count, float& minValue, float& maxValue)
+{
+#if defined(SIMD_SSE2)
+    __m128 mn = _mm_loadu_ps(v);
+    __m128 mx = mn;
+    for (int i = 4; i < count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(v + i);
+        mn = _mm_min_ps(mn, x);
+        mx = _mm_max_ps(mx, x);
+    }
+    mn = _mm_min_ps(mn, _mm_shuffle_ps(mn, mn, _MM_SHUFFLE(1, 0, 3, 2)));
+    mx = _mm_max_ps(mx, _mm_shuffle_ps(mx, mx, _MM_SHUFFLE(1, 0, 3, 2)));
+    mn = _mm_min_ps(mn, _mm_shuffle_ps(mn, mn, _MM_SHUFFLE(2, 3, 0, 1)));
+    mx = _mm_max_ps(mx, _mm_shuffle_ps(mx, mx, _MM_SHUFFLE(2, 3, 0, 1)));
+    minValue = _mm_cvtss_f32(mn);
+    maxValue = _mm_cvtss_f32(mx);
+#else
+    minValue = maxValue = v[0];
+    for (int i = 1; i < count; ++i)
+    {
+        minValue = std::min(minValue, v[i]);
+        maxValue = std::max(maxValue, v[i]);
+    }
+#endif
+}
+
+//---------------------------------------------------------------------
+// lane masks
+//---------------------------------------------------------------------
+
+// bit i of the result is set if base + offsets[i] >= 0, or > 0 if not inclusive
+// count must be a multiple of 4 and not greater than 64, offsets must be 16 bytes aligned
+inline uint64_t simdNotNegativeMask(float base, const float* offsets, int count, bool inclusive = true)
+{
+    uint64_t mask = 0;
+    int i = 0;
+#if defined(SIMD_AVX)
+    const __m256 base8 = _mm256_set1_ps(base);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_add_ps(base8, _mm256_loadu_ps(offsets + i));
+        __m256 test = inclusive ? _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GE_OQ) : _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GT_OQ);
+        mask |= (uint64_t)_mm256_movemask_ps(test) << i;
+    }
+#endif
+#if defined(SIMD_SSE2)
+    const __m128 base4 = _mm_set1_ps(base);
+    for (; i < count; i += 4)
+    {
+        __m128 v = _mm_add_ps(base4, _mm_load_ps(offsets + i));
+        __m128 test = inclusive ? _mm_cmpge_ps(v, _mm_setzero_ps()) : _mm_cmpgt_ps(v, _mm_setzero_ps());
+        mask |= (uint64_t)_mm_movemask_ps(test) << i;
+    }
+#else
+    for (; i < count; ++i)
+    {
+        float v = base + offsets[i];
+        mask |= (uint64_t)(inclusive ? v >= 0.0f : v > 0.0f) << i;
+    }
+#endif
+    return mask;
+}
+
+//---------------------------------------------------------------------
+// transforms
+//---------------------------------------------------------------------
+
+// the row vector v times m, same as v * m
+inline Vec4f simdMul(const Vec4f& v, const Mat4x4f& m)
+{
+#if defined(SIMD_SSE2)
+    __m128 r = _mm_mul_ps(_mm_set1_ps(v.x), _mm_loadu_ps(m.m[0]));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v.y), _mm_loadu_ps(m.m[1])));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v.z), _mm_loadu_ps(m.m[2])));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v.w), _mm_loadu_ps(m.m[3])));
+    Vec4f out;
+    _mm_storeu_ps(&out.x, r);
+    return out;
+#else
+    return v * m;
+#endif
+}
+
+// m times the column vector v, same as m * v
+inline Vec4f simdMul(const Mat4x4f& m, const Vec4f& v)
+{
+    return simdMul(v, m.Transpose());
+}
+
+// transform lanes of vectors stored as structure of arrays, component c of lane i is at [c * lanes + i]
+// out = in * m if rowVector, else out = m * in, lanes must be a multiple of 4, in and out must not overlap
+inline void simdTransformLanes(const float* in, const Mat4x4f& m, bool rowVector, float* out, int lanes)
+{
+    // element of the matrix multiplied by component c of the input to get component r of the output
+    auto factor = [&](int c, int r) { return rowVector ? m.m[c][r] : m.m[r][c]; };
+    for (int r = 0; r < 4; ++r)
+    {
+        int i = 0;
+#if defined(SIMD_AVX)
+        for (; i + 8 <= lanes; i += 8)
+        {
+            __m256 sum = _mm256_mul_ps(_mm256_loadu_ps(in + i), _mm256_set1_ps(factor(0, r)));
+            for (int c = 1; c < 4; ++c)
+            {
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(in + c * lanes + i), _mm256_set1_ps(factor(c, r))));
+            }
+            _mm256_storeu_ps(out + r * lanes + i, sum);
+        }
+#endif
+#if defined(SIMD_SSE2)
+        for (; i < lanes; i += 4)
+        {
+            __m128 sum = _mm_mul_ps(_mm_loadu_ps(in + i), _mm_set1_ps(factor(0, r)));
+            for (int c = 1; c < 4; ++c)
+            {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(in + c * lanes + i), _mm_set1_ps(factor(c, r))));
+            }
+            _mm_storeu_ps(out + r * lanes + i, sum);
+        }
+#else
+        for (; i < lanes; ++i)
+        {
+            out[r * lanes + i] = in[i] * factor(0, r) + in[lanes + i] * factor(1, r) +
+                in[2 * lanes + i] * factor(2, r) + in[3 * lanes + i] * factor(3, r);
+        }
+#endif
+    }
+}
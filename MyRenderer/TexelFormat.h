@@ -0,0 +1,296 @@
+#pragma once
+
+#include <cstring>
+#include "MathHelper.h"
+
+// how texels are stored, they are always floats once fetched
+enum TexelFormat
+{
+    // the texel type itself, e.g. Vec3f or float
+    TEXEL_FORMAT_FLOAT,
+    // 4 bytes, rgb in [0.0, 1.0] and alpha 1.0
+    TEXEL_FORMAT_RGBA8_UNORM,
+    // 4 bytes, rgb sRGB encoded, fetched as linear values
+    TEXEL_FORMAT_RGBA8_SRGB,
+    // 6 bytes, 3 half floats
+    TEXEL_FORMAT_RGB16F,
+    // 4 bytes, unsigned floats of 11, 11 and 10 bits, no negative values
+    TEXEL_FORMAT_R11G11B10F,
+    // 2 bytes, one channel in [0.0, 1.0], for depth
+    TEXEL_FORMAT_R16_UNORM,
+};
+
+// bytes of a packed texel, 0 for TEXEL_FORMAT_FLOAT
+inline size_t getTexelBytes(TexelFormat format)
+{
+    switch (format)
+    {
+    case TEXEL_FORMAT_RGBA8_UNORM:
+    case TEXEL_FORMAT_RGBA8_SRGB:
+    case TEXEL_FORMAT_R11G11B10F:
+        return 4;
+    case TEXEL_FORMAT_RGB16F:
+        return 6;
+    case TEXEL_FORMAT_R16_UNORM:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// greatest difference between a value in [0.0, 1.0] and its packed one
+inline float getTexelPrecision(TexelFormat format)
+{
+    switch (format)
+    {
+    case TEXEL_FORMAT_RGBA8_UNORM:
+    case TEXEL_FORMAT_RGBA8_SRGB:
+        return 0.5f / 255.0f;
+    case TEXEL_FORMAT_RGB16F:
+        return 1.0f / 4096.0f;
+    case TEXEL_FORMAT_R11G11B10F:
+        return 1.0f / 128.0f;
+    case TEXEL_FORMAT_R16_UNORM:
+        return 0.5f / 65535.0f;
+    default:
+        return 0.0f;
+    }
+}
+
+//---------------------------------------------------------------------
+// conversions of channels
+//---------------------------------------------------------------------
+
+inline uint8_t floatToUnorm8(float f)
+{
+    return uint8_t(clamp(f, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+inline uint16_t floatToUnorm16(float f)
+{
+    return uint16_t(clamp(f, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+// the 256 linear values of sRGB bytes
+inline const float* getSrgbByteTable()
+{
+    struct Table
+    {
+        float values[256];
+        Table()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                values[i] = srgbToLinear((float)i / 255.0f);
+            }
+        }
+    };
+    static const Table table;
+    return table.values;
+}
+
+// linear value to the nearest sRGB byte, without pow
+inline uint8_t linearToSrgbByte(float f)
+{
+    // the linear values half way between 2 bytes
+    struct Table
+    {
+        float bounds[255];
+        Table()
+        {
+            for (int i = 0; i < 255; ++i)
+            {
+                bounds[i] = srgbToLinear(((float)i + 0.5f) / 255.0f);
+            }
+        }
+    };
+    static const Table table;
+    // the count of bounds below f, 8 steps
+    int byte = 0;
+    for (int step = 128; step > 0; step >>= 1)
+    {
+        if (byte + step <= 255 && table.bounds[byte + step - 1] <= f)
+        {
+            byte += step;
+        }
+    }
+    return (uint8_t)byte;
+}
+
+// round to nearest, greater values get infinity
+inline uint16_t floatToHalf(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000U);
+    uint32_t absBits = bits & 0x7fffffffU;
+    // infinity or NaN
+    if (absBits >= 0x7f800000U)
+    {
+        return sign | 0x7c00U | (absBits > 0x7f800000U ? 0x200U : 0U);
+    }
+    // 65520.0 and above round to infinity
+    if (absBits >= 0x477ff000U)
+    {
+        return sign | 0x7c00U;
+    }
+    // below 2^-14, denormal
+    if (absBits < 0x38800000U)
+    {
+        float a;
+        memcpy(&a, &absBits, sizeof(a));
+        return sign | (uint16_t)(a * 16777216.0f + 0.5f);
+    }
+    // rebias the exponent from 127 to 15, a carry of the rounding goes to the exponent
+    return sign | (uint16_t)((absBits - 0x38000000U + 0x1000U) >> 13);
+}
+
+inline float halfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000U) << 16;
+    uint32_t exponent = (h >> 10) & 31U;
+    uint32_t mantissa = h & 0x3ffU;
+    uint32_t bits;
+    if (exponent == 0)
+    {
+        float f = (float)mantissa / 16777216.0f;
+        return sign != 0 ? -f : f;
+    }
+    if (exponent == 31)
+    {
+        bits = sign | 0x7f800000U | (mantissa << 13);
+    }
+    else
+    {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// unsigned float of 5 exponent bits and mantissaBits (6 or 5) mantissa bits, negative values and NaN get 0
+inline uint32_t floatToSmallFloat(float f, int mantissaBits)
+{
+    if (!(f > 0.0f))
+    {
+        return 0;
+    }
+    int shift = 10 - mantissaBits;
+    uint32_t h = floatToHalf(f);
+    // infinity stays infinity
+    if (h >= 0x7c00U)
+    {
+        return 0x7c00U >> shift;
+    }
+    return (h + (1U << (shift - 1))) >> shift;
+}
+
+inline float smallFloatToFloat(uint32_t bits, int mantissaBits)
+{
+    return halfToFloat((uint16_t)(bits << (10 - mantissaBits)));
+}
+
+//---------------------------------------------------------------------
+// texels
+//---------------------------------------------------------------------
+
+// pack the first count channels of a texel, missing channels are 0, alpha is 1
+inline void packTexel(TexelFormat format, const float* channels, int count, uint8_t* dst)
+{
+    float c[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    for (int i = 0; i < count && i < 4; ++i)
+    {
+        c[i] = channels[i];
+    }
+    switch (format)
+    {
+    case TEXEL_FORMAT_RGBA8_UNORM:
+        dst[0] = floatToUnorm8(c[0]);
+        dst[1] = floatToUnorm8(c[1]);
+        dst[2] = floatToUnorm8(c[2]);
+        dst[3] = floatToUnorm8(c[3]);
+        break;
+    case TEXEL_FORMAT_RGBA8_SRGB:
+        dst[0] = linearToSrgbByte(c[0]);
+        dst[1] = linearToSrgbByte(c[1]);
+        dst[2] = linearToSrgbByte(c[2]);
+        dst[3] = floatToUnorm8(c[3]);
+        break;
+    case TEXEL_FORMAT_RGB16F:
+    {
+        uint16_t h[3] = { floatToHalf(c[0]), floatToHalf(c[1]), floatToHalf(c[2]) };
+        memcpy(dst, h, sizeof(h));
+        break;
+    }
+    case TEXEL_FORMAT_R11G11B10F:
+    {
+        uint32_t bits = floatToSmallFloat(c[0], 6) | (floatToSmallFloat(c[1], 6) << 11) | (floatToSmallFloat(c[2], 5) << 22);
+        memcpy(dst, &bits, sizeof(bits));
+        break;
+    }
+    case TEXEL_FORMAT_R16_UNORM:
+    {
+        uint16_t v = floatToUnorm16(c[0]);
+        memcpy(dst, &v, sizeof(v));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// unpack the first count channels of a texel
+inline void unpackTexel(TexelFormat format, const uint8_t* src, float* channels, int count)
+{
+    float c[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    switch (format)
+    {
+    case TEXEL_FORMAT_RGBA8_UNORM:
+        for (int i = 0; i < 4; ++i)
+        {
+            c[i] = (float)src[i] / 255.0f;
+        }
+        break;
+    case TEXEL_FORMAT_RGBA8_SRGB:
+    {
+        const float* table = getSrgbByteTable();
+        c[0] = table[src[0]];
+        c[1] = table[src[1]];
+        c[2] = table[src[2]];
+        c[3] = (float)src[3] / 255.0f;
+        break;
+    }
+    case TEXEL_FORMAT_RGB16F:
+    {
+        uint16_t h[3];
+        memcpy(h, src, sizeof(h));
+        c[0] = halfToFloat(h[0]);
+        c[1] = halfToFloat(h[1]);
+        c[2] = halfToFloat(h[2]);
+        break;
+    }
+    case TEXEL_FORMAT_R11G11B10F:
+    {
+        uint32_t bits;
+        memcpy(&bits, src, sizeof(bits));
+        c[0] = smallFloatToFloat(bits & 0x7ffU, 6);
+        c[1] = smallFloatToFloat((bits >> 11) & 0x7ffU, 6);
+        c[2] = smallFloatToFloat(bits >> 22, 5);
+        break;
+    }
+    case TEXEL_FORMAT_R16_UNORM:
+    {
+        uint16_t v;
+        memcpy(&v, src, sizeof(v));
+        c[0] = (float)v / 65535.0f;
+        break;
+    }
+    default:
+        break;
+    }
+    for (int i = 0; i < count && i < 4; ++i)
+    {
+        channels[i] = c[i];
+    }
+}
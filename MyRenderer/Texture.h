@@ -1,11 +1,164 @@
 #pragma once
 
+#include <atomic>
+#include "BlockCompression.h"
 #include "MathHelper.h"
+#include "SimdHelper.h"
+#include "TexelFormat.h"
+#include "ThreadPool.h"
 
 #undef max
 #undef min
 // the left top of the texture is point (0.0, 0.0)
 
+// how the texels of every mipmap level are ordered in the data of the texture
+enum TextureLayout
+{
+    // rows one after another, pitch is the width
+    TEXTURE_LAYOUT_LINEAR,
+    // rows one after another, pitch is padded to a multiple of TEXTURE_PITCH_ALIGNMENT texels
+    TEXTURE_LAYOUT_LINEAR_ALIGNED,
+    // 4x4 tiles one after another, texels in a tile are linear
+    TEXTURE_LAYOUT_TILED_4X4,
+    // 8x8 tiles one after another, texels in a tile are linear
+    TEXTURE_LAYOUT_TILED_8X8,
+    // Z order, bits of x and y interleaved
+    TEXTURE_LAYOUT_MORTON,
+};
+
+// 16 texels of 4, 8, 12 or 16 bytes are whole 64 byte cache lines
+constexpr int TEXTURE_PITCH_ALIGNMENT = 16;
+
+// where a mipmap level is in the data of the texture
+// in compressed textures offset is in bytes of the blocks and pitch is in blocks
+struct MipLevel
+{
+    size_t offset;
+    int width;
+    int height;
+    // texels from one row to the next in linear layouts, tiles from one row of tiles to the next in tiled layouts
+    int pitch;
+    // bits of x and y interleaved in TEXTURE_LAYOUT_MORTON, the higher bits of the longer edge follow them
+    int mortonBits;
+};
+
+// the filter reducing a mipmap level to the next one
+enum MipmapFilter
+{
+    // average of the texels covered, exactly 2x2 texels for even sizes
+    MIPMAP_FILTER_BOX,
+    // windowed sinc with 3 lobes, sharper than box
+    MIPMAP_FILTER_LANCZOS,
+};
+
+struct MipmapOptions
+{
+    MipmapFilter filter = MIPMAP_FILTER_BOX;
+    // the texels are sRGB encoded, filter them in linear space
+    // the first 3 floats of a texel are converted, the 4th (alpha) is not
+    bool srgb = false;
+    // rows of every level are split across the threads of the pool, null to run on the calling thread
+    ThreadPool* pThreadPool = nullptr;
+};
+
+// the source texels of every destination texel on one axis of a mipmap reduction
+// taps of texel i are [starts[i], starts[i + 1]) of indices and weights
+struct MipmapTaps
+{
+    std::vector<int> starts;
+    std::vector<int> indices;
+    std::vector<float> weights;
+};
+
+inline float lanczos3(float x)
+{
+    const float pi = 3.14159265f;
+    x = std::abs(x);
+    if (x < 1e-5f)
+    {
+        return 1.0f;
+    }
+    if (x >= 3.0f)
+    {
+        return 0.0f;
+    }
+    return 3.0f * std::sin(pi * x) * std::sin(pi * x / 3.0f) / (pi * pi * x * x);
+}
+
+// works for any sizes, including non-power-of-two ones
+inline MipmapTaps getMipmapTaps(int srcSize, int dstSize, MipmapFilter filter)
+{
+    MipmapTaps taps;
+    float scale = (float)srcSize / (float)dstSize;
+    for (int i = 0; i < dstSize; ++i)
+    {
+        taps.starts.push_back((int)taps.indices.size());
+        float sum = 0.0f;
+        if (filter == MIPMAP_FILTER_LANCZOS && srcSize > dstSize)
+        {
+            // the filter is stretched by the scale, samples out of the edges are clamped
+            float center = ((float)i + 0.5f) * scale;
+            int first = (int)std::floor(center - 3.0f * scale);
+            int last = (int)std::ceil(center + 3.0f * scale);
+            for (int j = first; j <= last; ++j)
+            {
+                float weight = lanczos3(((float)j + 0.5f - center) / scale);
+                if (weight != 0.0f)
+                {
+                    taps.indices.push_back(clamp(j, 0, srcSize - 1));
+                    taps.weights.push_back(weight);
+                    sum += weight;
+                }
+            }
+        }
+        else
+        {
+            // weight of a source texel is its length covered by [i * scale, (i + 1) * scale)
+            float start = (float)i * scale;
+            float end = (float)(i + 1) * scale;
+            for (int j = (int)start; j < srcSize && (float)j < end; ++j)
+            {
+                float weight = std::min(end, (float)(j + 1)) - std::max(start, (float)j);
+                if (weight > 0.0f)
+                {
+                    taps.indices.push_back(j);
+                    taps.weights.push_back(weight);
+                    sum += weight;
+                }
+            }
+        }
+        // weights add up to 1
+        for (int k = taps.starts.back(); k < (int)taps.weights.size(); ++k)
+        {
+            taps.weights[k] /= sum;
+        }
+    }
+    taps.starts.push_back((int)taps.indices.size());
+    return taps;
+}
+
+// spread the lower 16 bits of x to the even bits
+inline uint32_t mortonSpread(uint32_t x)
+{
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// decoded blocks kept by every thread, must be a power of 2
+// 64 blocks of 4x4 texels cover a 32x32 window of a level
+constexpr int TEXTURE_BLOCK_CACHE_SIZE = 64;
+
+// ids of compressed textures in the block caches, 0 is never used
+inline uint64_t nextTextureBlockCacheId()
+{
+    static std::atomic<uint64_t> id(0);
+    return ++id;
+}
+
 template <class T>
 class Texture2D
 {
@@ -14,18 +167,21 @@ public:
     Texture2D() : Texture2D(0, 0) {}
 
     // gen from buffer
-    Texture2D(size_t w, size_t h, const std::vector<T>& buffer, int maxMipmapLevel = 0)
-        : width(w), height(h)
+    // buffer holds the level0 texels row by row, whatever the layout is
+    Texture2D(size_t w, size_t h, const std::vector<T>& buffer, int maxMipmapLevel = 0, TextureLayout layout = TEXTURE_LAYOUT_LINEAR,
+        const MipmapOptions& mipmapOptions = MipmapOptions())
+        : width(w), height(h), layout(layout)
     {
         if (width == 0 || height == 0)
         {
             this->maxMipmapLevel = 0;
+            initMipLevels();
             return;
         }
         // get the max mipmap level possible
+        // levels are halved (rounding down) until 1x1
         int mmlp = 0;
-        data = buffer;
-        while (((width >> mmlp) & 1) == 0 && ((height >> mmlp) & 1) == 0)
+        while ((std::max(width, height) >> (mmlp + 1)) > 0)
         {
            mmlp++;
         }
@@ -33,10 +189,9 @@ public:
         if (maxMipmapLevel == 0)
         {
             this->maxMipmapLevel = 0;
-            return;
         }
         // gen mipmap level as max as possible
-        if (maxMipmapLevel < 0)
+        else if (maxMipmapLevel < 0)
         {
             this->maxMipmapLevel = mmlp;
         }
@@ -45,22 +200,32 @@ public:
             // gen mipmaps
             this->maxMipmapLevel = std::min(mmlp, maxMipmapLevel);
         }
-        data.resize(dataSizeOfMipmapLevel(maxMipmapLevel));
-        genMipmaps();
+        data.resize(initMipLevels());
+        // place the level0 texels by the layout
+        for (size_t y = 0; y < height; ++y)
+        {
+            for (size_t x = 0; x < width; ++x)
+            {
+                get((int)x, (int)y) = buffer[x + y * width];
+            }
+        }
+        genMipmaps(mipmapOptions);
     }
 
     // gen single color
-    Texture2D(size_t w, size_t h, T initColor = {}, int maxMipmapLevel = 0)
-        : width(w), height(h)
+    Texture2D(size_t w, size_t h, T initColor = {}, int maxMipmapLevel = 0, TextureLayout layout = TEXTURE_LAYOUT_LINEAR)
+        : width(w), height(h), layout(layout)
     {
         if (width == 0 || height == 0)
         {
             this->maxMipmapLevel = 0;
+            initMipLevels();
             return;
         }
         // get the max mipmap level possible
+        // levels are halved (rounding down) until 1x1
         int mmlp = 0;
-        while (((width >> mmlp) & 1) == 0 && ((height >> mmlp) & 1) == 0)
+        while ((std::max(width, height) >> (mmlp + 1)) > 0)
         {
            mmlp++;
         }
@@ -79,14 +244,15 @@ public:
         {
             this->maxMipmapLevel = std::min(mmlp, maxMipmapLevel);
         }
-        data = std::vector<T>(dataSizeOfMipmapLevel(this->maxMipmapLevel), initColor);
+        data = std::vector<T>(initMipLevels(), initColor);
     }
 
     Texture2D(const Texture2D& tex) = default;
 
     Texture2D(Texture2D&& tex) noexcept
-        : width(tex.width), height(tex.height),
-        data(std::move(tex.data)), maxMipmapLevel(tex.maxMipmapLevel) {}
+        : data(std::move(tex.data)), width(tex.width), height(tex.height),
+        maxMipmapLevel(tex.maxMipmapLevel), layout(tex.layout), format(tex.format), packed(std::move(tex.packed)), compression(tex.compression),
+        blocks(std::move(tex.blocks)), blockCacheId(tex.blockCacheId), mipLevels(std::move(tex.mipLevels)) {}
 
     Texture2D& operator= (const Texture2D& tex) = default;
 
@@ -96,6 +262,13 @@ public:
         this->height = tex.height;
         this->data = std::move(tex.data);
         this->maxMipmapLevel = tex.maxMipmapLevel;
+        this->layout = tex.layout;
+        this->format = tex.format;
+        this->packed = std::move(tex.packed);
+        this->compression = tex.compression;
+        this->blocks = std::move(tex.blocks);
+        this->blockCacheId = tex.blockCacheId;
+        this->mipLevels = std::move(tex.mipLevels);
         return *this;
     }
 
@@ -104,64 +277,188 @@ public:
     // this function only outputs the level0 texture
     void toBitmap(uint8_t* pDest) const
     {
-        float* fs = (float*)data.data();
         int fcount = sizeof(T) / sizeof(float);
         int pix_count = width * height;
         for (int i = 0; i < pix_count; ++i)
         {
+            T texel = fetch(i % width, i / width, mipLevels[0]);
+            const float* fs = (const float*)&texel;
             for (int j = 0; j < fcount; ++j)
             {
-                pDest[i * fcount + j] = floatToByte(fs[i * fcount + fcount - j - 1]);
+                pDest[i * fcount + j] = floatToByte(fs[fcount - j - 1]);
             }
         }
     }
 
-protected:
-    void genMipmaps()
+public:
+    // rebuild levels 1 to maxMipmapLevel from level0
+    void genMipmaps(const MipmapOptions& options)
     {
-        int lastMipStart = 0;
-        int mipStart = width * height;
-        T result;
-        for(int mip = 1; mip <= maxMipmapLevel; ++mip)
+        const int floatCount = sizeof(T) / sizeof(float);
+        // texels of the level being reduced, floats row by row, in the space filtered in
+        std::vector<float> src((size_t)width * height * floatCount);
+        for (size_t y = 0; y < height; ++y)
+        {
+            for (size_t x = 0; x < width; ++x)
+            {
+                const float* f = (const float*)&get((int)x, (int)y);
+                for (int c = 0; c < floatCount; ++c)
+                {
+                    src[(x + y * width) * floatCount + c] = options.srgb && c < 3 ? srgbToLinear(f[c]) : f[c];
+                }
+            }
+        }
+        std::vector<float> dst;
+        for (int mip = 1; mip <= (int)maxMipmapLevel; ++mip)
         {
-            int mipWidth = width >> (mip * 2);
-            int mipHeight = height >> (mip * 2);
-            for(int y = 0; y < mipHeight; ++y)
+            const MipLevel& srcLevel = mipLevels[mip - 1];
+            const MipLevel& dstLevel = mipLevels[mip];
+            MipmapTaps tapsX = getMipmapTaps(srcLevel.width, dstLevel.width, options.filter);
+            MipmapTaps tapsY = getMipmapTaps(srcLevel.height, dstLevel.height, options.filter);
+            const int srcRowSize = srcLevel.width * floatCount;
+            dst.assign((size_t)dstLevel.width * dstLevel.height * floatCount, 0.0f);
+            // every job reduces a band of rows
+            const int rowsPerJob = 16;
+            auto job = [&](int band)
+            {
+                std::vector<float> row(srcRowSize);
+                int yEnd = std::min((band + 1) * rowsPerJob, dstLevel.height);
+                for (int y = band * rowsPerJob; y < yEnd; ++y)
+                {
+                    // vertical pass, blend the source rows to one row
+                    std::fill(row.begin(), row.end(), 0.0f);
+                    for (int k = tapsY.starts[y]; k < tapsY.starts[y + 1]; ++k)
+                    {
+                        simdAxpy(tapsY.weights[k], &src[(size_t)tapsY.indices[k] * srcRowSize], row.data(), srcRowSize);
+                    }
+                    // horizontal pass, then store the texels by the layout
+                    float* dstRow = &dst[(size_t)y * dstLevel.width * floatCount];
+                    for (int x = 0; x < dstLevel.width; ++x)
+                    {
+                        float* out = dstRow + x * floatCount;
+                        for (int k = tapsX.starts[x]; k < tapsX.starts[x + 1]; ++k)
+                        {
+                            const float* in = &row[tapsX.indices[k] * floatCount];
+                            for (int c = 0; c < floatCount; ++c)
+                            {
+                                out[c] += tapsX.weights[k] * in[c];
+                            }
+                        }
+                        T texel;
+                        float* f = (float*)&texel;
+                        for (int c = 0; c < floatCount; ++c)
+                        {
+                            f[c] = options.srgb && c < 3 ? linearToSrgb(clamp(out[c], 0.0f, 1.0f)) : out[c];
+                        }
+                        data[texelIndex(x, y, dstLevel)] = texel;
+                    }
+                }
+            };
+            int bandCount = (dstLevel.height + rowsPerJob - 1) / rowsPerJob;
+            if (options.pThreadPool != nullptr)
+            {
+                options.pThreadPool->parallelFor(bandCount, job);
+            }
+            else
             {
-                for(int x = 0; x < mipWidth; ++x)
+                for (int band = 0; band < bandCount; ++band)
                 {
-                    result += data[lastMipStart + x * 2 + 0 + (y * 2 + 0) * mipHeight * 2];
-                    result += data[lastMipStart + x * 2 + 0 + (y * 2 + 1) * mipHeight * 2];
-                    result += data[lastMipStart + x * 2 + 1 + (y * 2 + 0) * mipHeight * 2];
-                    result += data[lastMipStart + x * 2 + 1 + (y * 2 + 1) * mipHeight * 2];
-                    data[mipStart + x + y * mipHeight] = result / 4.0f;
+                    job(band);
                 }
             }
-            lastMipStart = mipStart;
-            mipStart += (width * height) >> (mip * 2);
+            src.swap(dst);
         }
     }
 
-    int dataSizeOfMipmapLevel(int m)
+protected:
+    // fill the table of mipmap levels, returns the size of data of all levels
+    size_t initMipLevels()
     {
-        int size = width * height;
-        while (m--)
+        mipLevels.resize(maxMipmapLevel + 1);
+        size_t offset = 0;
+        for (size_t m = 0; m <= maxMipmapLevel; ++m)
         {
-            size += (width * height) >> 2;
+            MipLevel& level = mipLevels[m];
+            level.offset = offset;
+            level.width = std::max((int)(width >> m), 1);
+            level.height = std::max((int)(height >> m), 1);
+            level.pitch = level.width;
+            level.mortonBits = 0;
+            size_t size = 0;
+            switch (layout)
+            {
+            case TEXTURE_LAYOUT_LINEAR:
+                size = (size_t)level.width * level.height;
+                break;
+            case TEXTURE_LAYOUT_LINEAR_ALIGNED:
+                level.pitch = (level.width + TEXTURE_PITCH_ALIGNMENT - 1) / TEXTURE_PITCH_ALIGNMENT * TEXTURE_PITCH_ALIGNMENT;
+                size = (size_t)level.pitch * level.height;
+                break;
+            case TEXTURE_LAYOUT_TILED_4X4:
+                level.pitch = (level.width + 3) / 4;
+                size = (size_t)level.pitch * ((level.height + 3) / 4) * 16;
+                break;
+            case TEXTURE_LAYOUT_TILED_8X8:
+                level.pitch = (level.width + 7) / 8;
+                size = (size_t)level.pitch * ((level.height + 7) / 8) * 64;
+                break;
+            case TEXTURE_LAYOUT_MORTON:
+            {
+                // both edges are padded to powers of 2
+                int xBits = 0;
+                int yBits = 0;
+                while ((1 << xBits) < level.width)
+                {
+                    ++xBits;
+                }
+                while ((1 << yBits) < level.height)
+                {
+                    ++yBits;
+                }
+                level.mortonBits = std::min(xBits, yBits);
+                size = (size_t)1 << (xBits + yBits);
+                break;
+            }
+            }
+            // every level starts at a multiple of the alignment
+            offset += (size + TEXTURE_PITCH_ALIGNMENT - 1) / TEXTURE_PITCH_ALIGNMENT * TEXTURE_PITCH_ALIGNMENT;
         }
-        return size;
+        return offset;
     }
 
 public:
+    // index in data of texel (x, y) of the level
+    inline size_t texelIndex(int x, int y, const MipLevel& level) const
+    {
+        switch (layout)
+        {
+        case TEXTURE_LAYOUT_TILED_4X4:
+            return level.offset + ((size_t)(x >> 2) + (size_t)(y >> 2) * level.pitch) * 16 + (x & 3) + (y & 3) * 4;
+        case TEXTURE_LAYOUT_TILED_8X8:
+            return level.offset + ((size_t)(x >> 3) + (size_t)(y >> 3) * level.pitch) * 64 + (x & 7) + (y & 7) * 8;
+        case TEXTURE_LAYOUT_MORTON:
+        {
+            // one of x and y has no bits higher than mortonBits
+            uint32_t low = (1U << level.mortonBits) - 1U;
+            uint32_t high = ((uint32_t)x >> level.mortonBits) | ((uint32_t)y >> level.mortonBits);
+            return level.offset + ((size_t)high << (level.mortonBits * 2)) + (mortonSpread(x & low) | (mortonSpread(y & low) << 1));
+        }
+        default:
+            return level.offset + x + (size_t)y * level.pitch;
+        }
+    }
+
     // get from level0 mipmap (x, y)
     T& get(int x, int y)
     {
-        return data[x + y * height];
+        assert(format == TEXEL_FORMAT_FLOAT && compression == TEXTURE_COMPRESSION_NONE);
+        return data[texelIndex(x, y, mipLevels[0])];
     }
 
     const T& get(int x, int y) const
     {
-        return data[x + y * height];
+        assert(format == TEXEL_FORMAT_FLOAT && compression == TEXTURE_COMPRESSION_NONE);
+        return data[texelIndex(x, y, mipLevels[0])];
     }
 
     // mipmapped get(x, y, m)
@@ -175,22 +472,193 @@ public:
         return data[indexMipmapped(x, y, m)];
     }
 
-    inline int indexMipmapped(int x, int y, int mipmapLevel)
+    inline size_t indexMipmapped(int x, int y, int mipmapLevel) const
+    {
+        return texelIndex(x, y, mipLevels[mipmapLevel]);
+    }
+
+    const MipLevel& getMipLevel(int mipmapLevel) const { return mipLevels[mipmapLevel]; }
+
+    // texel (x, y) of the level, decodes the block of compressed textures
+    inline T fetch(int x, int y, const MipLevel& level) const
+    {
+        if (compression == TEXTURE_COMPRESSION_NONE)
+        {
+            return load(texelIndex(x, y, level));
+        }
+        return fetchCompressed(x, y, level);
+    }
+
+    // texel at index of data, converted from the format, not for compressed textures
+    inline T load(size_t index) const
+    {
+        if (format == TEXEL_FORMAT_FLOAT)
+        {
+            return data[index];
+        }
+        T texel;
+        unpackTexel(format, &packed[index * getTexelBytes(format)], (float*)&texel, sizeof(T) / sizeof(float));
+        return texel;
+    }
+
+    // set texel at index of data, converted to the format, not for compressed textures
+    inline void store(size_t index, const T& texel)
+    {
+        if (format == TEXEL_FORMAT_FLOAT)
+        {
+            data[index] = texel;
+            return;
+        }
+        packTexel(format, (const float*)&texel, sizeof(T) / sizeof(float), &packed[index * getTexelBytes(format)]);
+    }
+
+    // convert the texels of all levels to the format and free data, get() and getMipmapped() can't be used after
+    void pack(TexelFormat newFormat)
+    {
+        assert(format == TEXEL_FORMAT_FLOAT && compression == TEXTURE_COMPRESSION_NONE);
+        if (newFormat == TEXEL_FORMAT_FLOAT)
+        {
+            return;
+        }
+        const size_t texelBytes = getTexelBytes(newFormat);
+        packed.resize(data.size() * texelBytes);
+        for (size_t i = 0; i < data.size(); ++i)
+        {
+            packTexel(newFormat, (const float*)&data[i], sizeof(T) / sizeof(float), &packed[i * texelBytes]);
+        }
+        format = newFormat;
+        std::vector<T>().swap(data);
+    }
+
+    // encode all levels to blocks and free the texels, data, get() and getMipmapped() can't be used after
+    // the layout is ignored, blocks are already 4x4 tiles, stored row by row
+    void compress(TextureCompression newCompression)
     {
-        int h = height >> (mipmapLevel * 2);
-        int st = 0;
-        for(int m = 0; m < mipmapLevel; ++m)
+        assert(compression == TEXTURE_COMPRESSION_NONE);
+        if (newCompression == TEXTURE_COMPRESSION_NONE)
         {
-            st += (width * height) >> (m * 2);
+            return;
+        }
+        const int floatCount = sizeof(T) / sizeof(float);
+        const int channelCount = std::min(floatCount, getBlockChannels(newCompression));
+        const size_t blockBytes = getBlockBytes(newCompression);
+        std::vector<MipLevel> blockLevels(mipLevels.size());
+        size_t offset = 0;
+        for (size_t m = 0; m < mipLevels.size(); ++m)
+        {
+            MipLevel& level = blockLevels[m];
+            level = mipLevels[m];
+            level.offset = offset;
+            level.pitch = (level.width + BLOCK_COMPRESSION_BLOCK_SIZE - 1) / BLOCK_COMPRESSION_BLOCK_SIZE;
+            level.mortonBits = 0;
+            offset += (size_t)level.pitch * ((level.height + BLOCK_COMPRESSION_BLOCK_SIZE - 1) / BLOCK_COMPRESSION_BLOCK_SIZE) * blockBytes;
+        }
+        blocks.assign(offset, 0);
+        float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS];
+        for (size_t m = 0; m < mipLevels.size(); ++m)
+        {
+            const MipLevel& level = mipLevels[m];
+            const MipLevel& blockLevel = blockLevels[m];
+            int rows = (level.height + BLOCK_COMPRESSION_BLOCK_SIZE - 1) / BLOCK_COMPRESSION_BLOCK_SIZE;
+            for (int by = 0; by < rows; ++by)
+            {
+                for (int bx = 0; bx < blockLevel.pitch; ++bx)
+                {
+                    for (int i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+                    {
+                        // blocks over the edges repeat the last texels
+                        int x = std::min(bx * BLOCK_COMPRESSION_BLOCK_SIZE + i % BLOCK_COMPRESSION_BLOCK_SIZE, level.width - 1);
+                        int y = std::min(by * BLOCK_COMPRESSION_BLOCK_SIZE + i / BLOCK_COMPRESSION_BLOCK_SIZE, level.height - 1);
+                        T texel = load(texelIndex(x, y, level));
+                        const float* f = (const float*)&texel;
+                        for (int c = 0; c < BLOCK_COMPRESSION_MAX_CHANNELS; ++c)
+                        {
+                            texels[i][c] = c < channelCount ? f[c] : 0.0f;
+                        }
+                    }
+                    encodeBlock(newCompression, texels, &blocks[blockLevel.offset + ((size_t)bx + (size_t)by * blockLevel.pitch) * blockBytes]);
+                }
+            }
+        }
+        mipLevels = std::move(blockLevels);
+        compression = newCompression;
+        blockCacheId = nextTextureBlockCacheId();
+        std::vector<T>().swap(data);
+        std::vector<uint8_t>().swap(packed);
+    }
+
+protected:
+    T fetchCompressed(int x, int y, const MipLevel& level) const
+    {
+        // direct mapped, a slot is picked by the low bits of the block coordinates
+        // so all blocks of a 32x32 window are cached together
+        // trivial, so the cache is zero filled without a constructor guarding every access
+        struct CachedBlock
+        {
+            uint64_t textureId;
+            size_t offset;
+            float texels[BLOCK_COMPRESSION_TEXEL_COUNT][sizeof(T) / sizeof(float)];
+        };
+        static thread_local CachedBlock cache[TEXTURE_BLOCK_CACHE_SIZE];
+
+        const int floatCount = sizeof(T) / sizeof(float);
+        const size_t blockBytes = getBlockBytes(compression);
+        int bx = x / BLOCK_COMPRESSION_BLOCK_SIZE;
+        int by = y / BLOCK_COMPRESSION_BLOCK_SIZE;
+        size_t offset = level.offset + ((size_t)bx + (size_t)by * level.pitch) * blockBytes;
+        size_t slot = (((size_t)bx & 7) | (((size_t)by & 7) << 3)) ^ (size_t)(blockCacheId * 7 + level.offset);
+        CachedBlock& cached = cache[slot & (TEXTURE_BLOCK_CACHE_SIZE - 1)];
+        if (cached.textureId != blockCacheId || cached.offset != offset)
+        {
+            float texels[BLOCK_COMPRESSION_TEXEL_COUNT][BLOCK_COMPRESSION_MAX_CHANNELS];
+            decodeBlock(compression, &blocks[offset], texels);
+            for (int i = 0; i < BLOCK_COMPRESSION_TEXEL_COUNT; ++i)
+            {
+                for (int c = 0; c < floatCount; ++c)
+                {
+                    cached.texels[i][c] = c < BLOCK_COMPRESSION_MAX_CHANNELS ? texels[i][c] : 0.0f;
+                }
+            }
+            cached.textureId = blockCacheId;
+            cached.offset = offset;
+        }
+        const float* in = cached.texels[(x % BLOCK_COMPRESSION_BLOCK_SIZE) + (y % BLOCK_COMPRESSION_BLOCK_SIZE) * BLOCK_COMPRESSION_BLOCK_SIZE];
+        T texel;
+        float* f = (float*)&texel;
+        for (int c = 0; c < floatCount; ++c)
+        {
+            f[c] = in[c];
         }
-        return st + x + y * h;
+        return texel;
     }
 
+public:
+
     void clear(T value)
     {
-        for(auto& v : data)
+        const size_t texelBytes = getTexelBytes(format);
+        fill(0, texelBytes > 0 ? packed.size() / texelBytes : data.size(), value);
+    }
+
+    // set count texels from index begin of data, not for compressed textures
+    void fill(size_t begin, size_t count, T value)
+    {
+        if (count == 0)
         {
-            v = value;
+            return;
+        }
+        if (format == TEXEL_FORMAT_FLOAT)
+        {
+            std::fill(data.begin() + begin, data.begin() + begin + count, value);
+            return;
+        }
+        // pack once and repeat the bytes
+        const size_t texelBytes = getTexelBytes(format);
+        uint8_t* dst = &packed[begin * texelBytes];
+        packTexel(format, (const float*)&value, sizeof(T) / sizeof(float), dst);
+        for (size_t i = 1; i < count; ++i)
+        {
+            memcpy(dst + i * texelBytes, dst, texelBytes);
         }
     }
 
@@ -201,6 +669,20 @@ public:
     size_t height;
     // max mipmap level
     size_t maxMipmapLevel;
+    // the layout of all levels, chosen at creation
+    TextureLayout layout;
+    // the texels are in packed instead of data after pack()
+    TexelFormat format = TEXEL_FORMAT_FLOAT;
+    std::vector<uint8_t> packed;
+    // the texels are in blocks instead of data after compress()
+    TextureCompression compression = TEXTURE_COMPRESSION_NONE;
+    std::vector<uint8_t> blocks;
+    // names the blocks in the block caches, copies share it as their blocks are the same
+    uint64_t blockCacheId = 0;
+
+protected:
+    // offset and size of every mipmap level, from level 0 to maxMipmapLevel
+    std::vector<MipLevel> mipLevels;
 };
 
 using Texture2D3F = Texture2D<Vec3f>;
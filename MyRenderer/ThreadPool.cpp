@@ -0,0 +1,92 @@
+#include <algorithm>
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int threadCount)
+    : nextJob(0)
+{
+    if (threadCount <= 0)
+    {
+        threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    // the calling thread of parallelFor is one of the threads
+    for (int i = 0; i < threadCount - 1; ++i)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& job)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+    // not worth waking up the workers
+    if (count == 1 || workers.empty())
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            job(i);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pJob = &job;
+        jobCount = count;
+        nextJob.store(0);
+        busyWorkers = (int)workers.size();
+        ++generation;
+    }
+    wakeCondition.notify_all();
+    runJobs();
+    // wait for the workers, the job must stay alive until they are done
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this] { return busyWorkers == 0; });
+    pJob = nullptr;
+}
+
+void ThreadPool::workerLoop()
+{
+    unsigned lastGeneration = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeCondition.wait(lock, [&] { return stopping || generation != lastGeneration; });
+            if (stopping)
+            {
+                return;
+            }
+            lastGeneration = generation;
+        }
+        runJobs();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --busyWorkers;
+        }
+        doneCondition.notify_one();
+    }
+}
+
+void ThreadPool::runJobs()
+{
+    int i;
+    while ((i = nextJob.fetch_add(1)) < jobCount)
+    {
+        (*pJob)(i);
+    }
+}
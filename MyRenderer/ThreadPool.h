@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* class ThreadPool
+* a fixed set of worker threads running parallel loops
+* usage :
+* 1. create the pool once, thread count 0 means one thread per hardware thread
+* 2. call parallelFor, it returns after all the jobs are done
+*/
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threadCount = 0);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator= (const ThreadPool&) = delete;
+
+    // run job(i) for every i in [0, count), the calling thread runs jobs too
+    // jobs are taken in increasing order of i, but may finish in any order
+    void parallelFor(int count, const std::function<void(int)>& job);
+
+    // count of threads running jobs, including the calling thread
+    int getThreadCount() const { return (int)workers.size() + 1; }
+
+protected:
+    void workerLoop();
+
+    void runJobs();
+
+protected:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    std::condition_variable doneCondition;
+
+    // the loop being run, only changed when no worker is running it
+    const std::function<void(int)>* pJob = nullptr;
+    int jobCount = 0;
+    std::atomic<int> nextJob;
+    // count of workers which have not finished the current loop
+    int busyWorkers = 0;
+    // increased by every parallelFor, wakes up the workers
+    unsigned generation = 0;
+    bool stopping = false;
+};
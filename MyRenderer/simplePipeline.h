@@ -1,50 +1,212 @@
 #pragma once
 
 #include "Pipeline.h"
+#include "Scene.h"
 
 constexpr int SC_COLOR = 5;
+// per instance values, scale xy and offset zw of the positions, and a tint of the colors
+constexpr int SC_INSTANCE_TRANSFORM = 6;
+constexpr int SC_INSTANCE_TINT = 7;
 
 constexpr int screenWidth = 100;
 constexpr int screenHeight = 100;
 constexpr int screenScale = 8;
 
+VaryingLayout sim_inputLayout = { { SV_Position, VARYING_TYPE_VEC4F }, { SC_COLOR, VARYING_TYPE_VEC3F } };
+
 std::vector<ShaderContext> sim_vertices;
 
 std::vector<int> sim_indecies;
 
-ShaderUniform uniforms;
+VaryingLayout sim_instanceLayout = { { SC_INSTANCE_TRANSFORM, VARYING_TYPE_VEC4F }, { SC_INSTANCE_TINT, VARYING_TYPE_VEC3F } };
+
+std::vector<ShaderContext> sim_instances;
+
+// built by the gen functions, then bound to the draws without copying
+std::shared_ptr<ShaderUniform> uniforms = std::make_shared<ShaderUniform>();
 
 PipelineState sim_pipelineState;
 
 Pipeline simPipeline;
 
-uint8_t bitData[screenWidth * screenHeight * 3 * sizeof(uint8_t)];
 uint8_t screenData[screenWidth * screenHeight * 3 * screenScale * screenScale * sizeof(uint8_t)];
 
 
 
 class SimpleVS : public VertexShader
 {
+public:
+    SimpleVS()
+    {
+        outputLayout.add(SV_Position, VARYING_TYPE_VEC4F);
+        outputLayout.add(SC_COLOR, VARYING_TYPE_VEC3F);
+    }
+
 protected:
-    virtual void excute(ShaderContext& input, ShaderContext& output, ShaderUniform& uniform) override
+    virtual void excute(ShaderContext& input, ShaderContext& output, const ShaderUniform&) override
     {
-        output.v4f[SV_Position] = input.v4f[SV_Position];
-        output.v3f[SC_COLOR] = input.v3f[SC_COLOR];
+        output.v4f(SV_Position) = input.v4f(SV_Position);
+        output.v3f(SC_COLOR) = input.v3f(SC_COLOR);
+    }
+
+    virtual void excuteBatch(const ShaderBatch& input, ShaderBatch& output, const ShaderUniform&) override
+    {
+        // every stream of the batch is copied at once
+        std::copy_n(input.stream(SV_Position, VARYING_TYPE_VEC4F), 4 * SHADER_BATCH_SIZE, output.stream(SV_Position, VARYING_TYPE_VEC4F));
+        std::copy_n(input.stream(SC_COLOR, VARYING_TYPE_VEC3F), 3 * SHADER_BATCH_SIZE, output.stream(SC_COLOR, VARYING_TYPE_VEC3F));
     }
 };
 
 class SimplePS : public PixelShader
 {
 protected:
-    virtual Vec4f excute(const ShaderContext& input, const ShaderUniform& uniform) override
+    virtual Vec4f excute(const ShaderContext& input, const ShaderUniform&) override
     {
-        return Vec4f(input.v3f.at(SC_COLOR), 1.0f);
+        return Vec4f(input.v3f(SC_COLOR), 1.0f);
     }
 };
 
 SimpleVS sim_vs;
 SimplePS sim_ps;
 
+// SimpleVS for instanced draws of sim_instances, every instance moves and tints the vertices
+class InstancedVS : public VertexShader
+{
+public:
+    InstancedVS()
+    {
+        outputLayout.add(SV_Position, VARYING_TYPE_VEC4F);
+        outputLayout.add(SC_COLOR, VARYING_TYPE_VEC3F);
+    }
+
+protected:
+    virtual void excute(ShaderContext& input, ShaderContext& output, const ShaderUniform&) override
+    {
+        const Vec4f& transform = input.v4f(SC_INSTANCE_TRANSFORM);
+        const Vec4f& position = input.v4f(SV_Position);
+        output.v4f(SV_Position) = { position.x * transform.x + transform.z, position.y * transform.y + transform.w, position.z, position.w };
+        output.v3f(SC_COLOR) = input.v3f(SC_COLOR) * input.v3f(SC_INSTANCE_TINT);
+    }
+};
+
+InstancedVS sim_instancedVS;
+
+VaryingLayout sim_texturedLayout = { { SV_Position, VARYING_TYPE_VEC4F }, { SV_uv, VARYING_TYPE_VEC2F } };
+
+class TexturedVS : public VertexShader
+{
+public:
+    TexturedVS()
+    {
+        outputLayout.add(SV_Position, VARYING_TYPE_VEC4F);
+        outputLayout.add(SV_uv, VARYING_TYPE_VEC2F);
+    }
+
+protected:
+    virtual void excute(ShaderContext& input, ShaderContext& output, const ShaderUniform&) override
+    {
+        output.v4f(SV_Position) = input.v4f(SV_Position);
+        output.v2f(SV_uv) = input.v2f(SV_uv);
+    }
+
+    virtual void excuteBatch(const ShaderBatch& input, ShaderBatch& output, const ShaderUniform&) override
+    {
+        std::copy_n(input.stream(SV_Position, VARYING_TYPE_VEC4F), 4 * SHADER_BATCH_SIZE, output.stream(SV_Position, VARYING_TYPE_VEC4F));
+        std::copy_n(input.stream(SV_uv, VARYING_TYPE_VEC2F), 2 * SHADER_BATCH_SIZE, output.stream(SV_uv, VARYING_TYPE_VEC2F));
+    }
+};
+
+// samples uniform texture 0 with sampler 0
+class TexturedPS : public PixelShader
+{
+protected:
+    virtual Vec4f excute(const ShaderContext& input, const ShaderUniform& uniform) override
+    {
+        return Vec4f(sample(uniform.sampler2D3F.at(0), *uniform.textures[0], input.v2f(SV_uv)), 1.0f);
+    }
+
+    virtual void excuteQuad(const ShaderContext input[4], uint32_t, Vec4f output[4], const ShaderUniform& uniform) override
+    {
+        Vec2f uv[4] = { input[0].v2f(SV_uv), input[1].v2f(SV_uv), input[2].v2f(SV_uv), input[3].v2f(SV_uv) };
+        Vec3f colors[4];
+        sampleQuad(uniform.sampler2D3F.at(0), *uniform.textures[0], uv, colors);
+        for (int j = 0; j < 4; ++j)
+        {
+            output[j] = Vec4f(colors[j], 1.0f);
+        }
+    }
+};
+
+TexturedVS sim_texturedVS;
+TexturedPS sim_texturedPS;
+
+// transforms SV_Position by the draw transform, row vectors as matrix_set_lookat() and matrix_set_perspective()
+class MeshVS : public VertexShader
+{
+public:
+    MeshVS()
+    {
+        outputLayout.add(SV_Position, VARYING_TYPE_VEC4F);
+        outputLayout.add(SV_normal, VARYING_TYPE_VEC3F);
+    }
+
+protected:
+    virtual void excute(ShaderContext& input, ShaderContext& output, const ShaderUniform&) override
+    {
+        output.v4f(SV_Position) = simdMul(input.v4f(SV_Position), getDrawTransform());
+        // meshes without normals are lit as facing the light
+        output.v3f(SV_normal) = input.layout->has(SV_normal) ? input.v3f(SV_normal) : Vec3f(0.0f, 0.0f, -1.0f);
+    }
+
+    virtual void excuteBatch(const ShaderBatch& input, ShaderBatch& output, const ShaderUniform&) override
+    {
+        // the positions of all lanes are transformed at once, the same as excute() does one by one
+        simdTransformLanes(input.stream(SV_Position, VARYING_TYPE_VEC4F), getDrawTransform(), true,
+            output.stream(SV_Position, VARYING_TYPE_VEC4F), SHADER_BATCH_SIZE);
+        float* normal = output.stream(SV_normal, VARYING_TYPE_VEC3F);
+        if (input.layout->has(SV_normal))
+        {
+            std::copy_n(input.stream(SV_normal, VARYING_TYPE_VEC3F), 3 * SHADER_BATCH_SIZE, normal);
+        }
+        else
+        {
+            std::fill_n(normal, 2 * SHADER_BATCH_SIZE, 0.0f);
+            std::fill_n(normal + 2 * SHADER_BATCH_SIZE, SHADER_BATCH_SIZE, -1.0f);
+        }
+    }
+};
+
+// a white directional light from the camera, and some ambient
+class MeshPS : public PixelShader
+{
+protected:
+    virtual Vec4f excute(const ShaderContext& input, const ShaderUniform&) override
+    {
+        const Vec3f& normal = input.v3f(SV_normal);
+        float length = Vector_length(normal);
+        float diffuse = length > 0.0f ? std::max(-normal.z / length, 0.0f) : 0.0f;
+        float light = 0.2f + 0.8f * diffuse;
+        return Vec4f(light, light, light, 1.0f);
+    }
+};
+
+MeshVS sim_meshVS;
+MeshPS sim_meshPS;
+
+Mesh sim_mesh;
+
+// view * projection of the single sim_mesh, bound as the draw transform
+Mat4x4f sim_meshTransform = matrix_set_identity();
+
+// the field of copies of sim_mesh, node 0 is the root, node i + 1 is copy i
+Scene sim_scene;
+std::vector<Mat4x4f> sim_fieldTransforms;
+// copies made a wall of occluders, they don't move
+std::vector<uint8_t> sim_fieldOccluders;
+float sim_fieldSpacing = 1.0f;
+Mat4x4f sim_view;
+Mat4x4f sim_projection;
+
 void setMSAAState(int count)
 {
     switch (count)
@@ -75,30 +237,189 @@ void setMSAAState(int count)
 
 void genColorredQuad()
 {
-    sim_vertices.resize(4);
-    sim_vertices[0].v4f[SV_Position] = { -0.5f, -0.5f, 0.0f, 1.0f };
-    sim_vertices[1].v4f[SV_Position] = { -0.5f, 0.5f, 0.0f, 1.0f };
-    sim_vertices[2].v4f[SV_Position] = { 0.5f, -0.5f, 0.0f, 1.0f };
-    sim_vertices[3].v4f[SV_Position] = { 0.5f, 0.5f, 0.0f, 1.0f };
-    sim_vertices[0].v3f[SC_COLOR] = { 1.0f, 0.0f, 0.0f };
-    sim_vertices[1].v3f[SC_COLOR] = { 0.0f, 1.0f, 0.0f };
-    sim_vertices[2].v3f[SC_COLOR] = { 0.0f, 0.0f, 1.0f };
-    sim_vertices[3].v3f[SC_COLOR] = { 1.0f, 1.0f, 1.0f };
+    sim_vertices.assign(4, ShaderContext(&sim_inputLayout));
+    sim_vertices[0].v4f(SV_Position) = { -0.5f, -0.5f, 0.0f, 1.0f };
+    sim_vertices[1].v4f(SV_Position) = { -0.5f, 0.5f, 0.0f, 1.0f };
+    sim_vertices[2].v4f(SV_Position) = { 0.5f, -0.5f, 0.0f, 1.0f };
+    sim_vertices[3].v4f(SV_Position) = { 0.5f, 0.5f, 0.0f, 1.0f };
+    sim_vertices[0].v3f(SC_COLOR) = { 1.0f, 0.0f, 0.0f };
+    sim_vertices[1].v3f(SC_COLOR) = { 0.0f, 1.0f, 0.0f };
+    sim_vertices[2].v3f(SC_COLOR) = { 0.0f, 0.0f, 1.0f };
+    sim_vertices[3].v3f(SC_COLOR) = { 1.0f, 1.0f, 1.0f };
     sim_indecies = { 0, 2, 1, 1, 2, 3 };
 }
 
 void genColorredTriangle()
 {
-    sim_vertices.resize(3);
-    sim_vertices[0].v4f[SV_Position] = { -0.5f, -0.5f, 0.0f, 1.0f };
-    sim_vertices[1].v4f[SV_Position] = { 0.0f, 0.5f, 0.0f, 1.0f };
-    sim_vertices[2].v4f[SV_Position] = { 0.5f, -0.5f, 0.0f, 1.0f };
-    sim_vertices[0].v3f[SC_COLOR] = { 1.0f, 0.0f, 0.0f };
-    sim_vertices[1].v3f[SC_COLOR] = { 0.0f, 1.0f, 0.0f };
-    sim_vertices[2].v3f[SC_COLOR] = { 0.0f, 0.0f, 1.0f };
+    sim_vertices.assign(3, ShaderContext(&sim_inputLayout));
+    sim_vertices[0].v4f(SV_Position) = { -0.5f, -0.5f, 0.0f, 1.0f };
+    sim_vertices[1].v4f(SV_Position) = { 0.0f, 0.5f, 0.0f, 1.0f };
+    sim_vertices[2].v4f(SV_Position) = { 0.5f, -0.5f, 0.0f, 1.0f };
+    sim_vertices[0].v3f(SC_COLOR) = { 1.0f, 0.0f, 0.0f };
+    sim_vertices[1].v3f(SC_COLOR) = { 0.0f, 1.0f, 0.0f };
+    sim_vertices[2].v3f(SC_COLOR) = { 0.0f, 0.0f, 1.0f };
     sim_indecies = { 0, 2, 1 };
 }
 
+// n x n colorred quads covering the whole NDC plane, 2 * n * n triangles
+void genColorredGrid(int n)
+{
+    sim_vertices.assign((n + 1) * (n + 1), ShaderContext(&sim_inputLayout));
+    for (int y = 0; y <= n; ++y)
+    {
+        for (int x = 0; x <= n; ++x)
+        {
+            float fx = (float)x / (float)n;
+            float fy = (float)y / (float)n;
+            sim_vertices[x + y * (n + 1)].v4f(SV_Position) = { fx * 2.0f - 1.0f, fy * 2.0f - 1.0f, 0.0f, 1.0f };
+            sim_vertices[x + y * (n + 1)].v3f(SC_COLOR) = { fx, fy, 1.0f - fx };
+        }
+    }
+    sim_indecies.clear();
+    sim_indecies.reserve(n * n * 6);
+    for (int y = 0; y < n; ++y)
+    {
+        for (int x = 0; x < n; ++x)
+        {
+            int i00 = x + y * (n + 1);
+            int i10 = i00 + 1;
+            int i01 = i00 + (n + 1);
+            int i11 = i01 + 1;
+            sim_indecies.insert(sim_indecies.end(), { i00, i10, i01, i01, i10, i11 });
+        }
+    }
+}
+
+// n x n instances, each moves the scene into one cell of an n x n grid over the NDC plane and tints it
+void genInstances(int n)
+{
+    sim_instances.assign(n * n, ShaderContext(&sim_instanceLayout));
+    for (int y = 0; y < n; ++y)
+    {
+        for (int x = 0; x < n; ++x)
+        {
+            float scale = 1.0f / (float)n;
+            ShaderContext& instance = sim_instances[x + y * n];
+            instance.v4f(SC_INSTANCE_TRANSFORM) = { scale, scale, ((float)x * 2.0f + 1.0f) * scale - 1.0f, ((float)y * 2.0f + 1.0f) * scale - 1.0f };
+            instance.v3f(SC_INSTANCE_TINT) = { 1.0f - (float)x / n, 0.5f + 0.5f * (float)y / n, 0.5f + 0.5f * (float)x / n };
+        }
+    }
+}
+
+// a quad with a mipmapped checkerboard repeated 8 times, sampled trilinearly
+// the mipmaps are generated on the threads of pThreadPool, or on the calling thread if it is null
+void genTexturedQuad(int textureSize, TextureLayout layout, TextureCompression compression = TEXTURE_COMPRESSION_NONE,
+    TexelFormat format = TEXEL_FORMAT_FLOAT, ThreadPool* pThreadPool = nullptr)
+{
+    sim_vertices.assign(4, ShaderContext(&sim_texturedLayout));
+    sim_vertices[0].v4f(SV_Position) = { -0.9f, -0.9f, 0.0f, 1.0f };
+    sim_vertices[1].v4f(SV_Position) = { -0.9f, 0.9f, 0.0f, 1.0f };
+    sim_vertices[2].v4f(SV_Position) = { 0.9f, -0.9f, 0.0f, 1.0f };
+    sim_vertices[3].v4f(SV_Position) = { 0.9f, 0.9f, 0.0f, 1.0f };
+    sim_vertices[0].v2f(SV_uv) = { 0.0f, 0.0f };
+    sim_vertices[1].v2f(SV_uv) = { 0.0f, 8.0f };
+    sim_vertices[2].v2f(SV_uv) = { 8.0f, 0.0f };
+    sim_vertices[3].v2f(SV_uv) = { 8.0f, 8.0f };
+    sim_indecies = { 0, 2, 1, 1, 2, 3 };
+
+    std::vector<Vec3f> texels(textureSize * textureSize);
+    for (int y = 0; y < textureSize; ++y)
+    {
+        for (int x = 0; x < textureSize; ++x)
+        {
+            bool white = ((x * 8 / textureSize) + (y * 8 / textureSize)) % 2 == 0;
+            texels[x + y * textureSize] = white ? Vec3f(1.0f, 1.0f, 1.0f) : Vec3f((float)x / textureSize, (float)y / textureSize, 0.25f);
+        }
+    }
+    MipmapOptions mipmapOptions;
+    mipmapOptions.pThreadPool = pThreadPool;
+    std::shared_ptr<Texture2D3F> texture = std::make_shared<Texture2D3F>(textureSize, textureSize, texels, -1, layout, mipmapOptions);
+    // compression encodes the packed texels
+    texture->pack(format);
+    texture->compress(compression);
+    uniforms->textures.clear();
+    uniforms->textures.push_back(texture);
+    Sampler2D<Vec3f> sampler;
+    sampler.setAddressMode(ADDRESS_MODE_REPEAT);
+    sampler.setFilterMode(FILTER_MODE_LINEAR, 1);
+    sampler.setMipMapMode(MIPMAP_MODE_LINEAR);
+    uniforms->sampler2D3F[0] = sampler;
+}
+
+// look at sim_mesh from the front (-z), far enough to see all of it, and fit the clipping planes to it
+void setMeshCamera(float aspect)
+{
+    Vec3f boundsMin, boundsMax;
+    if (!sim_mesh.getBounds(boundsMin, boundsMax))
+    {
+        boundsMin = boundsMax = Vec3f(0.0f, 0.0f, 0.0f);
+    }
+    Vec3f center = (boundsMin + boundsMax) * 0.5f;
+    float radius = std::max(Vector_length(boundsMax - boundsMin) * 0.5f, 1e-3f);
+    float distance = radius * 2.5f;
+    sim_pipelineState.near = radius * 0.1f;
+    sim_pipelineState.far = distance + radius * 2.0f;
+    Mat4x4f view = matrix_set_lookat(center - Vec3f(0.0f, 0.0f, distance), center, Vec3f(0.0f, 1.0f, 0.0f));
+    Mat4x4f projection = matrix_set_perspective(3.1415926f / 3.0f, aspect, sim_pipelineState.near, sim_pipelineState.far);
+    sim_meshTransform = view * projection;
+}
+
+// n x n copies of sim_mesh on the xz plane, the camera stands in the middle of them looking along +x
+// and sees as far as half the field, most copies are out of the view
+// with occluders, the copies of the column 2 cells ahead of the camera are stretched to a wall and set as occluders
+void genMeshField(int n, float aspect, bool occluders = false)
+{
+    Vec3f boundsMin, boundsMax;
+    if (!sim_mesh.getBounds(boundsMin, boundsMax))
+    {
+        boundsMin = boundsMax = Vec3f(0.0f, 0.0f, 0.0f);
+    }
+    float radius = std::max(Vector_length(boundsMax - boundsMin) * 0.5f, 1e-3f);
+    float spacing = radius * 3.0f;
+    sim_fieldSpacing = spacing;
+    Vec3f center = (boundsMin + boundsMax) * 0.5f;
+    std::shared_ptr<const ShaderUniform> material = uniforms;
+    int root = sim_scene.addNode(-1, matrix_set_identity());
+    sim_fieldTransforms.resize(n * n);
+    sim_fieldOccluders.assign(n * n, 0);
+    for (int z = 0; z < n; ++z)
+    {
+        for (int x = 0; x < n; ++x)
+        {
+            // the center of the mesh at the center of its cell, walls are 4 times as high and overlap along z
+            bool wall = occluders && x == n / 2 + 2;
+            Mat4x4f transform = matrix_set_translate(-center.x, -center.y, -center.z) *
+                (wall ? matrix_set_scale(1.0f, 4.0f, 3.0f) : matrix_set_identity()) *
+                matrix_set_translate((float)x * spacing, 0.0f, (float)z * spacing);
+            sim_fieldTransforms[x + z * n] = transform;
+            sim_fieldOccluders[x + z * n] = wall ? 1 : 0;
+            int node = sim_scene.addNode(root, transform);
+            sim_scene.setDrawable(node, &sim_mesh, &sim_meshVS, &sim_meshPS, material);
+            sim_scene.setOccluder(node, wall);
+        }
+    }
+    float half = (float)n * spacing * 0.5f;
+    Vec3f eye(half, radius * 2.0f, half);
+    sim_pipelineState.near = radius * 0.1f;
+    sim_pipelineState.far = half + radius * 2.0f;
+    sim_view = matrix_set_lookat(eye, eye + Vec3f(1.0f, -0.1f, 0.0f), Vec3f(0.0f, 1.0f, 0.0f));
+    sim_projection = matrix_set_perspective(3.1415926f / 3.0f, aspect, sim_pipelineState.near, sim_pipelineState.far);
+}
+
+// move every 4th copy of the field up and down by the frame, the BVH is refitted by sim_scene.update()
+void animateMeshField(int frame)
+{
+    for (int i = 0; i < (int)sim_fieldTransforms.size(); i += 4)
+    {
+        if (sim_fieldOccluders[i] != 0)
+        {
+            continue;
+        }
+        float lift = (float)sin((float)frame * 0.2f + (float)i) * sim_fieldSpacing * 0.25f;
+        sim_scene.setLocalTransform(i + 1, sim_fieldTransforms[i] * matrix_set_translate(0.0f, lift, 0.0f));
+    }
+}
+
 void initSimplePipeline()
 {
     sim_pipelineState.width = screenWidth;
@@ -109,8 +430,8 @@ void initSimplePipeline()
     genColorredQuad();
 
     simPipeline.setPipelineState(sim_pipelineState);
-    simPipeline.setVertexBuffer(sim_vertices);
-    simPipeline.setIndexBuffer(sim_indecies);
+    simPipeline.setVertexBuffer(VertexBufferView(sim_vertices));
+    simPipeline.setIndexBuffer(IndexBufferView(sim_indecies));
     simPipeline.setUniforms(uniforms);
     simPipeline.setShaders(&sim_vs, &sim_ps);
 }
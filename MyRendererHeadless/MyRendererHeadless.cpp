@@ -0,0 +1,822 @@
+// MyRendererHeadless.cpp : headless batch renderer, renders frames offscreen without any window
+//
+// usage :
+//   MyRendererHeadless [--scene quad|triangle|grid|textured|mesh] [--grid N] [--width W] [--height H]
+//                      [--mesh FILE] [--save-mesh FILE] [--objects N] [--occluders 0|1]
+//                      [--msaa 1|4|16] [--msaa-storage planar|interleaved|compressed]
+//                      [--resolve box|tent] [--depth-resolve min|max]
+//                      [--raster immediate|tiled] [--threads N] [--cull none|front|back]
+//                      [--shading forward|visibility] [--command-buffer 0|1] [--instances N]
+//                      [--frames N] [--format ppm|raw] [--output PATTERN]
+//                      [--scale N] [--upscale nearest|bilinear] [--srgb-output 0|1]
+//                      [--texture-layout linear|aligned|tiled4|tiled8|morton] [--texture-compression none|bc1]
+//                      [--texture-format FORMAT] [--color-format FORMAT] [--depth-format float|r16]
+//                      [--check-raster 0|1]
+//
+// FORMAT is float, rgba8, srgb8, rgb16f or r11g11b10f
+//
+// the mesh scene draws FILE, a Wavefront OBJ if it ends with .obj or else a binary mesh file which is mapped,
+// --save-mesh writes the loaded mesh as a binary mesh file. --objects N draws N x N copies of the mesh
+// through a Scene, which culls the copies out of the view and moves some of them every frame.
+// --occluders 1 stretches a row of the copies in front of the camera to a wall, the copies hidden by it are not drawn.
+//
+// --instances N draws N x N instances of the quad, triangle or grid scene in one instanced draw,
+// each instance is moved into one cell of an N x N grid and tinted.
+//
+// PATTERN is a printf style file name which takes the frame index, e.g. "frame_%04d.ppm",
+// or "-" to write all frames to stdout. without --output frames are rendered but not written.
+// frame times are reported to stderr, so stdout can be piped when writing frames to it.
+// frames are (W * N) x (H * N) pixels with --scale N.
+//
+// --check-raster 1 renders the first frame of the scene in immediate raster on one thread and in tiled raster
+// on --threads threads, with msaa 1, 4 and 16 and both shading modes, at W x H and at 131 x 77 whose tiles
+// are cut by the edges of the render target, and exits with 1 if any of the outputs are not the same.
+//
+// on Linux, build with the Makefile next to this file, make check runs --check-raster
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Pipeline.h"
+#include "simplePipeline.h"
+
+enum OutputFormat
+{
+    OUTPUT_FORMAT_PPM,
+    OUTPUT_FORMAT_RAW,
+};
+
+struct HeadlessOptions
+{
+    std::string scene = "quad";
+    int gridSize = 64;
+    // the mesh scene, .obj or a binary mesh file
+    std::string meshPath;
+    std::string saveMeshPath;
+    // N x N copies of the mesh in a scene, 0 : draw the mesh once
+    int objects = 0;
+    // a wall of occluders in the copies
+    bool occluders = false;
+    int width = 1920;
+    int height = 1080;
+    int msaa = 1;
+    MSAAStorage msaaStorage = MSAA_STORAGE_COMPRESSED;
+    ResolveFilter resolveFilter = RESOLVE_FILTER_BOX;
+    DepthResolve depthResolve = DEPTH_RESOLVE_MIN;
+    RasterMode rasterMode = RASTER_MODE_IMMEDIATE;
+    ShadingMode shadingMode = SHADING_MODE_FORWARD;
+    // 0 : one thread per hardware thread
+    int threads = 0;
+    CullMode cullMode = CULL_MODE_NONE;
+    // layout of the texture of the textured scene
+    TextureLayout textureLayout = TEXTURE_LAYOUT_LINEAR;
+    TextureCompression textureCompression = TEXTURE_COMPRESSION_NONE;
+    TexelFormat textureFormat = TEXEL_FORMAT_FLOAT;
+    // storage of the render targets
+    TexelFormat colorFormat = TEXEL_FORMAT_FLOAT;
+    TexelFormat depthFormat = TEXEL_FORMAT_FLOAT;
+    int frames = 1;
+    // record the frame in a command buffer once and submit it every frame
+    bool commandBuffer = false;
+    // N x N instances of the colorred scenes, 0 : draw without instancing
+    int instances = 0;
+    OutputFormat format = OUTPUT_FORMAT_PPM;
+    // upscale of the written frames, and sRGB encoding of the linear colors
+    int scale = 1;
+    UpscaleFilter upscaleFilter = UPSCALE_FILTER_NEAREST;
+    bool srgbOutput = false;
+    // empty : don't write frames, "-" : write frames to stdout
+    std::string output;
+    // compare immediate and tiled raster instead of rendering frames
+    bool checkRaster = false;
+};
+
+static void printUsage(const char* name)
+{
+    fprintf(stderr,
+        "usage: %s [--scene quad|triangle|grid|textured|mesh] [--grid N] [--width W] [--height H]\n"
+        "          [--mesh FILE] [--save-mesh FILE] [--objects N] [--occluders 0|1]\n"
+        "          [--msaa 1|4|16] [--msaa-storage planar|interleaved|compressed]\n"
+        "          [--resolve box|tent] [--depth-resolve min|max]\n"
+        "          [--raster immediate|tiled] [--threads N] [--cull none|front|back]\n"
+        "          [--shading forward|visibility] [--command-buffer 0|1] [--instances N]\n"
+        "          [--frames N] [--format ppm|raw] [--output PATTERN|-]\n"
+        "          [--scale N] [--upscale nearest|bilinear] [--srgb-output 0|1]\n"
+        "          [--texture-layout linear|aligned|tiled4|tiled8|morton] [--texture-compression none|bc1]\n"
+        "          [--texture-format FORMAT] [--color-format FORMAT] [--depth-format float|r16]\n"
+        "          [--check-raster 0|1]\n"
+        "FORMAT is float, rgba8, srgb8, rgb16f or r11g11b10f\n",
+        name);
+}
+
+// formats of 3 channels
+static bool parseColorFormat(const char* value, TexelFormat& format)
+{
+    if (strcmp(value, "float") == 0)
+    {
+        format = TEXEL_FORMAT_FLOAT;
+    }
+    else if (strcmp(value, "rgba8") == 0)
+    {
+        format = TEXEL_FORMAT_RGBA8_UNORM;
+    }
+    else if (strcmp(value, "srgb8") == 0)
+    {
+        format = TEXEL_FORMAT_RGBA8_SRGB;
+    }
+    else if (strcmp(value, "rgb16f") == 0)
+    {
+        format = TEXEL_FORMAT_RGB16F;
+    }
+    else if (strcmp(value, "r11g11b10f") == 0)
+    {
+        format = TEXEL_FORMAT_R11G11B10F;
+    }
+    else
+    {
+        fprintf(stderr, "unknown format %s\n", value);
+        return false;
+    }
+    return true;
+}
+
+static bool parseOptions(int argc, char** argv, HeadlessOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            return false;
+        }
+        // all the other options take one value
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--scene")
+        {
+            options.scene = value;
+        }
+        else if (arg == "--grid")
+        {
+            options.gridSize = atoi(value);
+        }
+        else if (arg == "--mesh")
+        {
+            options.meshPath = value;
+        }
+        else if (arg == "--save-mesh")
+        {
+            options.saveMeshPath = value;
+        }
+        else if (arg == "--objects")
+        {
+            options.objects = atoi(value);
+        }
+        else if (arg == "--occluders")
+        {
+            options.occluders = atoi(value) != 0;
+        }
+        else if (arg == "--width")
+        {
+            options.width = atoi(value);
+        }
+        else if (arg == "--height")
+        {
+            options.height = atoi(value);
+        }
+        else if (arg == "--msaa")
+        {
+            options.msaa = atoi(value);
+        }
+        else if (arg == "--msaa-storage")
+        {
+            if (strcmp(value, "planar") == 0)
+            {
+                options.msaaStorage = MSAA_STORAGE_PLANAR;
+            }
+            else if (strcmp(value, "interleaved") == 0)
+            {
+                options.msaaStorage = MSAA_STORAGE_INTERLEAVED;
+            }
+            else if (strcmp(value, "compressed") == 0)
+            {
+                options.msaaStorage = MSAA_STORAGE_COMPRESSED;
+            }
+            else
+            {
+                fprintf(stderr, "unknown msaa storage %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--resolve")
+        {
+            if (strcmp(value, "box") == 0)
+            {
+                options.resolveFilter = RESOLVE_FILTER_BOX;
+            }
+            else if (strcmp(value, "tent") == 0)
+            {
+                options.resolveFilter = RESOLVE_FILTER_TENT;
+            }
+            else
+            {
+                fprintf(stderr, "unknown resolve filter %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--depth-resolve")
+        {
+            if (strcmp(value, "min") == 0)
+            {
+                options.depthResolve = DEPTH_RESOLVE_MIN;
+            }
+            else if (strcmp(value, "max") == 0)
+            {
+                options.depthResolve = DEPTH_RESOLVE_MAX;
+            }
+            else
+            {
+                fprintf(stderr, "unknown depth resolve %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--shading")
+        {
+            if (strcmp(value, "forward") == 0)
+            {
+                options.shadingMode = SHADING_MODE_FORWARD;
+            }
+            else if (strcmp(value, "visibility") == 0)
+            {
+                options.shadingMode = SHADING_MODE_VISIBILITY_BUFFER;
+            }
+            else
+            {
+                fprintf(stderr, "unknown shading mode %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--raster")
+        {
+            if (strcmp(value, "immediate") == 0)
+            {
+                options.rasterMode = RASTER_MODE_IMMEDIATE;
+            }
+            else if (strcmp(value, "tiled") == 0)
+            {
+                options.rasterMode = RASTER_MODE_TILED;
+            }
+            else
+            {
+                fprintf(stderr, "unknown raster mode %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--threads")
+        {
+            options.threads = atoi(value);
+        }
+        else if (arg == "--cull")
+        {
+            if (strcmp(value, "none") == 0)
+            {
+                options.cullMode = CULL_MODE_NONE;
+            }
+            else if (strcmp(value, "front") == 0)
+            {
+                options.cullMode = CULL_MODE_FRONT;
+            }
+            else if (strcmp(value, "back") == 0)
+            {
+                options.cullMode = CULL_MODE_BACK;
+            }
+            else
+            {
+                fprintf(stderr, "unknown cull mode %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--texture-layout")
+        {
+            if (strcmp(value, "linear") == 0)
+            {
+                options.textureLayout = TEXTURE_LAYOUT_LINEAR;
+            }
+            else if (strcmp(value, "aligned") == 0)
+            {
+                options.textureLayout = TEXTURE_LAYOUT_LINEAR_ALIGNED;
+            }
+            else if (strcmp(value, "tiled4") == 0)
+            {
+                options.textureLayout = TEXTURE_LAYOUT_TILED_4X4;
+            }
+            else if (strcmp(value, "tiled8") == 0)
+            {
+                options.textureLayout = TEXTURE_LAYOUT_TILED_8X8;
+            }
+            else if (strcmp(value, "morton") == 0)
+            {
+                options.textureLayout = TEXTURE_LAYOUT_MORTON;
+            }
+            else
+            {
+                fprintf(stderr, "unknown texture layout %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--texture-compression")
+        {
+            // the texture is RGB, BC4 and BC5 would drop channels
+            if (strcmp(value, "none") == 0)
+            {
+                options.textureCompression = TEXTURE_COMPRESSION_NONE;
+            }
+            else if (strcmp(value, "bc1") == 0)
+            {
+                options.textureCompression = TEXTURE_COMPRESSION_BC1;
+            }
+            else
+            {
+                fprintf(stderr, "unknown texture compression %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--texture-format")
+        {
+            if (!parseColorFormat(value, options.textureFormat))
+            {
+                return false;
+            }
+        }
+        else if (arg == "--color-format")
+        {
+            if (!parseColorFormat(value, options.colorFormat))
+            {
+                return false;
+            }
+        }
+        else if (arg == "--depth-format")
+        {
+            if (strcmp(value, "float") == 0)
+            {
+                options.depthFormat = TEXEL_FORMAT_FLOAT;
+            }
+            else if (strcmp(value, "r16") == 0)
+            {
+                options.depthFormat = TEXEL_FORMAT_R16_UNORM;
+            }
+            else
+            {
+                fprintf(stderr, "unknown depth format %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--frames")
+        {
+            options.frames = atoi(value);
+        }
+        else if (arg == "--command-buffer")
+        {
+            options.commandBuffer = atoi(value) != 0;
+        }
+        else if (arg == "--instances")
+        {
+            options.instances = atoi(value);
+        }
+        else if (arg == "--format")
+        {
+            if (strcmp(value, "ppm") == 0)
+            {
+                options.format = OUTPUT_FORMAT_PPM;
+            }
+            else if (strcmp(value, "raw") == 0)
+            {
+                options.format = OUTPUT_FORMAT_RAW;
+            }
+            else
+            {
+                fprintf(stderr, "unknown format %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--scale")
+        {
+            options.scale = atoi(value);
+        }
+        else if (arg == "--upscale")
+        {
+            if (strcmp(value, "nearest") == 0)
+            {
+                options.upscaleFilter = UPSCALE_FILTER_NEAREST;
+            }
+            else if (strcmp(value, "bilinear") == 0)
+            {
+                options.upscaleFilter = UPSCALE_FILTER_BILINEAR;
+            }
+            else
+            {
+                fprintf(stderr, "unknown upscale filter %s\n", value);
+                return false;
+            }
+        }
+        else if (arg == "--srgb-output")
+        {
+            options.srgbOutput = atoi(value) != 0;
+        }
+        else if (arg == "--output")
+        {
+            options.output = value;
+        }
+        else if (arg == "--check-raster")
+        {
+            options.checkRaster = atoi(value) != 0;
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (options.width <= 0 || options.height <= 0 || options.frames <= 0 || options.gridSize <= 0 || options.scale <= 0)
+    {
+        fprintf(stderr, "width, height, frames, grid and scale must be positive\n");
+        return false;
+    }
+    if (options.threads < 0 || options.instances < 0 || options.objects < 0)
+    {
+        fprintf(stderr, "threads, instances and objects can't be negative\n");
+        return false;
+    }
+    if (options.objects > 0 && (options.scene != "mesh" || options.commandBuffer))
+    {
+        fprintf(stderr, "--objects needs the mesh scene, and draws without a command buffer\n");
+        return false;
+    }
+    if (options.msaa != 1 && options.msaa != 4 && options.msaa != 16)
+    {
+        fprintf(stderr, "msaa must be 1, 4 or 16\n");
+        return false;
+    }
+    return true;
+}
+
+static bool endsWith(const std::string& s, const char* suffix)
+{
+    size_t length = strlen(suffix);
+    return s.size() >= length && s.compare(s.size() - length, length, suffix) == 0;
+}
+
+static bool loadMesh(const HeadlessOptions& options)
+{
+    if (options.meshPath.empty())
+    {
+        fprintf(stderr, "the mesh scene needs --mesh\n");
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool obj = endsWith(options.meshPath, ".obj") || endsWith(options.meshPath, ".OBJ");
+    if (!(obj ? importObj(options.meshPath.c_str(), sim_mesh) : mapMesh(options.meshPath.c_str(), sim_mesh)))
+    {
+        fprintf(stderr, "can't load mesh %s\n", options.meshPath.c_str());
+        return false;
+    }
+    auto end = std::chrono::steady_clock::now();
+    fprintf(stderr, "%s %s in %.3f ms, %d vertices, %d triangles\n", obj ? "imported" : "mapped", options.meshPath.c_str(),
+        std::chrono::duration<double, std::milli>(end - start).count(), sim_mesh.getVertexCount(), sim_mesh.getIndexCount() / 3);
+    if (!options.saveMeshPath.empty() && !saveMesh(options.saveMeshPath.c_str(), sim_mesh))
+    {
+        fprintf(stderr, "can't save mesh %s\n", options.saveMeshPath.c_str());
+        return false;
+    }
+    if (options.objects > 0)
+    {
+        genMeshField(options.objects, (float)options.width / (float)options.height, options.occluders);
+    }
+    else
+    {
+        setMeshCamera((float)options.width / (float)options.height);
+    }
+    return true;
+}
+
+static bool genScene(const HeadlessOptions& options)
+{
+    if (options.scene == "quad")
+    {
+        genColorredQuad();
+    }
+    else if (options.scene == "triangle")
+    {
+        genColorredTriangle();
+    }
+    else if (options.scene == "grid")
+    {
+        genColorredGrid(options.gridSize);
+    }
+    else if (options.scene == "textured")
+    {
+        // the mipmaps are generated on the threads of the pipeline
+        ThreadPool* pThreadPool = simPipeline.getThreadPool();
+        auto start = std::chrono::steady_clock::now();
+        genTexturedQuad(256, options.textureLayout, options.textureCompression, options.textureFormat, pThreadPool);
+        auto end = std::chrono::steady_clock::now();
+        fprintf(stderr, "generated the texture in %.3f ms on %d threads\n",
+            std::chrono::duration<double, std::milli>(end - start).count(), pThreadPool ? pThreadPool->getThreadCount() : 1);
+    }
+    else if (options.scene == "mesh")
+    {
+        return loadMesh(options);
+    }
+    else
+    {
+        fprintf(stderr, "unknown scene %s\n", options.scene.c_str());
+        return false;
+    }
+    if (options.instances > 0)
+    {
+        if (options.scene == "textured")
+        {
+            fprintf(stderr, "--instances needs the quad, triangle or grid scene\n");
+            return false;
+        }
+        genInstances(options.instances);
+    }
+    return true;
+}
+
+static bool writeFrame(FILE* file, const HeadlessOptions& options, const uint8_t* rgb)
+{
+    if (options.format == OUTPUT_FORMAT_PPM)
+    {
+        fprintf(file, "P6\n%d %d\n255\n", options.width * options.scale, options.height * options.scale);
+    }
+    size_t size = (size_t)options.width * options.height * options.scale * options.scale * 3;
+    return fwrite(rgb, 1, size, file) == size;
+}
+
+static bool outputFrame(const HeadlessOptions& options, int frame, const uint8_t* rgb)
+{
+    if (options.output == "-")
+    {
+        return writeFrame(stdout, options, rgb);
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), options.output.c_str(), frame);
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+        return false;
+    }
+    bool ok = writeFrame(file, options, rgb);
+    fclose(file);
+    return ok;
+}
+
+// bind the buffers and shaders of the scene to simPipeline
+static void bindScene(const HeadlessOptions& options)
+{
+    simPipeline.setVertexBuffer(VertexBufferView(sim_vertices));
+    simPipeline.setIndexBuffer(IndexBufferView(sim_indecies));
+    simPipeline.setUniforms(uniforms);
+    if (options.scene == "textured")
+    {
+        simPipeline.setShaders(&sim_texturedVS, &sim_texturedPS);
+    }
+    else if (options.scene == "mesh")
+    {
+        simPipeline.setMesh(&sim_mesh);
+        simPipeline.setShaders(&sim_meshVS, &sim_meshPS);
+        simPipeline.setDrawTransform(sim_meshTransform);
+    }
+    else if (options.instances > 0)
+    {
+        simPipeline.setInstanceBuffer(VertexBufferView(sim_instances));
+        simPipeline.setShaders(&sim_instancedVS, &sim_ps);
+    }
+    else
+    {
+        simPipeline.setShaders(&sim_vs, &sim_ps);
+    }
+}
+
+// draw a frame of the scene with the bound state, without a command buffer
+static void drawFrame(const HeadlessOptions& options, int frame, uint8_t* rgb, const FrameOutputOptions& outputOptions)
+{
+    simPipeline.clearRenderTarget({ 0.0f, 0.0f, 0.0f }, 1.0f);
+    if (options.objects > 0)
+    {
+        animateMeshField(frame);
+        sim_scene.update();
+        sim_scene.draw(simPipeline, sim_view, sim_projection);
+    }
+    else if (options.instances > 0)
+    {
+        simPipeline.renderToTargetInstanced((int)sim_instances.size());
+    }
+    else
+    {
+        simPipeline.renderToTarget();
+    }
+    simPipeline.presentToScreen(rgb, outputOptions);
+}
+
+// the binned raster on many threads must give the same output as the immediate one on one thread
+static bool checkRaster(const HeadlessOptions& options)
+{
+    const int sizes[2][2] = { { options.width, options.height }, { 131, 77 } };
+    const int msaaCounts[3] = { 1, 4, 16 };
+    const ShadingMode shadingModes[2] = { SHADING_MODE_FORWARD, SHADING_MODE_VISIBILITY_BUFFER };
+    FrameOutputOptions outputOptions;
+    outputOptions.format = PIXEL_FORMAT_RGB8;
+    std::vector<uint8_t> immediate, tiled;
+    int failures = 0;
+    for (const auto& size : sizes)
+    {
+        for (int msaa : msaaCounts)
+        {
+            for (ShadingMode shadingMode : shadingModes)
+            {
+                PipelineState state = sim_pipelineState;
+                state.width = size[0];
+                state.height = size[1];
+                setMSAAState(msaa);
+                state.msCount = sim_pipelineState.msCount;
+                state.sampleCoords = sim_pipelineState.sampleCoords;
+                state.shadingMode = shadingMode;
+                immediate.resize((size_t)state.width * state.height * 3);
+                tiled.resize(immediate.size());
+                state.rasterMode = RASTER_MODE_IMMEDIATE;
+                state.threadCount = 1;
+                simPipeline.setPipelineState(state);
+                bindScene(options);
+                drawFrame(options, 0, immediate.data(), outputOptions);
+                state.rasterMode = RASTER_MODE_TILED;
+                state.threadCount = options.threads;
+                simPipeline.setPipelineState(state);
+                bindScene(options);
+                drawFrame(options, 0, tiled.data(), outputOptions);
+                bool same = immediate == tiled;
+                failures += same ? 0 : 1;
+                fprintf(stderr, "%dx%d, msaa %d, %s shading : %s\n", state.width, state.height, msaa,
+                    shadingMode == SHADING_MODE_FORWARD ? "forward" : "visibility", same ? "same" : "DIFFERENT");
+            }
+        }
+    }
+    fprintf(stderr, "raster check %s\n", failures == 0 ? "passed" : "failed");
+    return failures == 0;
+}
+
+int main(int argc, char** argv)
+{
+    HeadlessOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    sim_pipelineState.width = options.width;
+    sim_pipelineState.height = options.height;
+    setMSAAState(options.msaa);
+    sim_pipelineState.msaaStorage = options.msaaStorage;
+    sim_pipelineState.resolveFilter = options.resolveFilter;
+    sim_pipelineState.depthResolve = options.depthResolve;
+    sim_pipelineState.rasterMode = options.rasterMode;
+    sim_pipelineState.shadingMode = options.shadingMode;
+    sim_pipelineState.threadCount = options.threads;
+    sim_pipelineState.cullMode = options.cullMode;
+    sim_pipelineState.colorFormat = options.colorFormat;
+    sim_pipelineState.depthFormat = options.depthFormat;
+
+    // the scene builds its resources on the threads of the pipeline, then may fit the clipping planes to it
+    simPipeline.setPipelineState(sim_pipelineState);
+    if (!genScene(options))
+    {
+        return 1;
+    }
+    simPipeline.setPipelineState(sim_pipelineState);
+    bindScene(options);
+    if (options.checkRaster)
+    {
+        return checkRaster(options) ? 0 : 1;
+    }
+
+    // the render target is bottom-up, frames are written as RGB and top-down
+    FrameOutputOptions outputOptions;
+    outputOptions.format = PIXEL_FORMAT_RGB8;
+    outputOptions.flipY = true;
+    outputOptions.scale = options.scale;
+    outputOptions.filter = options.upscaleFilter;
+    outputOptions.srgb = options.srgbOutput;
+    std::vector<uint8_t> rgb((size_t)options.width * options.height * options.scale * options.scale * 3);
+
+    fprintf(stderr, "scene %s, %d triangles, %d instances, %dx%d, msaa %d, %s raster, %d frames\n",
+        options.scene.c_str(), options.scene == "mesh" ? sim_mesh.getIndexCount() / 3 : (int)sim_indecies.size() / 3,
+        std::max((int)sim_instances.size(), 1), options.width, options.height, options.msaa,
+        options.rasterMode == RASTER_MODE_TILED ? "tiled" : "immediate", options.frames);
+
+    CommandBuffer commands;
+    if (options.commandBuffer)
+    {
+        commands.begin();
+        commands.setPipelineState(sim_pipelineState);
+        if (options.scene == "mesh")
+        {
+            commands.setShaders(&sim_meshVS, &sim_meshPS);
+            commands.setVertexBuffer(sim_mesh.getVertexBufferView());
+            commands.setIndexBuffer(sim_mesh.getIndexBufferView());
+            commands.setDrawTransform(sim_meshTransform);
+        }
+        else if (options.instances > 0)
+        {
+            commands.setShaders(&sim_instancedVS, &sim_ps);
+            commands.setVertexBuffer(VertexBufferView(sim_vertices));
+            commands.setIndexBuffer(IndexBufferView(sim_indecies));
+            commands.setInstanceBuffer(VertexBufferView(sim_instances));
+        }
+        else
+        {
+            commands.setShaders(options.scene == "textured" ? (VertexShader*)&sim_texturedVS : &sim_vs,
+                options.scene == "textured" ? (PixelShader*)&sim_texturedPS : &sim_ps);
+            commands.setVertexBuffer(VertexBufferView(sim_vertices));
+            commands.setIndexBuffer(IndexBufferView(sim_indecies));
+        }
+        commands.setUniforms(uniforms);
+        commands.clearRenderTarget({ 0.0f, 0.0f, 0.0f }, 1.0f);
+        if (options.instances > 0)
+        {
+            commands.drawInstanced((int)sim_instances.size());
+        }
+        else
+        {
+            commands.draw();
+        }
+        commands.present(rgb.data(), outputOptions);
+        if (!commands.end())
+        {
+            fprintf(stderr, "invalid command buffer : %s\n", commands.getError().c_str());
+            return 1;
+        }
+    }
+
+    double totalMs = 0.0;
+    double minMs = 0.0;
+    double maxMs = 0.0;
+    for (int frame = 0; frame < options.frames; ++frame)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (options.commandBuffer)
+        {
+            simPipeline.submit(commands);
+        }
+        else
+        {
+            drawFrame(options, frame, rgb.data(), outputOptions);
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        totalMs += ms;
+        minMs = frame == 0 ? ms : std::min(minMs, ms);
+        maxMs = frame == 0 ? ms : std::max(maxMs, ms);
+        fprintf(stderr, "frame %d: %.3f ms\n", frame, ms);
+
+        // writing frames is not part of the frame time
+        if (!options.output.empty())
+        {
+            if (!outputFrame(options, frame, rgb.data()))
+            {
+                fprintf(stderr, "failed to write frame %d\n", frame);
+                return 1;
+            }
+        }
+    }
+
+    if (options.objects > 0)
+    {
+        const SceneStatistics& sceneStatistics = sim_scene.getStatistics();
+        fprintf(stderr, "scene: %d of %d objects visible, %d occluded, %d bvh nodes tested, %d refitted\n", sceneStatistics.objectsVisible,
+            sceneStatistics.objects, sceneStatistics.objectsOccluded, sceneStatistics.nodesTested, sceneStatistics.nodesRefitted);
+    }
+    // counters of the last draw
+    const PipelineStatistics& statistics = simPipeline.getStatistics();
+    fprintf(stderr, "vertex cache: %llu hits, %llu misses\n",
+        (unsigned long long)statistics.vertexCacheHits, (unsigned long long)statistics.vertexCacheMisses);
+    fprintf(stderr, "triangles: %llu in, culled %llu clipping, %llu facing, %llu zero area, %llu sub-sample, %llu rasterized\n",
+        (unsigned long long)statistics.trianglesInput, (unsigned long long)statistics.trianglesCulledClipping,
+        (unsigned long long)statistics.trianglesCulledFacing, (unsigned long long)statistics.trianglesCulledZeroArea,
+        (unsigned long long)statistics.trianglesCulledSubSample, (unsigned long long)statistics.trianglesRasterized);
+
+    double avgMs = totalMs / options.frames;
+    fprintf(stderr, "avg %.3f ms, min %.3f ms, max %.3f ms, %.2f fps\n",
+        avgMs, minMs, maxMs, avgMs > 0.0 ? 1000.0 / avgMs : 0.0);
+    return 0;
+}